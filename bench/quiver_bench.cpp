@@ -0,0 +1,327 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <exception>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <getopt.hpp>
+
+#include "plot.hpp"
+#include "profile.hpp"
+#include "spec.hpp"
+
+
+constexpr std::size_t min_arrow_count     = 1000;
+constexpr std::size_t default_arrow_count = 1000000;
+constexpr int         default_repeats     = 3;
+constexpr double      view_radius         = 2;
+constexpr double      pixels_per_length   = 250;
+constexpr double      pi                  = 3.141592653589793;
+
+char const* const field_names[] = {"grid", "swirl", "random", "colors"};
+
+
+struct bench_options
+{
+    bool                     help = false;
+    std::size_t              max_arrows = default_arrow_count;
+    int                      repeats = default_repeats;
+    int                      threads = 1;
+    std::string              format = "png";
+    std::vector<std::string> fields;
+};
+
+
+// Best time of a phase over repeated runs, with the amount of data it
+// processed.
+struct phase_result
+{
+    std::string name;
+    double      seconds = std::numeric_limits<double>::infinity();
+    std::size_t bytes = 0;
+};
+
+
+static void          show_usage();
+static bench_options parse_options(int argc, char** argv);
+static std::size_t   parse_size(std::string const& str);
+static void          run_benchmark(std::string const& field, std::size_t count, bench_options const& options);
+static std::string   make_spec(std::string const& field, std::size_t count);
+static void          write_arrow(std::ostream& out, double x, double y, double dx, double dy);
+static void          report(std::string const& field, std::size_t count, std::vector<phase_result> const& phases);
+
+
+int
+main(int argc, char** argv)
+{
+    try {
+        bench_options options;
+
+        try {
+            options = parse_options(argc, argv);
+        } catch (std::exception const& err) {
+            std::cerr << "error: " << err.what() << '\n';
+            show_usage();
+            return 1;
+        }
+
+        if (options.help) {
+            show_usage();
+            return 0;
+        }
+
+        for (auto const& field : options.fields) {
+            for (auto count = min_arrow_count; count <= options.max_arrows; count *= 10) {
+                run_benchmark(field, count, options);
+            }
+        }
+    } catch (std::exception const& err) {
+        std::cerr << "error: " << err.what() << '\n';
+        return 1;
+    }
+
+    return 0;
+}
+
+
+void
+show_usage()
+{
+    std::string const usage =
+        "usage: quiver_bench [-h] [-n arrows] [-r repeats] [-j threads] [-f format] [field ...]\n"
+        "\n"
+        "  field       Synthetic field to plot: grid, swirl, random or colors.\n"
+        "              All fields are run if none is given.\n"
+        "\n"
+        "options:\n"
+        "  -n arrows   Largest number of arrows (default 1000000). Sizes\n"
+        "              from 1000 up to this are run in steps of 10x\n"
+        "  -r repeats  Number of runs per size; the fastest is reported\n"
+        "  -j threads  Number of rendering threads (0 uses all cores)\n"
+        "  -f format   Output image format (default png)\n"
+        "  -h          Print this help message and exit\n"
+        "\n"
+        "Results are written to stdout as one JSON object per line.\n"
+        "\n";
+    std::cerr << usage;
+}
+
+
+bench_options
+parse_options(int argc, char** argv)
+{
+    bench_options options;
+    cxx::getopt getopt;
+
+    for (int ch; (ch = getopt(argc, argv, "hn:r:j:f:")) != -1; ) {
+        switch (ch) {
+        case 'h':
+            options.help = true;
+            return options;
+
+        case 'n':
+            options.max_arrows = parse_size(getopt.optarg);
+            break;
+
+        case 'r':
+            options.repeats = int(std::max(parse_size(getopt.optarg), std::size_t(1)));
+            break;
+
+        case 'j':
+            options.threads = int(parse_size(getopt.optarg));
+            break;
+
+        case 'f':
+            options.format = getopt.optarg;
+            break;
+
+        default:
+            throw std::runtime_error{"unrecognized command-line option"};
+        }
+    }
+
+    for (int i = getopt.optind; i < argc; i++) {
+        auto const known = std::find(std::begin(field_names), std::end(field_names), std::string{argv[i]});
+        if (known == std::end(field_names)) {
+            throw std::runtime_error{"unknown field: " + std::string{argv[i]}};
+        }
+        options.fields.push_back(argv[i]);
+    }
+
+    if (options.fields.empty()) {
+        options.fields.assign(std::begin(field_names), std::end(field_names));
+    }
+
+    return options;
+}
+
+
+std::size_t
+parse_size(std::string const& str)
+{
+    std::size_t end;
+    unsigned long long value = 0;
+    try {
+        value = std::stoull(str, &end);
+    } catch (std::exception const&) {
+        end = 0;
+    }
+    if (end != str.size() || str.empty() || str[0] == '-') {
+        throw std::runtime_error{"invalid number: " + str};
+    }
+    return std::size_t(value);
+}
+
+
+// Times parsing, data range estimation, drawing and encoding of a synthetic
+// spec. The plot range is left for quiver to compute so that the range phase
+// is exercised, and the image is encoded in memory so that disk speed does
+// not count.
+void
+run_benchmark(std::string const& field, std::size_t count, bench_options const& options)
+{
+    auto const json = make_spec(field, count);
+
+    std::vector<phase_result> phases = {{"parse"}, {"range"}, {"draw"}, {"encode"}};
+    phases[0].bytes = json.size();
+
+    plot_session session;
+    plot_profile profile;
+    session.set_profile(&profile);
+
+    for (int run = 0; run < options.repeats; run++) {
+        auto const start = std::chrono::steady_clock::now();
+        auto spec = parse_quiver_spec(json);
+        auto const parse_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        spec.rendering.threads = options.threads;
+        spec.rendering.format = options.format;
+
+        profile.clear();
+        auto const image = session.encode(spec);
+
+        auto const wall_seconds = [&](char const* phase) {
+            return profile.get(phase).wall_seconds;
+        };
+        auto const draw_seconds = wall_seconds("background") + wall_seconds("arrows") + wall_seconds("flush");
+
+        phases[0].seconds = std::min(phases[0].seconds, parse_seconds);
+        phases[1].seconds = std::min(phases[1].seconds, wall_seconds("range"));
+        phases[2].seconds = std::min(phases[2].seconds, draw_seconds);
+        phases[3].seconds = std::min(phases[3].seconds, wall_seconds("encode"));
+        phases[3].bytes = image.size();
+    }
+
+    report(field, count, phases);
+}
+
+
+// Generates the JSON text of a spec with the given number of arrows. Fields
+// cover a square of side 2 * view_radius:
+//
+// - grid:   arrows on a regular grid showing a smooth periodic flow
+// - swirl:  random arrows in a vortex, colored by position, as sample_2
+// - random: arrows with random position and direction and default style
+// - colors: random arrows each with its own color, width and aspect ratio
+//
+std::string
+make_spec(std::string const& field, std::size_t count)
+{
+    std::mt19937_64 random{0};
+    std::uniform_real_distribution<double> coordinate{-view_radius, view_radius};
+    std::uniform_real_distribution<double> unit{0, 1};
+
+    std::ostringstream out;
+    out.precision(9);
+
+    out << R"({"rendering": {"pixels_per_length": )" << pixels_per_length << "}, ";
+    if (field == "swirl") {
+        out << R"("style": {"background_color": [0, 0, 0], "stem_to_shaft_ratio": 5}, )";
+    } else {
+        out << R"("style": {"background_color": [1, 1, 1]}, )";
+    }
+    out << R"("arrows": [)";
+
+    auto const side = std::size_t(std::ceil(std::sqrt(double(count))));
+    auto const spacing = 2 * view_radius / double(side);
+
+    for (std::size_t i = 0; i < count; i++) {
+        if (i > 0) {
+            out << ", ";
+        }
+
+        if (field == "grid") {
+            auto const x = -view_radius + spacing * (double(i % side) + 0.5);
+            auto const y = -view_radius + spacing * (double(i / side) + 0.5);
+            write_arrow(out, x, y, 0.8 * spacing * std::sin(2 * y), 0.8 * spacing * std::cos(2 * x));
+            out << "}";
+        } else if (field == "swirl") {
+            auto const x = coordinate(random);
+            auto const y = coordinate(random);
+            auto const r = std::hypot(x, y);
+            auto const phase = std::atan2(y, x) + 0.5;
+            auto const v = 0.01 + std::sqrt(0.001 * r);
+            auto const s = (view_radius + x) / (2 * view_radius);
+            auto const t = (view_radius + y) / (2 * view_radius);
+
+            write_arrow(out, x, y, v * std::sin(phase), -v * std::cos(phase));
+            out << R"(, "w": )" << 0.1 * v;
+            out << R"(, "c": [)" << 0.5 + 0.5 * s << ", " << 1 - 0.5 * t << ", " << 0.5 + 0.5 * t << "]}";
+        } else if (field == "random") {
+            auto const angle = 2 * pi * unit(random);
+            write_arrow(out, coordinate(random), coordinate(random), 0.02 * std::cos(angle), 0.02 * std::sin(angle));
+            out << "}";
+        } else {
+            auto const angle = 2 * pi * unit(random);
+            write_arrow(out, coordinate(random), coordinate(random), 0.02 * std::cos(angle), 0.02 * std::sin(angle));
+            out << R"(, "w": )" << 0.002 + 0.004 * unit(random);
+            out << R"(, "a": )" << 1 + unit(random);
+            out << R"(, "c": [)" << unit(random) << ", " << unit(random) << ", " << unit(random) << ", " << 0.5 + 0.5 * unit(random) << "]}";
+        }
+    }
+
+    out << "]}";
+    return out.str();
+}
+
+
+// Writes the required keys of an arrow, leaving the object open.
+void
+write_arrow(std::ostream& out, double x, double y, double dx, double dy)
+{
+    out << R"({"x": )" << x << R"(, "y": )" << y << R"(, "dx": )" << dx << R"(, "dy": )" << dy;
+}
+
+
+void
+report(std::string const& field, std::size_t count, std::vector<phase_result> const& phases)
+{
+    std::cout << R"({"field": ")" << field << R"(", "arrows": )" << count << R"(, "phases": {)";
+
+    for (std::size_t i = 0; i < phases.size(); i++) {
+        auto const& phase = phases[i];
+        auto const rate = [&](double amount) {
+            return phase.seconds > 0 ? amount / phase.seconds : 0.0;
+        };
+
+        if (i > 0) {
+            std::cout << ", ";
+        }
+        std::cout << '"' << phase.name << R"(": {"seconds": )" << phase.seconds;
+        std::cout << R"(, "arrows_per_second": )" << rate(double(count));
+        if (phase.bytes > 0) {
+            std::cout << R"(, "bytes": )" << phase.bytes;
+            std::cout << R"(, "bytes_per_second": )" << rate(double(phase.bytes));
+        }
+        std::cout << "}";
+    }
+
+    std::cout << "}}" << std::endl;
+}
@@ -25,11 +25,18 @@ def main():
         ]
     }
 
-    with subprocess.Popen(["quiver", "-o", "/dev/stdout", "/dev/stdin"], stdin=subprocess.PIPE, stdout=subprocess.PIPE) as proc:
+    # Raw premultiplied RGBA skips PNG encoding and decoding entirely.
+    with subprocess.Popen(["quiver", "-f", "raw", "-o", "-", "/dev/stdin"], stdin=subprocess.PIPE, stdout=subprocess.PIPE) as proc:
         json.dump(spec, io.TextIOWrapper(proc.stdin))
-        image = PIL.Image.open(proc.stdout)
-        image.load()
-    
+        data = proc.stdout.read()
+
+    rendering = spec["rendering"]
+    size = tuple(
+        round((upper - lower) * rendering["pixels_per_length"])
+        for lower, upper in [rendering["x_range"], rendering["y_range"]]
+    )
+    image = PIL.Image.frombuffer("RGBA", size, data, "raw", "RGBa", 0, 1)
+
     extent = spec["rendering"]["x_range"] + spec["rendering"]["y_range"]
     plt.imshow(image, extent=extent, interpolation="kaiser")
     plt.show()
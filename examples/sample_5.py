@@ -0,0 +1,58 @@
+import io
+import json
+import math
+import subprocess
+
+import PIL.Image
+
+
+def main():
+    with subprocess.Popen(["quiver", "-S"], stdin=subprocess.PIPE, stdout=subprocess.PIPE) as proc:
+        for frame in range(10):
+            spec = make_spec(frame / 10 * math.pi)
+            image = request_plot(proc, spec)
+            image.save(f"frame_{frame}.png")
+
+        proc.stdin.close()
+
+
+def make_spec(phase):
+    arrows = []
+    for i in range(-5, 6):
+        for j in range(-5, 6):
+            x = i / 5
+            y = j / 5
+            arrows.append({
+                "x": x,
+                "y": y,
+                "dx": 0.1 * math.cos(phase + x),
+                "dy": 0.1 * math.sin(phase + y)
+            })
+
+    return {
+        "rendering": {
+            "pixels_per_length": 200,
+            "x_range": [-1.2, 1.2],
+            "y_range": [-1.2, 1.2]
+        },
+        "style": {
+            "background_color": [1, 1, 1],
+            "shaft_width": 0.02
+        },
+        "arrows": arrows
+    }
+
+
+def request_plot(proc, spec):
+    proc.stdin.write(json.dumps(spec).encode() + b"\n")
+    proc.stdin.flush()
+
+    status, _, rest = proc.stdout.readline().decode().rstrip("\n").partition(" ")
+    if status != "ok":
+        raise RuntimeError(rest)
+
+    data = proc.stdout.read(int(rest))
+    return PIL.Image.open(io.BytesIO(data))
+
+
+main()
@@ -0,0 +1,90 @@
+import ctypes
+import json
+
+import matplotlib.pyplot as plt
+import numpy as np
+
+
+class QuiverArray(ctypes.Structure):
+    _fields_ = [("data", ctypes.c_void_p), ("stride", ctypes.c_ssize_t)]
+
+
+class QuiverArrows(ctypes.Structure):
+    _fields_ = [("count", ctypes.c_size_t)] + [
+        (name, QuiverArray) for name in ["x", "y", "dx", "dy", "w", "a", "c", "s"]
+    ]
+
+
+def load_library(path="libquiver.so"):
+    lib = ctypes.CDLL(path)
+    lib.quiver_session_create.restype = ctypes.c_void_p
+    lib.quiver_session_destroy.argtypes = [ctypes.c_void_p]
+    lib.quiver_last_error.argtypes = [ctypes.c_void_p]
+    lib.quiver_last_error.restype = ctypes.c_char_p
+    lib.quiver_measure.argtypes = [
+        ctypes.c_void_p,
+        ctypes.c_char_p,
+        ctypes.POINTER(QuiverArrows),
+        ctypes.POINTER(ctypes.c_int),
+        ctypes.POINTER(ctypes.c_int),
+    ]
+    lib.quiver_render.argtypes = [
+        ctypes.c_void_p,
+        ctypes.c_char_p,
+        ctypes.POINTER(QuiverArrows),
+        ctypes.c_void_p,
+        ctypes.c_ssize_t,
+        ctypes.c_int,
+    ]
+    return lib
+
+
+def as_quiver_array(array):
+    if array is None:
+        return QuiverArray(None, 0)
+    return QuiverArray(array.ctypes.data, array.strides[0])
+
+
+def render(lib, session, settings, **columns):
+    arrows = QuiverArrows(len(columns["x"]), *[
+        as_quiver_array(columns.get(name))
+        for name in ["x", "y", "dx", "dy", "w", "a", "c", "s"]
+    ])
+    settings = json.dumps(settings).encode()
+
+    width = ctypes.c_int()
+    height = ctypes.c_int()
+    if lib.quiver_measure(session, settings, arrows, width, height) != 0:
+        raise RuntimeError(lib.quiver_last_error(session).decode())
+
+    # Non-premultiplied RGBA, as matplotlib expects.
+    image = np.empty((height.value, width.value, 4), dtype=np.uint8)
+    if lib.quiver_render(session, settings, arrows, image.ctypes.data, image.strides[0], 1) != 0:
+        raise RuntimeError(lib.quiver_last_error(session).decode())
+    return image
+
+
+def main():
+    lib = load_library()
+    session = lib.quiver_session_create()
+
+    # Arrows are read straight from the arrays, including strided views.
+    y, x = np.mgrid[-1:1:100j, -1.5:1.5:150j]
+    u = -y * np.exp(-x**2 - y**2)
+    v = x * np.exp(-x**2 - y**2)
+
+    settings = {
+        "rendering": {"pixels_per_length": 300},
+        "style": {"shaft_width": 0.006, "color_by": "magnitude", "colormap": "viridis"},
+    }
+    image = render(
+        lib, session, settings,
+        x=x.ravel(), y=y.ravel(), dx=0.03 * u.ravel(), dy=0.03 * v.ravel()
+    )
+    lib.quiver_session_destroy(session)
+
+    plt.imshow(image, extent=[-1.5, 1.5, -1, 1], interpolation="kaiser")
+    plt.show()
+
+
+main()
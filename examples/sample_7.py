@@ -0,0 +1,50 @@
+import json
+import subprocess
+
+import numpy as np
+
+
+COLUMN_BITS = {"x": 1, "y": 2, "dx": 4, "dy": 8, "w": 16, "a": 32, "c": 64, "s": 128}
+
+
+def pad(data):
+    return data + b"\0" * (-len(data) % 8)
+
+
+def write_raw_arrows(path, settings, dtype=np.float64, **columns):
+    """Writes arrays to a raw arrow file. c must hold uint32 colors."""
+    count = len(columns["x"])
+    mask = sum(COLUMN_BITS[name] for name in columns)
+    settings = json.dumps(settings).encode()
+
+    header = np.zeros(64, dtype=np.uint8)
+    header[:8] = np.frombuffer(b"QUIVRAW\0", dtype=np.uint8)
+    header[8:32].view("<u4")[[0, 1, 4, 5]] = [1, np.dtype(dtype).itemsize, mask, len(settings)]
+    header[16:24].view("<u8")[0] = count
+
+    with open(path, "wb") as file:
+        file.write(header.tobytes())
+        file.write(pad(settings))
+        for name in sorted(columns, key=COLUMN_BITS.get):
+            column_type = "<u4" if name == "c" else np.dtype(dtype).newbyteorder("<")
+            file.write(pad(np.ascontiguousarray(columns[name], dtype=column_type).tobytes()))
+
+
+def main():
+    # A million arrows of a random flow.
+    rng = np.random.default_rng(1)
+    x = rng.uniform(-1.5, 1.5, 1_000_000)
+    y = rng.uniform(-1, 1, 1_000_000)
+    u = -y * np.exp(-x**2 - y**2)
+    v = x * np.exp(-x**2 - y**2)
+
+    settings = {
+        "rendering": {"pixels_per_length": 500, "order": "spatial"},
+        "style": {"shaft_width": 0.001, "color_by": "magnitude"},
+    }
+    write_raw_arrows("flow.qraw", settings, np.float32, x=x, y=y, dx=0.02 * u, dy=0.02 * v)
+
+    subprocess.run(["quiver", "-j", "0", "-o", "flow.png", "flow.qraw"], check=True)
+
+
+main()
@@ -0,0 +1,289 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <istream>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <blend2d.h>
+#include <getopt.hpp>
+
+#include "image_writer.hpp"
+
+
+constexpr int         default_compression = 6;
+constexpr int         merge_block_rows    = 64;
+constexpr char const* standard_output     = "-";
+
+
+struct merge_options
+{
+    bool                       help = false;
+    std::string                output;
+    std::optional<std::string> format;
+    int                        compression = default_compression;
+    std::vector<std::string>   parts;
+};
+
+
+// Size of a PAM image of 8-bit RGBA pixels.
+struct pam_header
+{
+    int width  = 0;
+    int height = 0;
+};
+
+
+static void          show_usage();
+static merge_options parse_options(int argc, char** argv);
+static int           parse_count(std::string const& str);
+static void          merge_parts(merge_options const& options);
+static pam_header    read_pam_header(std::istream& stream, std::string const& filename);
+static void          open_part(std::string const& filename, std::ifstream& file);
+
+
+int
+main(int argc, char** argv)
+{
+    try {
+        merge_options options;
+
+        try {
+            options = parse_options(argc, argv);
+        } catch (std::exception const& err) {
+            std::cerr << "error: " << err.what() << '\n';
+            show_usage();
+            return 1;
+        }
+
+        if (options.help) {
+            show_usage();
+            return 0;
+        }
+
+        merge_parts(options);
+    } catch (std::exception const& err) {
+        std::cerr << "error: " << err.what() << '\n';
+        return 1;
+    }
+
+    return 0;
+}
+
+
+void
+show_usage()
+{
+    std::string const usage =
+        "usage: quiver-merge [-h] [-f format] [-z level] -o output part ...\n"
+        "\n"
+        "  part        PAM image of a band of rows rendered by quiver -p, given\n"
+        "              in the order of the bands from top to bottom\n"
+        "\n"
+        "options:\n"
+        "  -o output   Output image file name, or - for stdout\n"
+        "  -f format   Output format: png, raw, ppm, pam or qoi\n"
+        "  -z level    PNG compression level from 0 to 9 (1 is fast)\n"
+        "  -h          Print this help message and exit\n"
+        "\n";
+    std::cerr << usage;
+}
+
+
+merge_options
+parse_options(int argc, char** argv)
+{
+    merge_options options;
+    cxx::getopt getopt;
+
+    for (int ch; (ch = getopt(argc, argv, "ho:f:z:")) != -1; ) {
+        switch (ch) {
+        case 'h':
+            options.help = true;
+            return options;
+
+        case 'o':
+            options.output = getopt.optarg;
+            break;
+
+        case 'f':
+            options.format = getopt.optarg;
+            break;
+
+        case 'z':
+            options.compression = parse_count(getopt.optarg);
+            break;
+
+        default:
+            throw std::runtime_error{"unrecognized command-line option"};
+        }
+    }
+
+    if (options.output.empty()) {
+        throw std::runtime_error{"output image is not specified"};
+    }
+    if (options.compression > 9) {
+        throw std::runtime_error{"compression must be in 0-9"};
+    }
+
+    for (int i = getopt.optind; i < argc; i++) {
+        options.parts.push_back(argv[i]);
+    }
+    if (options.parts.empty()) {
+        throw std::runtime_error{"no part images are given"};
+    }
+
+    return options;
+}
+
+
+int
+parse_count(std::string const& str)
+{
+    std::size_t end;
+    int value = -1;
+    try {
+        value = std::stoi(str, &end);
+    } catch (std::exception const&) {
+        end = 0;
+    }
+    if (end != str.size() || value < 0) {
+        throw std::runtime_error{"invalid count: " + str};
+    }
+    return value;
+}
+
+
+// Stacks the parts into one image. Headers are read first to size the image,
+// then the rows of each part are streamed to the output a block at a time,
+// so that memory use is bounded by a block rather than the image.
+void
+merge_parts(merge_options const& options)
+{
+    pam_header size;
+    for (auto const& part : options.parts) {
+        std::ifstream file;
+        open_part(part, file);
+        auto const header = read_pam_header(file, part);
+
+        if (size.width != 0 && header.width != size.width) {
+            throw std::runtime_error{"part " + part + " differs in width from the previous parts"};
+        }
+        size.width = header.width;
+        if (header.height > INT32_MAX - size.height) {
+            throw std::runtime_error{"merged image is too tall"};
+        }
+        size.height += header.height;
+    }
+
+    auto const format = options.format ? parse_image_format(*options.format) : guess_image_format(options.output);
+
+    std::ofstream output_file;
+    if (options.output != standard_output) {
+        output_file.open(options.output, std::ios::binary);
+        if (!output_file) {
+            throw std::runtime_error{"failed to open output file " + options.output};
+        }
+    }
+    auto& output = output_file.is_open() ? static_cast<std::ostream&>(output_file) : std::cout;
+    auto const writer = make_image_writer(format, output, size.width, size.height, options.compression);
+
+    std::vector<unsigned char> rgba;
+    BLImage block;
+    for (auto const& part : options.parts) {
+        std::ifstream file;
+        open_part(part, file);
+        auto const header = read_pam_header(file, part);
+
+        for (int y = 0; y < header.height; y += merge_block_rows) {
+            auto const rows = std::min(merge_block_rows, header.height - y);
+            if (block.height() != rows) {
+                block = BLImage{size.width, rows, BL_FORMAT_PRGB32};
+            }
+
+            auto const row_size = std::size_t(size.width) * 4;
+            rgba.resize(row_size * std::size_t(rows));
+            if (!file.read(reinterpret_cast<char*>(rgba.data()), std::streamsize(rgba.size()))) {
+                throw std::runtime_error{"part " + part + " is truncated"};
+            }
+
+            BLImageData data;
+            block.makeMutable(&data);
+            for (int row = 0; row < rows; row++) {
+                auto const pixels = static_cast<unsigned char*>(data.pixelData) + row * data.stride;
+                premultiply_row(rgba.data() + std::size_t(row) * row_size, size.width, reinterpret_cast<std::uint32_t*>(pixels));
+            }
+            writer->write_rows(block);
+        }
+    }
+
+    writer->finish();
+}
+
+
+// Reads the header of a PAM image as quiver writes it, leaving the stream at
+// the first pixel.
+pam_header
+read_pam_header(std::istream& stream, std::string const& filename)
+{
+    auto const invalid = [&](std::string const& reason) {
+        return std::runtime_error{"part " + filename + " is not an RGBA PAM image: " + reason};
+    };
+
+    std::string line;
+    if (!std::getline(stream, line) || line != "P7") {
+        throw invalid("bad magic");
+    }
+
+    pam_header header;
+    int depth = 0;
+    int maxval = 0;
+    while (std::getline(stream, line) && line != "ENDHDR") {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        std::istringstream fields{line};
+        std::string key;
+        fields >> key;
+        if (key == "WIDTH") {
+            fields >> header.width;
+        } else if (key == "HEIGHT") {
+            fields >> header.height;
+        } else if (key == "DEPTH") {
+            fields >> depth;
+        } else if (key == "MAXVAL") {
+            fields >> maxval;
+        }
+        if (!fields && key != "TUPLTYPE") {
+            throw invalid("bad " + key);
+        }
+    }
+
+    if (!stream) {
+        throw invalid("no ENDHDR");
+    }
+    if (depth != 4 || maxval != 255) {
+        throw invalid("DEPTH must be 4 and MAXVAL 255");
+    }
+    if (header.width <= 0 || header.height < 0) {
+        throw invalid("bad size");
+    }
+    return header;
+}
+
+
+void
+open_part(std::string const& filename, std::ifstream& file)
+{
+    file.open(filename, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error{"failed to open part " + filename};
+    }
+}
@@ -0,0 +1,256 @@
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "aggregate.hpp"
+#include "parallel.hpp"
+
+
+// Arrows of a chunk are split into blocks whose cells workers find in
+// parallel. Cells are split into contiguous ranges that workers accumulate in
+// parallel, several per thread to balance unevenly filled grids.
+constexpr std::size_t aggregate_block_size = 16384;
+constexpr std::size_t ranges_per_thread    = 4;
+constexpr std::size_t outside_grid         = SIZE_MAX;
+
+
+// Running sums and extremes of the arrows that fall in a grid cell.
+struct cell_accumulator
+{
+    std::size_t count    = 0;
+    double      x        = 0;
+    double      y        = 0;
+    double      dx       = 0;
+    double      dy       = 0;
+    double      width    = 0;
+    double      aspect   = 0;
+    double      color[4] = {};
+    std::size_t scalars  = 0; // Arrows with a scalar
+    double      scalar   = 0;
+};
+
+
+static void          accumulate(cell_accumulator& cell, double value, double& target, reduction op);
+static void          combine(double& target, double value, reduction op);
+static double        finish(double value, std::size_t count, reduction op);
+static std::uint32_t pack_channels(double const* channels);
+
+
+// Bins arrows by their starting point into the cells of the grid and returns
+// one arrow per non-empty cell, in row-major order. The arrow starts at the
+// mean position and has the mean vector. Widths and colors are combined by
+// the reductions of the grid, and scalars are averaged over the arrows that
+// have them. Arrows starting outside the grid are dropped.
+// Workers first find the cells of blocks of arrows and count the arrows of
+// each range of cells per block. A stable counting sort then lists the arrows
+// of each range in input order, and workers accumulate the disjoint ranges,
+// each visiting only its own arrows. Every cell thus sums its arrows in the
+// same order whatever the number of threads, so the result does not depend
+// on it.
+arrow_store
+aggregate_arrows(arrow_source& arrows, aggregate_grid const& grid, unsigned threads)
+{
+    auto const cell_count = grid.columns * grid.rows;
+    auto const cell_width = (grid.x_range.upper - grid.x_range.lower) / double(grid.columns);
+    auto const cell_height = (grid.y_range.upper - grid.y_range.lower) / double(grid.rows);
+    auto const range_count = std::min<std::size_t>(std::size_t(threads) * ranges_per_thread, cell_count);
+
+    std::vector<cell_accumulator> cells(cell_count);
+    std::vector<std::size_t> cell_indices;
+    std::vector<std::size_t> block_ranges;  // Arrows of block b in range r at b * range_count + r
+    std::vector<std::size_t> range_offsets; // Arrows of range r at sorted[range_offsets[r]]
+    std::vector<std::size_t> sorted;
+    bool has_aspect = false;
+    bool has_color = false;
+
+    arrows.scan([&](arrow_store const& chunk) {
+        auto const block_count = (chunk.size() + aggregate_block_size - 1) / aggregate_block_size;
+        has_aspect = has_aspect || chunk.aspect();
+        has_color = has_color || chunk.color();
+        cell_indices.resize(chunk.size());
+        block_ranges.assign(block_count * range_count, 0);
+
+        parallel_for(block_count, threads, [&](std::size_t block, unsigned) {
+            auto const x = chunk.x();
+            auto const y = chunk.y();
+            auto const begin = block * aggregate_block_size;
+            auto const end = std::min(begin + aggregate_block_size, chunk.size());
+            auto const counts = block_ranges.data() + block * range_count;
+
+            for (auto i = begin; i < end; i++) {
+                auto const column = std::floor((x[i] - grid.x_range.lower) / cell_width);
+                auto const row = std::floor((grid.y_range.upper - y[i]) / cell_height);
+                auto const inside = column >= 0 && column < double(grid.columns) && row >= 0 && row < double(grid.rows);
+                cell_indices[i] = inside ? std::size_t(row) * grid.columns + std::size_t(column) : outside_grid;
+                if (inside) {
+                    counts[cell_indices[i] * range_count / cell_count]++;
+                }
+            }
+        });
+
+        // Turns the counts into the positions where each block places the
+        // arrows of each range, ranges first and blocks in order.
+        range_offsets.resize(range_count + 1);
+        std::size_t total = 0;
+        for (std::size_t range = 0; range < range_count; range++) {
+            range_offsets[range] = total;
+            for (std::size_t block = 0; block < block_count; block++) {
+                auto& position = block_ranges[block * range_count + range];
+                total += std::exchange(position, total);
+            }
+        }
+        range_offsets[range_count] = total;
+        sorted.resize(total);
+
+        parallel_for(block_count, threads, [&](std::size_t block, unsigned) {
+            auto const begin = block * aggregate_block_size;
+            auto const end = std::min(begin + aggregate_block_size, chunk.size());
+            auto const positions = block_ranges.data() + block * range_count;
+
+            for (auto i = begin; i < end; i++) {
+                if (cell_indices[i] != outside_grid) {
+                    sorted[positions[cell_indices[i] * range_count / cell_count]++] = i;
+                }
+            }
+        });
+
+        parallel_for(range_count, threads, [&](std::size_t range, unsigned) {
+            auto const x = chunk.x();
+            auto const y = chunk.y();
+            auto const dx = chunk.dx();
+            auto const dy = chunk.dy();
+            auto const widths = chunk.width();
+            auto const aspects = chunk.aspect();
+            auto const colors = chunk.color();
+            auto const scalars = chunk.scalar();
+
+            for (auto k = range_offsets[range]; k < range_offsets[range + 1]; k++) {
+                auto const i = sorted[k];
+                auto& cell = cells[cell_indices[i]];
+                auto const width = widths && chunk.has_width(i) ? widths[i] : grid.shape.shaft_width;
+                auto const aspect = aspects && chunk.has_aspect(i) ? aspects[i] : grid.shape.head_aspect_ratio;
+                auto const color = colors && chunk.has_color(i) ? colors[i] : grid.arrow_color;
+
+                accumulate(cell, width, cell.width, grid.width_reduction);
+                accumulate(cell, color >> 16 & 0xFF, cell.color[0], grid.color_reduction);
+                accumulate(cell, color >> 8 & 0xFF, cell.color[1], grid.color_reduction);
+                accumulate(cell, color & 0xFF, cell.color[2], grid.color_reduction);
+                accumulate(cell, color >> 24, cell.color[3], grid.color_reduction);
+
+                cell.count++;
+                cell.x += x[i];
+                cell.y += y[i];
+                cell.dx += dx[i];
+                cell.dy += dy[i];
+                cell.aspect += aspect;
+                if (scalars && chunk.has_scalar(i)) {
+                    cell.scalars++;
+                    cell.scalar += scalars[i];
+                }
+            }
+        });
+    });
+
+    arrow_store aggregated;
+    for (auto const& cell : cells) {
+        if (cell.count == 0) {
+            continue;
+        }
+
+        auto const n = double(cell.count);
+        double channels[4];
+        for (int c = 0; c < 4; c++) {
+            channels[c] = finish(cell.color[c], cell.count, grid.color_reduction);
+        }
+
+        arrow_spec arrow;
+        arrow.x = cell.x / n;
+        arrow.y = cell.y / n;
+        arrow.dx = cell.dx / n;
+        arrow.dy = cell.dy / n;
+        arrow.w = finish(cell.width, cell.count, grid.width_reduction);
+        if (has_aspect) {
+            arrow.a = cell.aspect / n;
+        }
+        if (has_color) {
+            arrow.c = unpack_color(pack_channels(channels));
+        }
+        if (cell.scalars > 0) {
+            arrow.s = cell.scalar / double(cell.scalars);
+        }
+        aggregated.push_back(arrow);
+    }
+    return aggregated;
+}
+
+
+reduction
+parse_reduction(std::string const& name)
+{
+    if (name == "mean") {
+        return reduction::mean;
+    }
+    if (name == "min") {
+        return reduction::min;
+    }
+    if (name == "max") {
+        return reduction::max;
+    }
+    throw std::runtime_error{"unknown reduction: " + name};
+}
+
+
+// Folds a value into a reduced quantity. The first value of a cell, seen
+// while its count is still zero, initializes the quantity.
+void
+accumulate(cell_accumulator& cell, double value, double& target, reduction op)
+{
+    if (cell.count == 0) {
+        target = value;
+    } else {
+        combine(target, value, op);
+    }
+}
+
+
+void
+combine(double& target, double value, reduction op)
+{
+    switch (op) {
+    case reduction::mean:
+        target += value;
+        break;
+
+    case reduction::min:
+        target = std::min(target, value);
+        break;
+
+    case reduction::max:
+        target = std::max(target, value);
+        break;
+    }
+}
+
+
+double
+finish(double value, std::size_t count, reduction op)
+{
+    return op == reduction::mean ? value / double(count) : value;
+}
+
+
+// Packs 8-bit channel values given in the order R, G, B, A.
+std::uint32_t
+pack_channels(double const* channels)
+{
+    auto const channel = [&](int c) {
+        return std::uint32_t(std::clamp(std::nearbyint(channels[c]), 0.0, 255.0));
+    };
+    return channel(3) << 24 | channel(0) << 16 | channel(1) << 8 | channel(2);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "geometry.hpp"
+#include "spec.hpp"
+
+
+// How per-arrow values of a grid cell are combined.
+enum class reduction
+{
+    mean,
+    min,
+    max,
+};
+
+
+// Regular grid over the plot range. Each cell is drawn as one arrow.
+struct aggregate_grid
+{
+    range_spec    x_range;
+    range_spec    y_range;
+    std::size_t   columns = 0;
+    std::size_t   rows    = 0;
+    reduction     width_reduction = reduction::mean;
+    reduction     color_reduction = reduction::mean;
+    arrow_shape   shape;
+    std::uint32_t arrow_color = 0;
+};
+
+
+arrow_store aggregate_arrows(arrow_source& arrows, aggregate_grid const& grid, unsigned threads);
+reduction   parse_reduction(std::string const& name);
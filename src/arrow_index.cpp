@@ -0,0 +1,134 @@
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include <blend2d.h>
+
+#include "arrow_index.hpp"
+#include "geometry.hpp"
+
+
+// Cells are sized to hold this many arrows on average.
+constexpr double      arrows_per_cell = 16;
+constexpr std::size_t max_grid_size   = 4096;
+
+
+static BLBox bound_segment(arrow_store const& arrows, std::size_t i);
+
+
+// Bins arrows by counting sort: one pass counts the arrows of each cell and
+// another places their indices, so each cell lists arrows in input order.
+arrow_index::arrow_index(arrow_store const& arrows)
+{
+    if (arrows.size() > UINT32_MAX) {
+        throw std::runtime_error{"too many arrows to index"};
+    }
+
+    auto const n = arrows.size();
+    if (n > 0) {
+        auto const [x_range, y_range] = compute_arrow_bounds(arrows);
+        _x_range = x_range;
+        _y_range = y_range;
+
+        auto const grid_size = std::clamp(std::size_t(std::sqrt(double(n) / arrows_per_cell)), std::size_t(1), max_grid_size);
+        _columns = grid_size;
+        _rows = grid_size;
+    }
+
+    if (auto const widths = arrows.width()) {
+        for (std::size_t i = 0; i < n; i++) {
+            if (arrows.has_width(i)) {
+                _max_width = std::max<double>(_max_width, widths[i]);
+            }
+        }
+    }
+
+    _offsets.assign(_columns * _rows + 1, 0);
+    for (std::size_t i = 0; i < n; i++) {
+        auto const cells = cover(bound_segment(arrows, i));
+        for (auto row = cells.row_begin; row < cells.row_end; row++) {
+            for (auto column = cells.column_begin; column < cells.column_end; column++) {
+                _offsets[row * _columns + column + 1]++;
+            }
+        }
+    }
+    for (std::size_t k = 1; k < _offsets.size(); k++) {
+        _offsets[k] += _offsets[k - 1];
+    }
+
+    _indices.resize(_offsets.back());
+    auto cursors = _offsets;
+    for (std::size_t i = 0; i < n; i++) {
+        auto const cells = cover(bound_segment(arrows, i));
+        for (auto row = cells.row_begin; row < cells.row_end; row++) {
+            for (auto column = cells.column_begin; column < cells.column_end; column++) {
+                _indices[cursors[row * _columns + column]++] = std::uint32_t(i);
+            }
+        }
+    }
+}
+
+
+double
+arrow_index::max_width() const
+{
+    return _max_width;
+}
+
+
+// Arrows spanning several cells are listed once per cell, so the indices of
+// the covered cells are merged and deduplicated.
+void
+arrow_index::query(BLBox const& box, std::vector<std::uint32_t>& indices) const
+{
+    indices.clear();
+    if (box.x1 < _x_range.lower || box.x0 > _x_range.upper || box.y1 < _y_range.lower || box.y0 > _y_range.upper) {
+        return;
+    }
+
+    auto const cells = cover(box);
+    for (auto row = cells.row_begin; row < cells.row_end; row++) {
+        auto const begin = _offsets[row * _columns + cells.column_begin];
+        auto const end = _offsets[row * _columns + cells.column_end];
+        indices.insert(indices.end(), _indices.begin() + std::ptrdiff_t(begin), _indices.begin() + std::ptrdiff_t(end));
+    }
+
+    std::sort(indices.begin(), indices.end());
+    indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+}
+
+
+// Returns the cells overlapping the box, clamped to the grid.
+arrow_index::cell_range
+arrow_index::cover(BLBox const& box) const
+{
+    auto const cell = [](double value, range_spec const& range, std::size_t count) {
+        auto const span = range.upper - range.lower;
+        auto const position = span > 0 ? (value - range.lower) / span * double(count) : 0;
+        if (!(position > 0)) {
+            return std::size_t(0);
+        }
+        return std::size_t(std::min(std::floor(position), double(count - 1)));
+    };
+
+    cell_range cells;
+    cells.column_begin = cell(box.x0, _x_range, _columns);
+    cells.column_end = cell(box.x1, _x_range, _columns) + 1;
+    cells.row_begin = cell(box.y0, _y_range, _rows);
+    cells.row_end = cell(box.y1, _y_range, _rows) + 1;
+    return cells;
+}
+
+
+BLBox
+bound_segment(arrow_store const& arrows, std::size_t i)
+{
+    double const x = arrows.x()[i];
+    double const y = arrows.y()[i];
+    auto const x_end = x + arrows.dx()[i];
+    auto const y_end = y + arrows.dy()[i];
+    return BLBox{std::min(x, x_end), std::min(y, y_end), std::max(x, x_end), std::max(y, y_end)};
+}
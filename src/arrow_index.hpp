@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <blend2d.h>
+
+#include "spec.hpp"
+
+
+// Uniform grid over the arrows of a store, listing in each cell the arrows
+// whose line segment from tail to tip overlaps the cell. Built once, it
+// answers which arrows may be visible in any number of views.
+class arrow_index
+{
+public:
+    explicit arrow_index(arrow_store const& arrows);
+
+    // Largest width given to any arrow, or zero.
+    double max_width() const;
+
+    // Replaces indices with the arrows whose segments may overlap the box, in
+    // input order. The box must be widened by the margin of arrowheads.
+    void query(BLBox const& box, std::vector<std::uint32_t>& indices) const;
+
+private:
+    struct cell_range
+    {
+        std::size_t column_begin = 0;
+        std::size_t column_end   = 0;
+        std::size_t row_begin    = 0;
+        std::size_t row_end      = 0;
+    };
+
+    cell_range cover(BLBox const& box) const;
+
+private:
+    range_spec                 _x_range;
+    range_spec                 _y_range;
+    std::size_t                _columns = 1;
+    std::size_t                _rows    = 1;
+    double                     _max_width = 0;
+
+    // Arrows of cell k are indices[offsets[k]] to indices[offsets[k + 1]]
+    std::vector<std::size_t>   _offsets;
+    std::vector<std::uint32_t> _indices;
+};
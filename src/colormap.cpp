@@ -0,0 +1,123 @@
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "colormap.hpp"
+
+
+// Built-in colormaps given as opaque colors evenly spaced along the gradient.
+// The perceptually uniform maps are sampled from their matplotlib tables.
+struct builtin_colormap
+{
+    char const*                          name;
+    std::initializer_list<std::uint32_t> stops;
+};
+
+static builtin_colormap const builtin_colormaps[] = {
+    {"viridis", {
+        0x440154, 0x482878, 0x3E4989, 0x31688E, 0x26828E,
+        0x1F9E89, 0x35B779, 0x6ECE58, 0xB5DE2B, 0xFDE725
+    }},
+    {"magma", {
+        0x000004, 0x180F3D, 0x440F76, 0x721F81, 0x9E2F7F,
+        0xCD4071, 0xF1605D, 0xFD9668, 0xFECA8D, 0xFCFDBF
+    }},
+    {"inferno", {
+        0x000004, 0x1B0C41, 0x4A0C6B, 0x781C6D, 0xA52C60,
+        0xCF4446, 0xED6925, 0xFB9B06, 0xF7D13D, 0xFCFFA4
+    }},
+    {"plasma", {
+        0x0D0887, 0x46039F, 0x7201A8, 0x9C179E, 0xBD3786,
+        0xD8576B, 0xED7953, 0xFB9F3A, 0xFDCA26, 0xF0F921
+    }},
+    {"cividis", {
+        0x00204D, 0x00336F, 0x39486B, 0x575D6D, 0x707173,
+        0x8A8779, 0xA69D75, 0xC4B56C, 0xE4CF5B, 0xFFEA46
+    }},
+    {"gray", {
+        0x000000, 0xFFFFFF
+    }},
+    // Cyclic, so that angles of -pi and pi get the same color.
+    {"hsv", {
+        0xFF0000, 0xFFFF00, 0x00FF00, 0x00FFFF, 0x0000FF, 0xFF00FF, 0xFF0000
+    }},
+};
+
+
+static std::uint32_t mix_colors(std::uint32_t a, std::uint32_t b, double t);
+
+
+// Samples the piecewise linear gradient through the stops. Channels are
+// interpolated separately, alpha included.
+colormap::colormap(std::vector<std::uint32_t> const& stops)
+{
+    if (stops.empty()) {
+        throw std::runtime_error{"colormap needs at least one color"};
+    }
+
+    auto const segments = double(stops.size() - 1);
+    for (std::size_t k = 0; k < colormap_size; k++) {
+        auto const position = double(k) / double(colormap_size - 1) * segments;
+        auto const segment = std::min(std::size_t(position), stops.size() - 1);
+        auto const next = std::min(segment + 1, stops.size() - 1);
+        _colors[k] = mix_colors(stops[segment], stops[next], position - double(segment));
+    }
+}
+
+
+colormap
+make_colormap(colormap_spec const& spec)
+{
+    std::vector<std::uint32_t> stops;
+
+    if (spec.colors.empty()) {
+        for (auto const& builtin : builtin_colormaps) {
+            if (spec.name == builtin.name) {
+                for (auto const stop : builtin.stops) {
+                    stops.push_back(0xFF000000 | stop);
+                }
+                return colormap{stops};
+            }
+        }
+        throw std::runtime_error{"unknown colormap: " + spec.name};
+    }
+
+    for (auto const& color : spec.colors) {
+        stops.push_back(pack_color(color));
+    }
+    return colormap{stops};
+}
+
+
+color_source
+parse_color_source(std::string const& name)
+{
+    if (name == "magnitude") {
+        return color_source::magnitude;
+    }
+    if (name == "angle") {
+        return color_source::angle;
+    }
+    if (name == "s") {
+        return color_source::scalar;
+    }
+    throw std::runtime_error{"color_by must be \"magnitude\", \"angle\" or \"s\""};
+}
+
+
+std::uint32_t
+mix_colors(std::uint32_t a, std::uint32_t b, double t)
+{
+    std::uint32_t mixed = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        auto const from = double(a >> shift & 0xFF);
+        auto const to = double(b >> shift & 0xFF);
+        mixed |= std::uint32_t(std::nearbyint(from + (to - from) * t)) << shift;
+    }
+    return mixed;
+}
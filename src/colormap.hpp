@@ -0,0 +1,50 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "spec.hpp"
+
+
+// Number of colors a colormap is sampled to.
+constexpr std::size_t colormap_size = 256;
+
+
+// Arrow quantity that a colormap maps to colors.
+enum class color_source
+{
+    none,      // Arrows are colored by c or the arrow color
+    magnitude, // Length of the arrow vector
+    angle,     // Direction of the arrow vector in radians, from -pi to pi
+    scalar,    // Per-arrow value s
+};
+
+
+// Colors sampled at evenly spaced points of a gradient through the given
+// packed colors, so that mapping a value is a table lookup.
+class colormap
+{
+public:
+    colormap() = default;
+    explicit colormap(std::vector<std::uint32_t> const& stops);
+
+    // Returns the color at t in [0, 1]. Values outside are clamped, and NaN
+    // maps to the first color.
+    std::uint32_t map(double t) const
+    {
+        auto const index = t > 0 ? std::min(t, 1.0) * double(colormap_size - 1) : 0.0;
+        return _colors[std::size_t(std::nearbyint(index))];
+    }
+
+private:
+    std::array<std::uint32_t, colormap_size> _colors = {};
+};
+
+
+colormap     make_colormap(colormap_spec const& spec);
+color_source parse_color_source(std::string const& name);
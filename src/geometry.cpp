@@ -0,0 +1,405 @@
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#if defined(__SSE2__) || defined(_M_X64)
+# define QUIVER_USE_SSE2
+# include <emmintrin.h>
+#endif
+
+#include <blend2d.h>
+
+#include "geometry.hpp"
+
+
+// Arrows are processed in blocks so that resolved per-arrow parameters fit
+// in a small stack buffer.
+constexpr std::size_t block_size = 256;
+
+
+#ifdef QUIVER_USE_SSE2
+static __m128d load_reals(arrow_real const* values);
+#endif
+static void resolve_shape(
+    arrow_store const& arrows,
+    std::size_t begin,
+    std::size_t count,
+    arrow_shape const& shape,
+    double* widths,
+    double* aspects
+);
+static void outline_arrow(
+    double x,
+    double y,
+    double dx,
+    double dy,
+    double width,
+    double aspect,
+    double stem_to_shaft_ratio,
+    BLPoint* vertices
+);
+static bool overlaps_convex_polygon(BLPoint const* points, std::size_t count, BLBox const& box);
+
+
+std::pair<range_spec, range_spec>
+compute_arrow_bounds(arrow_store const& arrows)
+{
+    auto const x = arrows.x();
+    auto const y = arrows.y();
+    auto const dx = arrows.dx();
+    auto const dy = arrows.dy();
+    auto const n = arrows.size();
+
+    range_spec x_range = {x[0], x[0]};
+    range_spec y_range = {y[0], y[0]};
+    std::size_t i = 0;
+
+#ifdef QUIVER_USE_SSE2
+    auto x_lower = _mm_set1_pd(x[0]);
+    auto x_upper = x_lower;
+    auto y_lower = _mm_set1_pd(y[0]);
+    auto y_upper = y_lower;
+
+    for (; i + 2 <= n; i += 2) {
+        auto const x_start = load_reals(x + i);
+        auto const y_start = load_reals(y + i);
+        auto const x_end = _mm_add_pd(x_start, load_reals(dx + i));
+        auto const y_end = _mm_add_pd(y_start, load_reals(dy + i));
+
+        x_lower = _mm_min_pd(x_lower, _mm_min_pd(x_start, x_end));
+        x_upper = _mm_max_pd(x_upper, _mm_max_pd(x_start, x_end));
+        y_lower = _mm_min_pd(y_lower, _mm_min_pd(y_start, y_end));
+        y_upper = _mm_max_pd(y_upper, _mm_max_pd(y_start, y_end));
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, x_lower);
+    x_range.lower = std::min(lanes[0], lanes[1]);
+    _mm_storeu_pd(lanes, x_upper);
+    x_range.upper = std::max(lanes[0], lanes[1]);
+    _mm_storeu_pd(lanes, y_lower);
+    y_range.lower = std::min(lanes[0], lanes[1]);
+    _mm_storeu_pd(lanes, y_upper);
+    y_range.upper = std::max(lanes[0], lanes[1]);
+#endif
+
+    for (; i < n; i++) {
+        double const x_start = x[i];
+        double const y_start = y[i];
+        auto const x_end = x_start + dx[i];
+        auto const y_end = y_start + dy[i];
+
+        x_range.lower = std::min({x_range.lower, x_start, x_end});
+        x_range.upper = std::max({x_range.upper, x_start, x_end});
+        y_range.lower = std::min({y_range.lower, y_start, y_end});
+        y_range.upper = std::max({y_range.upper, y_start, y_end});
+    }
+
+    return std::make_pair(x_range, y_range);
+}
+
+
+void
+compute_arrow_vertices(
+    arrow_store const& arrows,
+    std::size_t begin,
+    std::size_t end,
+    arrow_shape const& shape,
+    BLPoint* vertices
+)
+{
+    auto const x = arrows.x();
+    auto const y = arrows.y();
+    auto const dx = arrows.dx();
+    auto const dy = arrows.dy();
+
+    double widths[block_size];
+    double aspects[block_size];
+
+    for (auto block = begin; block < end; block += block_size) {
+        auto const count = std::min(block_size, end - block);
+        resolve_shape(arrows, block, count, shape, widths, aspects);
+
+        std::size_t k = 0;
+
+#ifdef QUIVER_USE_SSE2
+        auto const zero = _mm_setzero_pd();
+        auto const one = _mm_set1_pd(1);
+        auto const half = _mm_set1_pd(0.5);
+        auto const ratio = _mm_set1_pd(shape.stem_to_shaft_ratio);
+
+        for (; k + 2 <= count; k += 2) {
+            auto const i = block + k;
+            auto const px = load_reals(x + i);
+            auto const py = load_reals(y + i);
+            auto const vx = load_reals(dx + i);
+            auto const vy = load_reals(dy + i);
+            auto const width = _mm_loadu_pd(widths + k);
+            auto const aspect = _mm_loadu_pd(aspects + k);
+
+            // Unit direction. Zero-length arrows point to the east.
+            auto const length = _mm_sqrt_pd(_mm_add_pd(_mm_mul_pd(vx, vx), _mm_mul_pd(vy, vy)));
+            auto const nonzero = _mm_cmpgt_pd(length, zero);
+            auto const inverse = _mm_and_pd(nonzero, _mm_div_pd(one, length));
+            auto const ux = _mm_or_pd(_mm_and_pd(nonzero, _mm_mul_pd(vx, inverse)), _mm_andnot_pd(nonzero, one));
+            auto const uy = _mm_mul_pd(vy, inverse);
+
+            auto const head_length = _mm_min_pd(_mm_div_pd(_mm_mul_pd(width, ratio), aspect), length);
+            auto const x_stem = _mm_sub_pd(length, head_length);
+            auto const y_shaft = _mm_mul_pd(width, half);
+            auto const y_stem = _mm_mul_pd(_mm_mul_pd(head_length, aspect), half);
+
+            // Local (along, across) coordinates of the outline.
+            __m128d const along[arrow_vertex_count] = {
+                zero, x_stem, x_stem, length, x_stem, x_stem, zero
+            };
+            __m128d const across[arrow_vertex_count] = {
+                y_shaft, y_shaft, y_stem, zero, _mm_sub_pd(zero, y_stem), _mm_sub_pd(zero, y_shaft), _mm_sub_pd(zero, y_shaft)
+            };
+
+            auto const out = vertices + (i - begin) * arrow_vertex_count;
+
+            for (std::size_t j = 0; j < arrow_vertex_count; j++) {
+                auto const wx = _mm_add_pd(px, _mm_sub_pd(_mm_mul_pd(ux, along[j]), _mm_mul_pd(uy, across[j])));
+                auto const wy = _mm_add_pd(py, _mm_add_pd(_mm_mul_pd(uy, along[j]), _mm_mul_pd(ux, across[j])));
+                _mm_storeu_pd(&out[j].x, _mm_unpacklo_pd(wx, wy));
+                _mm_storeu_pd(&out[arrow_vertex_count + j].x, _mm_unpackhi_pd(wx, wy));
+            }
+        }
+#endif
+
+        for (; k < count; k++) {
+            auto const i = block + k;
+            outline_arrow(
+                x[i], y[i], dx[i], dy[i], widths[k], aspects[k], shape.stem_to_shaft_ratio,
+                vertices + (i - begin) * arrow_vertex_count
+            );
+        }
+    }
+}
+
+
+
+// Appends the outline as a closed polygon by writing path commands in place.
+// This avoids per-vertex calls and, once the path has grown to its working
+// size, any allocation.
+void
+append_arrow_outline(BLPath& path, BLPoint const* outline)
+{
+    std::uint8_t* commands;
+    BLPoint* vertices;
+    if (path.modifyOp(BL_MODIFY_OP_APPEND_GROW, arrow_command_count, &commands, &vertices) != BL_SUCCESS) {
+        throw std::bad_alloc{};
+    }
+
+    commands[0] = BL_PATH_CMD_MOVE;
+    vertices[0] = outline[0];
+
+    for (std::size_t j = 1; j < arrow_vertex_count; j++) {
+        commands[j] = BL_PATH_CMD_ON;
+        vertices[j] = outline[j];
+    }
+
+    auto const nan = std::numeric_limits<double>::quiet_NaN();
+    commands[arrow_vertex_count] = BL_PATH_CMD_CLOSE;
+    vertices[arrow_vertex_count] = BLPoint{nan, nan};
+}
+
+// Appends an axis-aligned square with the same area and orientation as the
+// outline, centered between the tail and the tip. Arrows much smaller than a
+// pixel look the same either way, and the square is cheaper to rasterize.
+void
+append_arrow_dot(BLPath& path, BLPoint const* outline)
+{
+    // Shoelace formula. The outline is clockwise, so the sum is negative.
+    double twice_area = 0;
+    for (std::size_t j = 0; j < arrow_vertex_count; j++) {
+        auto const& p = outline[j];
+        auto const& q = outline[(j + 1) % arrow_vertex_count];
+        twice_area += p.x * q.y - q.x * p.y;
+    }
+    auto const half_side = std::sqrt(std::abs(twice_area) / 2) / 2;
+
+    auto const& tip = outline[3];
+    auto const x = ((outline[0].x + outline[6].x) / 2 + tip.x) / 2;
+    auto const y = ((outline[0].y + outline[6].y) / 2 + tip.y) / 2;
+
+    std::uint8_t* commands;
+    BLPoint* vertices;
+    if (path.modifyOp(BL_MODIFY_OP_APPEND_GROW, 5, &commands, &vertices) != BL_SUCCESS) {
+        throw std::bad_alloc{};
+    }
+
+    auto const nan = std::numeric_limits<double>::quiet_NaN();
+    commands[0] = BL_PATH_CMD_MOVE;
+    commands[1] = BL_PATH_CMD_ON;
+    commands[2] = BL_PATH_CMD_ON;
+    commands[3] = BL_PATH_CMD_ON;
+    commands[4] = BL_PATH_CMD_CLOSE;
+    vertices[0] = BLPoint{x - half_side, y + half_side};
+    vertices[1] = BLPoint{x + half_side, y + half_side};
+    vertices[2] = BLPoint{x + half_side, y - half_side};
+    vertices[3] = BLPoint{x - half_side, y - half_side};
+    vertices[4] = BLPoint{nan, nan};
+}
+
+
+// Returns the larger side of the bounding box of the outline.
+double
+measure_arrow_outline(BLPoint const* outline)
+{
+    auto x_min = outline[0].x;
+    auto x_max = outline[0].x;
+    auto y_min = outline[0].y;
+    auto y_max = outline[0].y;
+
+    for (std::size_t j = 1; j < arrow_vertex_count; j++) {
+        x_min = std::min(x_min, outline[j].x);
+        x_max = std::max(x_max, outline[j].x);
+        y_min = std::min(y_min, outline[j].y);
+        y_max = std::max(y_max, outline[j].y);
+    }
+    return std::max(x_max - x_min, y_max - y_min);
+}
+
+
+// Returns whether the outline overlaps the box. The outline is the union of
+// the shaft and the head, which are convex and tested separately.
+bool
+overlaps_arrow_outline(BLPoint const* outline, BLBox const& box)
+{
+    BLPoint const shaft[] = {outline[0], outline[1], outline[5], outline[6]};
+    BLPoint const head[] = {outline[2], outline[3], outline[4]};
+    return overlaps_convex_polygon(shaft, 4, box) || overlaps_convex_polygon(head, 3, box);
+}
+
+
+#ifdef QUIVER_USE_SSE2
+// Loads two stored reals as doubles. Both branches must compile, as the
+// function is not a template.
+__m128d
+load_reals(arrow_real const* values)
+{
+    if constexpr (std::is_same_v<arrow_real, float>) {
+        return _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64(reinterpret_cast<__m128i const*>(values))));
+    } else {
+        return _mm_loadu_pd(reinterpret_cast<double const*>(values));
+    }
+}
+#endif
+
+
+void
+resolve_shape(
+    arrow_store const& arrows,
+    std::size_t begin,
+    std::size_t count,
+    arrow_shape const& shape,
+    double* widths,
+    double* aspects
+)
+{
+    auto const width = arrows.width();
+    auto const aspect = arrows.aspect();
+
+    for (std::size_t k = 0; k < count; k++) {
+        auto const i = begin + k;
+        widths[k] = width && arrows.has_width(i) ? width[i] : shape.shaft_width;
+        aspects[k] = aspect && arrows.has_aspect(i) ? aspect[i] : shape.head_aspect_ratio;
+    }
+}
+
+
+void
+outline_arrow(
+    double x,
+    double y,
+    double dx,
+    double dy,
+    double width,
+    double aspect,
+    double stem_to_shaft_ratio,
+    BLPoint* vertices
+)
+{
+    // Same operations as the vectorized path so that both agree exactly.
+    auto const length = std::sqrt(dx * dx + dy * dy);
+    auto const inverse = length > 0 ? 1 / length : 0;
+    auto const ux = length > 0 ? dx * inverse : 1;
+    auto const uy = dy * inverse;
+
+    auto const head_length = std::min(width * stem_to_shaft_ratio / aspect, length);
+    auto const x_stem = length - head_length;
+    auto const y_shaft = width / 2;
+    auto const y_stem = head_length * aspect / 2;
+
+    double const along[arrow_vertex_count] = {
+        0, x_stem, x_stem, length, x_stem, x_stem, 0
+    };
+    double const across[arrow_vertex_count] = {
+        y_shaft, y_shaft, y_stem, 0, -y_stem, -y_shaft, -y_shaft
+    };
+
+    for (std::size_t j = 0; j < arrow_vertex_count; j++) {
+        vertices[j].x = x + ux * along[j] - uy * across[j];
+        vertices[j].y = y + uy * along[j] + ux * across[j];
+    }
+}
+
+
+// Separating axis test: a convex polygon and a box are disjoint if and only
+// if their projections are apart on an axis of the box or on the normal of an
+// edge of the polygon.
+bool
+overlaps_convex_polygon(BLPoint const* points, std::size_t count, BLBox const& box)
+{
+    auto x_min = points[0].x;
+    auto x_max = points[0].x;
+    auto y_min = points[0].y;
+    auto y_max = points[0].y;
+
+    for (std::size_t j = 1; j < count; j++) {
+        x_min = std::min(x_min, points[j].x);
+        x_max = std::max(x_max, points[j].x);
+        y_min = std::min(y_min, points[j].y);
+        y_max = std::max(y_max, points[j].y);
+    }
+    if (x_max < box.x0 || x_min > box.x1 || y_max < box.y0 || y_min > box.y1) {
+        return false;
+    }
+
+    BLPoint const corners[] = {{box.x0, box.y0}, {box.x1, box.y0}, {box.x1, box.y1}, {box.x0, box.y1}};
+
+    for (std::size_t j = 0; j < count; j++) {
+        auto const& p = points[j];
+        auto const& q = points[(j + 1) % count];
+        auto const normal = BLPoint{q.y - p.y, p.x - q.x};
+        auto const project = [&](BLPoint const& point) {
+            return normal.x * point.x + normal.y * point.y;
+        };
+
+        auto polygon_min = project(points[0]);
+        auto polygon_max = polygon_min;
+        for (std::size_t k = 1; k < count; k++) {
+            polygon_min = std::min(polygon_min, project(points[k]));
+            polygon_max = std::max(polygon_max, project(points[k]));
+        }
+
+        auto box_min = project(corners[0]);
+        auto box_max = box_min;
+        for (auto const& corner : corners) {
+            box_min = std::min(box_min, project(corner));
+            box_max = std::max(box_max, project(corner));
+        }
+
+        if (polygon_max < box_min || polygon_min > box_max) {
+            return false;
+        }
+    }
+    return true;
+}
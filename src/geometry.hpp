@@ -0,0 +1,63 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+
+#include <blend2d.h>
+
+#include "spec.hpp"
+
+
+// Number of vertices in the outline of an arrow, and number of path commands
+// needed to draw the outline as a closed polygon.
+constexpr std::size_t arrow_vertex_count  = 7;
+constexpr std::size_t arrow_command_count = arrow_vertex_count + 1;
+
+
+// Shape of arrows that do not override width or aspect ratio.
+struct arrow_shape
+{
+    double shaft_width         = 0;
+    double stem_to_shaft_ratio = 0;
+    double head_aspect_ratio   = 0;
+};
+
+
+std::pair<range_spec, range_spec> compute_arrow_bounds(arrow_store const& arrows);
+
+void compute_arrow_vertices(
+    arrow_store const& arrows,
+    std::size_t begin,
+    std::size_t end,
+    arrow_shape const& shape,
+    BLPoint* vertices
+);
+
+void   append_arrow_outline(BLPath& path, BLPoint const* outline);
+void   append_arrow_dot(BLPath& path, BLPoint const* outline);
+double measure_arrow_outline(BLPoint const* outline);
+bool   overlaps_arrow_outline(BLPoint const* outline, BLBox const& box);
+
+
+// Returns a box that encloses the outline of the arrow. The box is widened on
+// all sides by half the widest possible arrowhead.
+inline BLBox
+bound_arrow(arrow_store const& arrows, std::size_t i, arrow_shape const& shape)
+{
+    auto const widths = arrows.width();
+    auto const width = widths && arrows.has_width(i) ? widths[i] : shape.shaft_width;
+    auto const margin = width * shape.stem_to_shaft_ratio / 2;
+
+    double const x = arrows.x()[i];
+    double const y = arrows.y()[i];
+    auto const x_end = x + arrows.dx()[i];
+    auto const y_end = y + arrows.dy()[i];
+
+    return BLBox{
+        std::min(x, x_end) - margin,
+        std::min(y, y_end) - margin,
+        std::max(x, x_end) + margin,
+        std::max(y, y_end) + margin
+    };
+}
@@ -0,0 +1,422 @@
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <blend2d.h>
+
+#include "image_writer.hpp"
+#include "png.hpp"
+
+
+constexpr int qoi_index_size = 64;
+
+
+static std::optional<image_format> find_image_format(std::string const& name);
+static void                        composited_row(std::uint32_t const* pixels, int width, unsigned char* rgb);
+static unsigned char               unpremultiply(std::uint32_t value, std::uint32_t alpha);
+static std::uint32_t               premultiply(std::uint32_t value, std::uint32_t alpha);
+static void                        write_bytes(std::ostream& stream, unsigned char const* data, std::size_t size);
+static void                        check_complete(int rows_written, int height);
+static void                        flush_stream(std::ostream& stream);
+
+
+// Rows of converted pixels written as they are, after an optional header.
+// Serves the raw, PPM and PAM formats.
+class packed_writer : public image_writer
+{
+public:
+    using convert_function = void(*)(std::uint32_t const*, int, unsigned char*);
+
+    packed_writer(
+        std::ostream& stream,
+        int width,
+        int height,
+        int channels,
+        convert_function convert,
+        std::string const& header
+    )
+    : _stream{stream}, _width{width}, _height{height}, _convert{convert}, _row(std::size_t(width) * channels)
+    {
+        _stream << header;
+    }
+
+    void write_rows(BLImage const& rows) override
+    {
+        BLImageData data;
+        rows.getData(&data);
+
+        auto const pixels = static_cast<unsigned char const*>(data.pixelData);
+        for (int y = 0; y < data.size.h; y++) {
+            _convert(reinterpret_cast<std::uint32_t const*>(pixels + y * data.stride), _width, _row.data());
+            write_bytes(_stream, _row.data(), _row.size());
+        }
+        _rows_written += data.size.h;
+    }
+
+    void finish() override
+    {
+        check_complete(_rows_written, _height);
+        flush_stream(_stream);
+    }
+
+private:
+    std::ostream&              _stream;
+    int                        _width;
+    int                        _height;
+    int                        _rows_written = 0;
+    convert_function           _convert;
+    std::vector<unsigned char> _row;
+};
+
+
+// Encodes the "Quite OK Image" format. The encoder state carries over from
+// row to row because QOI treats the image as a single run of pixels.
+class qoi_writer : public image_writer
+{
+public:
+    qoi_writer(std::ostream& stream, int width, int height)
+    : _stream{stream}, _width{width}, _height{height}, _pixels(std::size_t(width) * 4)
+    {
+        // Worst case is five bytes per pixel.
+        _output.reserve(std::size_t(width) * 5);
+
+        unsigned char const header[] = {
+            'q', 'o', 'i', 'f',
+            static_cast<unsigned char>(width >> 24), static_cast<unsigned char>(width >> 16),
+            static_cast<unsigned char>(width >> 8), static_cast<unsigned char>(width),
+            static_cast<unsigned char>(height >> 24), static_cast<unsigned char>(height >> 16),
+            static_cast<unsigned char>(height >> 8), static_cast<unsigned char>(height),
+            4, // RGBA
+            0, // sRGB with linear alpha
+        };
+        write_bytes(_stream, header, sizeof header);
+    }
+
+    void write_rows(BLImage const& rows) override
+    {
+        BLImageData data;
+        rows.getData(&data);
+
+        auto const pixels = static_cast<unsigned char const*>(data.pixelData);
+        for (int y = 0; y < data.size.h; y++) {
+            unpremultiply_row(reinterpret_cast<std::uint32_t const*>(pixels + y * data.stride), _width, _pixels.data());
+            encode_row();
+        }
+        _rows_written += data.size.h;
+    }
+
+    void finish() override
+    {
+        check_complete(_rows_written, _height);
+
+        flush_run();
+        unsigned char const end_marker[] = {0, 0, 0, 0, 0, 0, 0, 1};
+        _output.insert(_output.end(), end_marker, end_marker + sizeof end_marker);
+        write_bytes(_stream, _output.data(), _output.size());
+        flush_stream(_stream);
+    }
+
+private:
+    void encode_row()
+    {
+        for (int x = 0; x < _width; x++) {
+            auto const p = _pixels.data() + x * 4;
+            auto const r = p[0];
+            auto const g = p[1];
+            auto const b = p[2];
+            auto const a = p[3];
+
+            if (r == _r && g == _g && b == _b && a == _a) {
+                if (++_run == 62) {
+                    flush_run();
+                }
+                continue;
+            }
+            flush_run();
+
+            auto const hash = (r * 3 + g * 5 + b * 7 + a * 11) % qoi_index_size;
+            auto const slot = _index + hash * 4;
+
+            if (slot[0] == r && slot[1] == g && slot[2] == b && slot[3] == a) {
+                _output.push_back(static_cast<unsigned char>(0x00 | hash));
+            } else if (a == _a) {
+                int const vr = std::int8_t(r - _r);
+                int const vg = std::int8_t(g - _g);
+                int const vb = std::int8_t(b - _b);
+                int const vg_r = vr - vg;
+                int const vg_b = vb - vg;
+
+                if (vr >= -2 && vr <= 1 && vg >= -2 && vg <= 1 && vb >= -2 && vb <= 1) {
+                    _output.push_back(static_cast<unsigned char>(0x40 | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2)));
+                } else if (vg_r >= -8 && vg_r <= 7 && vg >= -32 && vg <= 31 && vg_b >= -8 && vg_b <= 7) {
+                    _output.push_back(static_cast<unsigned char>(0x80 | (vg + 32)));
+                    _output.push_back(static_cast<unsigned char>((vg_r + 8) << 4 | (vg_b + 8)));
+                } else {
+                    _output.insert(_output.end(), {0xFE, r, g, b});
+                }
+            } else {
+                _output.insert(_output.end(), {0xFF, r, g, b, a});
+            }
+
+            std::copy(p, p + 4, slot);
+            _r = r;
+            _g = g;
+            _b = b;
+            _a = a;
+        }
+
+        write_bytes(_stream, _output.data(), _output.size());
+        _output.clear();
+    }
+
+    void flush_run()
+    {
+        if (_run > 0) {
+            _output.push_back(static_cast<unsigned char>(0xC0 | (_run - 1)));
+            _run = 0;
+        }
+    }
+
+private:
+    std::ostream&              _stream;
+    int                        _width;
+    int                        _height;
+    int                        _rows_written = 0;
+    std::vector<unsigned char> _pixels;
+    std::vector<unsigned char> _output;
+
+    // Encoder state: previous pixel, current run and recently seen pixels
+    unsigned char _r = 0;
+    unsigned char _g = 0;
+    unsigned char _b = 0;
+    unsigned char _a = 255;
+    int           _run = 0;
+    unsigned char _index[qoi_index_size * 4] = {};
+};
+
+
+vector_streambuf::vector_streambuf(std::vector<unsigned char>& data)
+: _data{data}
+{
+}
+
+
+std::streamsize
+vector_streambuf::xsputn(char const* bytes, std::streamsize count)
+{
+    _data.insert(_data.end(), bytes, bytes + count);
+    return count;
+}
+
+
+vector_streambuf::int_type
+vector_streambuf::overflow(int_type ch)
+{
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        _data.push_back(static_cast<unsigned char>(traits_type::to_char_type(ch)));
+    }
+    return traits_type::not_eof(ch);
+}
+
+
+std::unique_ptr<image_writer>
+make_image_writer(image_format format, std::ostream& stream, int width, int height, int compression)
+{
+    auto const size = std::to_string(width) + " " + std::to_string(height);
+
+    switch (format) {
+    case image_format::png:
+        return std::make_unique<png_writer>(stream, width, height, compression);
+
+    case image_format::raw:
+        return std::make_unique<packed_writer>(stream, width, height, 4, premultiplied_row, "");
+
+    case image_format::ppm:
+        return std::make_unique<packed_writer>(stream, width, height, 3, composited_row, "P6\n" + size + "\n255\n");
+
+    case image_format::pam:
+        return std::make_unique<packed_writer>(
+            stream, width, height, 4, unpremultiply_row,
+            "P7\nWIDTH " + std::to_string(width) + "\nHEIGHT " + std::to_string(height) +
+            "\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n"
+        );
+
+    case image_format::qoi:
+        return std::make_unique<qoi_writer>(stream, width, height);
+    }
+
+    throw std::logic_error{"unknown image format"};
+}
+
+
+image_format
+parse_image_format(std::string const& name)
+{
+    if (auto const format = find_image_format(name)) {
+        return *format;
+    }
+    throw std::runtime_error{"unknown image format: " + name};
+}
+
+
+// Returns the format implied by the extension of the file name. Unknown
+// extensions fall back to PNG.
+image_format
+guess_image_format(std::string const& filename)
+{
+    auto extension = std::filesystem::path{filename}.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char ch) {
+        return char(std::tolower(ch));
+    });
+
+    if (extension == ".rgba") {
+        return image_format::raw;
+    }
+    if (extension.empty()) {
+        return image_format::png;
+    }
+    return find_image_format(extension.substr(1)).value_or(image_format::png);
+}
+
+
+char const*
+image_format_extension(image_format format)
+{
+    switch (format) {
+    case image_format::png: return ".png";
+    case image_format::raw: return ".raw";
+    case image_format::ppm: return ".ppm";
+    case image_format::pam: return ".pam";
+    case image_format::qoi: return ".qoi";
+    }
+    return "";
+}
+
+
+std::optional<image_format>
+find_image_format(std::string const& name)
+{
+    for (auto const format : {image_format::png, image_format::raw, image_format::ppm, image_format::pam, image_format::qoi}) {
+        if (name == image_format_extension(format) + 1) {
+            return format;
+        }
+    }
+    return std::nullopt;
+}
+
+
+// Converts premultiplied pixels to non-premultiplied RGBA bytes.
+void
+unpremultiply_row(std::uint32_t const* pixels, int width, unsigned char* rgba)
+{
+    for (int x = 0; x < width; x++) {
+        auto const pixel = pixels[x];
+        auto const alpha = pixel >> 24;
+        auto const out = rgba + x * 4;
+
+        out[0] = unpremultiply((pixel >> 16) & 0xFF, alpha);
+        out[1] = unpremultiply((pixel >> 8) & 0xFF, alpha);
+        out[2] = unpremultiply(pixel & 0xFF, alpha);
+        out[3] = static_cast<unsigned char>(alpha);
+    }
+}
+
+
+void
+premultiplied_row(std::uint32_t const* pixels, int width, unsigned char* rgba)
+{
+    for (int x = 0; x < width; x++) {
+        auto const pixel = pixels[x];
+        auto const out = rgba + x * 4;
+
+        out[0] = static_cast<unsigned char>(pixel >> 16);
+        out[1] = static_cast<unsigned char>(pixel >> 8);
+        out[2] = static_cast<unsigned char>(pixel);
+        out[3] = static_cast<unsigned char>(pixel >> 24);
+    }
+}
+
+
+// Inverse of unpremultiply_row(). Rounding to nearest both ways gives back
+// the exact premultiplied pixels, since premultiplied channels never exceed
+// alpha.
+void
+premultiply_row(unsigned char const* rgba, int width, std::uint32_t* pixels)
+{
+    for (int x = 0; x < width; x++) {
+        auto const in = rgba + x * 4;
+        auto const alpha = std::uint32_t(in[3]);
+        pixels[x] = alpha << 24 | premultiply(in[0], alpha) << 16 | premultiply(in[1], alpha) << 8 | premultiply(in[2], alpha);
+    }
+}
+
+
+// Premultiplied color channels are the color composited over black.
+void
+composited_row(std::uint32_t const* pixels, int width, unsigned char* rgb)
+{
+    for (int x = 0; x < width; x++) {
+        auto const pixel = pixels[x];
+        auto const out = rgb + x * 3;
+
+        out[0] = static_cast<unsigned char>(pixel >> 16);
+        out[1] = static_cast<unsigned char>(pixel >> 8);
+        out[2] = static_cast<unsigned char>(pixel);
+    }
+}
+
+
+unsigned char
+unpremultiply(std::uint32_t value, std::uint32_t alpha)
+{
+    if (alpha == 0xFF) {
+        return static_cast<unsigned char>(value);
+    }
+    if (alpha == 0) {
+        return 0;
+    }
+    return static_cast<unsigned char>(std::min<std::uint32_t>((value * 255 + alpha / 2) / alpha, 255));
+}
+
+
+std::uint32_t
+premultiply(std::uint32_t value, std::uint32_t alpha)
+{
+    return (value * alpha + 127) / 255;
+}
+
+
+void
+write_bytes(std::ostream& stream, unsigned char const* data, std::size_t size)
+{
+    stream.write(reinterpret_cast<char const*>(data), std::streamsize(size));
+    if (!stream) {
+        throw std::runtime_error{"failed to write image"};
+    }
+}
+
+
+void
+check_complete(int rows_written, int height)
+{
+    if (rows_written != height) {
+        throw std::logic_error{"image is incomplete"};
+    }
+}
+
+
+void
+flush_stream(std::ostream& stream)
+{
+    if (!stream.flush()) {
+        throw std::runtime_error{"failed to write image"};
+    }
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include <blend2d.h>
+
+
+// Supported output image formats.
+enum class image_format
+{
+    png, // PNG, non-premultiplied RGBA
+    raw, // Headerless premultiplied RGBA bytes
+    ppm, // Binary PPM, RGB composited over black
+    pam, // PAM, non-premultiplied RGBA
+    qoi, // QOI, non-premultiplied RGBA
+};
+
+
+// Writes an image to a stream row by row, so that the whole image need not be
+// in memory. Rows are given as Blend2D images in premultiplied PRGB32 format
+// and must add up to the height given on construction.
+class image_writer
+{
+public:
+    virtual      ~image_writer() = default;
+    virtual void write_rows(BLImage const& rows) = 0;
+    virtual void finish() = 0;
+};
+
+
+// Stream buffer that appends the bytes written through it to a vector, so
+// that an image encoded in memory is written straight into its final buffer.
+class vector_streambuf : public std::streambuf
+{
+public:
+    explicit vector_streambuf(std::vector<unsigned char>& data);
+
+protected:
+    std::streamsize xsputn(char const* bytes, std::streamsize count) override;
+    int_type        overflow(int_type ch) override;
+
+private:
+    std::vector<unsigned char>& _data;
+};
+
+
+std::unique_ptr<image_writer> make_image_writer(
+    image_format format,
+    std::ostream& stream,
+    int width,
+    int height,
+    int compression
+);
+
+image_format parse_image_format(std::string const& name);
+image_format guess_image_format(std::string const& filename);
+char const*  image_format_extension(image_format format);
+void         premultiplied_row(std::uint32_t const* pixels, int width, unsigned char* rgba);
+void         unpremultiply_row(std::uint32_t const* pixels, int width, unsigned char* rgba);
+void         premultiply_row(unsigned char const* rgba, int width, std::uint32_t* pixels);
@@ -0,0 +1,295 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <new>
+#include <ostream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "plot.hpp"
+#include "quiver.h"
+#include "spec.hpp"
+
+
+// Arrows are gathered from the caller's arrays in chunks of this many.
+constexpr std::size_t gather_chunk_size = 65536;
+
+// Encoded images start in a buffer of this many bytes, which doubles as
+// needed.
+constexpr std::size_t initial_encode_capacity = 65536;
+
+
+struct quiver_session
+{
+    plot_session session;
+    std::string  error;
+};
+
+
+// Arrows in caller memory, gathered into chunks on each scan. Only a chunk
+// is held at a time, whatever the number of arrows.
+class strided_arrow_source : public arrow_source
+{
+public:
+    explicit strided_arrow_source(quiver_arrows const& arrows)
+    : _arrows{arrows}
+    {
+        if (!arrows.x.data || !arrows.y.data || !arrows.dx.data || !arrows.dy.data) {
+            throw std::runtime_error{"x, y, dx and dy are required"};
+        }
+    }
+
+    void scan(chunk_handler const& handler) override
+    {
+        for (std::size_t begin = 0; begin < _arrows.count; begin += gather_chunk_size) {
+            auto const end = std::min(begin + gather_chunk_size, _arrows.count);
+
+            arrow_columns columns;
+            gather(_arrows.x, begin, end, columns.x);
+            gather(_arrows.y, begin, end, columns.y);
+            gather(_arrows.dx, begin, end, columns.dx);
+            gather(_arrows.dy, begin, end, columns.dy);
+            gather(_arrows.w, begin, end, columns.w);
+            gather(_arrows.a, begin, end, columns.a);
+            gather(_arrows.c, begin, end, columns.c);
+            gather(_arrows.s, begin, end, columns.s);
+
+            _chunk.clear();
+            _chunk.append(std::move(columns));
+            handler(_chunk);
+        }
+    }
+
+private:
+    template<typename T>
+    static void gather(quiver_array const& array, std::size_t begin, std::size_t end, std::vector<T>& values)
+    {
+        if (!array.data) {
+            return;
+        }
+
+        auto const stride = array.stride;
+        auto const bytes = static_cast<unsigned char const*>(array.data);
+
+        values.resize(end - begin);
+        for (auto i = begin; i < end; i++) {
+            std::memcpy(&values[i - begin], bytes + std::ptrdiff_t(i) * stride, sizeof(T));
+        }
+    }
+
+    quiver_arrows const& _arrows;
+    arrow_store          _chunk;
+};
+
+
+// Stream buffer that collects bytes in memory from malloc(), so that an
+// encoded image is handed to the caller without a copy. Growing by realloc()
+// lets large buffers be remapped instead of copied. Memory that is not
+// released is freed on destruction.
+class malloc_streambuf : public std::streambuf
+{
+public:
+    ~malloc_streambuf() override
+    {
+        std::free(_data);
+    }
+
+    std::size_t size() const
+    {
+        return _size;
+    }
+
+    // Returns the bytes, shrunk to their size, which the caller frees. The
+    // buffer is never null.
+    unsigned char* release()
+    {
+        reserve(1);
+        if (auto const data = std::realloc(_data, std::max(_size, std::size_t(1)))) {
+            _data = static_cast<unsigned char*>(data);
+        }
+        _capacity = 0;
+        _size = 0;
+        return std::exchange(_data, nullptr);
+    }
+
+protected:
+    std::streamsize xsputn(char const* bytes, std::streamsize count) override
+    {
+        reserve(_size + std::size_t(count));
+        std::memcpy(_data + _size, bytes, std::size_t(count));
+        _size += std::size_t(count);
+        return count;
+    }
+
+    int_type overflow(int_type ch) override
+    {
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            auto const byte = traits_type::to_char_type(ch);
+            xsputn(&byte, 1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+private:
+    void reserve(std::size_t size)
+    {
+        if (size <= _capacity) {
+            return;
+        }
+        auto const capacity = std::max({size, 2 * _capacity, initial_encode_capacity});
+        auto const data = static_cast<unsigned char*>(std::realloc(_data, capacity));
+        if (!data) {
+            throw std::bad_alloc{};
+        }
+        _data = data;
+        _capacity = capacity;
+    }
+
+    unsigned char* _data     = nullptr;
+    std::size_t    _size     = 0;
+    std::size_t    _capacity = 0;
+};
+
+
+static quiver_spec parse_settings(char const* settings);
+template<typename F>
+static int         call(quiver_session* session, F const& function);
+
+
+quiver_session*
+quiver_session_create(void)
+{
+    try {
+        return new quiver_session;
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+
+void
+quiver_session_destroy(quiver_session* session)
+{
+    delete session;
+}
+
+
+char const*
+quiver_last_error(quiver_session const* session)
+{
+    return session->error.c_str();
+}
+
+
+int
+quiver_measure(
+    quiver_session* session,
+    char const* settings,
+    quiver_arrows const* arrows,
+    int* width,
+    int* height
+)
+{
+    return call(session, [&] {
+        auto const spec = parse_settings(settings);
+        strided_arrow_source source{*arrows};
+        auto const [plot_width, plot_height] = measure_quiver_plot(spec.rendering, source);
+        *width = plot_width;
+        *height = plot_height;
+    });
+}
+
+
+int
+quiver_render(
+    quiver_session* session,
+    char const* settings,
+    quiver_arrows const* arrows,
+    void* pixels,
+    ptrdiff_t stride,
+    quiver_pixel_format format
+)
+{
+    return call(session, [&] {
+        auto const spec = parse_settings(settings);
+        strided_arrow_source source{*arrows};
+        session->session.render(
+            spec.rendering,
+            spec.style,
+            source,
+            static_cast<unsigned char*>(pixels),
+            stride,
+            format == QUIVER_RGBA_PREMULTIPLIED
+        );
+    });
+}
+
+
+int
+quiver_encode(
+    quiver_session* session,
+    char const* settings,
+    quiver_arrows const* arrows,
+    unsigned char** data,
+    size_t* size
+)
+{
+    return call(session, [&] {
+        auto const spec = parse_settings(settings);
+        strided_arrow_source source{*arrows};
+
+        malloc_streambuf buffer;
+        std::ostream stream{&buffer};
+        stream.exceptions(std::ios::badbit);
+        session->session.encode(spec.rendering, spec.style, source, stream);
+
+        *size = buffer.size();
+        *data = buffer.release();
+    });
+}
+
+
+void
+quiver_free(void* data)
+{
+    std::free(data);
+}
+
+
+// Parses the rendering and style of a spec. Arrows in the settings are
+// ignored.
+quiver_spec
+parse_settings(char const* settings)
+{
+    if (!settings) {
+        return quiver_spec{};
+    }
+    auto spec = parse_quiver_spec(settings);
+    spec.arrows.clear();
+    spec.frames.clear();
+    return spec;
+}
+
+
+// Runs the function and turns exceptions into the error of the session.
+template<typename F>
+int
+call(quiver_session* session, F const& function)
+{
+    try {
+        function();
+        session->error.clear();
+        return QUIVER_OK;
+    } catch (std::exception const& error) {
+        session->error = error.what();
+    } catch (...) {
+        session->error = "unknown error";
+    }
+    return QUIVER_ERROR;
+}
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <chrono>
 #include <exception>
 #include <filesystem>
 #include <fstream>
@@ -5,23 +7,66 @@
 #include <optional>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <getopt.hpp>
 
+#include "image_writer.hpp"
+#include "mapped_file.hpp"
+#include "parallel.hpp"
 #include "plot.hpp"
+#include "profile.hpp"
+#include "raw_arrows.hpp"
 #include "spec.hpp"
 
 
+constexpr std::chrono::milliseconds watch_interval{250};
+
+
 struct program_options
 {
-    bool                       help = false;
-    std::optional<std::string> output;
-    std::string                spec;
+    bool                          help = false;
+    bool                          stream = false;
+    bool                          serve = false;
+    bool                          watch = false;
+    std::optional<std::string>    output;
+    std::optional<std::string>    format;
+    std::optional<int>            compression;
+    std::optional<int>            threads;
+    std::optional<int>            pyramid_levels;
+    std::optional<partition_spec> partition;
+    std::optional<std::string>    stats_format;
+    std::optional<std::string>    stats_file;
+    std::string                   spec;
+};
+
+
+// Destination of the statistics of each plot, if requested.
+class stats_output
+{
+public:
+    explicit stats_output(program_options const& options);
+
+    plot_profile* profile();
+    void          report();
+
+private:
+    bool          _enabled = false;
+    bool          _json = false;
+    std::ofstream _file;
+    plot_profile  _profile;
 };
 
 static void            show_usage();
 static program_options parse_options(int argc, char** argv);
-static quiver_spec     load_quiver_spec(std::string const& filename);
+static quiver_spec     load_quiver_spec(program_options const& options, plot_profile* profile);
+static void            produce_spec_file(program_options const& options, stats_output& stats);
+static void            apply_options(rendering_spec& rendering, program_options const& options);
+static int             parse_count(std::string const& str);
+static partition_spec  parse_partition(std::string const& str);
+static void            serve_requests(program_options const& options, stats_output& stats);
+static void            watch_spec(program_options const& options, stats_output& stats);
 
 
 int
@@ -43,17 +88,24 @@ main(int argc, char** argv)
             return 0;
         }
 
-        auto spec = load_quiver_spec(options.spec);
+        stats_output stats{options};
 
-        if (options.output) {
-            spec.rendering.output = *options.output;
+        if (options.serve) {
+            serve_requests(options, stats);
+        } else if (options.watch) {
+            watch_spec(options, stats);
+        } else if (options.stream) {
+            std::optional<quiver_spec_reader> reader;
+            {
+                phase_timer timer{stats.profile(), "decode"};
+                reader.emplace(options.spec);
+            }
+            apply_options(reader->rendering(), options);
+            produce_quiver_plot(reader->rendering(), reader->style(), *reader, stats.profile());
+            stats.report();
+        } else {
+            produce_spec_file(options, stats);
         }
-
-        if (!spec.rendering.output) {
-            spec.rendering.output = std::filesystem::path{options.spec}.replace_extension(".png");
-        }
-
-        produce_quiver_plot(spec);
     } catch (std::exception const& err) {
         std::cerr << "error: " << err.what() << '\n';
         return 1;
@@ -67,13 +119,31 @@ void
 show_usage()
 {
     std::string const usage =
-        "usage: quiver [-h] [-o output] spec\n"
+        "usage: quiver [-hsw] [-j threads] [-o output] [-f format] [-z level]\n"
+        "              [-P levels] [-p i/N] [-t stats] [-T stats_file] spec\n"
+        "       quiver -S [-j threads] [-f format] [-z level] [-t stats] [-T stats_file]\n"
         "\n"
-        "  spec       JSON file specifying the quiver plot to produce\n"
+        "  spec        JSON, CBOR or MessagePack file specifying the quiver plot\n"
+        "              to produce, or a raw arrow file\n"
         "\n"
         "options:\n"
-        "  -o output  Output PNG image file name\n"
-        "  -h         Print this help message and exit\n"
+        "  -j threads  Number of rendering and decoding threads (0 uses all cores)\n"
+        "  -o output   Output image file name, or - for stdout\n"
+        "  -f format   Output format: png, raw, ppm, pam or qoi\n"
+        "  -z level    PNG compression level from 0 to 9 (1 is fast)\n"
+        "  -P levels   Write map tiles of the given number of zoom levels to\n"
+        "              output/z/x/y for a web viewer\n"
+        "  -p i/N      Render only band i of N bands of image rows into a PAM\n"
+        "              image, for stitching with quiver-merge\n"
+        "  -t stats    Print timings and counts of each plot to stderr in the\n"
+        "              given format: text or json\n"
+        "  -T file     Write the statistics to a file instead of stderr\n"
+        "  -s          Stream arrows from the spec file in bounded memory\n"
+        "  -w          Watch the spec file and update the image on every change,\n"
+        "              redrawing only the region of changed arrows\n"
+        "  -S          Serve specs read from stdin, one JSON per line, and\n"
+        "              write images to stdout\n"
+        "  -h          Print this help message and exit\n"
         "\n";
     std::cerr << usage;
 }
@@ -85,17 +155,57 @@ parse_options(int argc, char** argv)
     program_options options;
     cxx::getopt getopt;
 
-    for (int ch; (ch = getopt(argc, argv, "ho:")) != -1; ) {
+    for (int ch; (ch = getopt(argc, argv, "hj:o:f:z:P:p:t:T:swS")) != -1; ) {
         switch (ch) {
         case 'h':
             // Stop parsing options if help is requested.
             options.help = true;
             return options;
 
+        case 'j':
+            options.threads = parse_count(getopt.optarg);
+            break;
+
         case 'o':
             options.output = getopt.optarg;
             break;
 
+        case 'f':
+            options.format = getopt.optarg;
+            break;
+
+        case 'z':
+            options.compression = parse_count(getopt.optarg);
+            break;
+
+        case 'P':
+            options.pyramid_levels = parse_count(getopt.optarg);
+            break;
+
+        case 'p':
+            options.partition = parse_partition(getopt.optarg);
+            break;
+
+        case 't':
+            options.stats_format = getopt.optarg;
+            break;
+
+        case 'T':
+            options.stats_file = getopt.optarg;
+            break;
+
+        case 's':
+            options.stream = true;
+            break;
+
+        case 'w':
+            options.watch = true;
+            break;
+
+        case 'S':
+            options.serve = true;
+            break;
+
         default:
             throw std::runtime_error{"unrecognized command-line option"};
         }
@@ -104,6 +214,18 @@ parse_options(int argc, char** argv)
     argc -= getopt.optind;
     argv += getopt.optind;
 
+    if (options.watch && (options.stream || options.serve)) {
+        throw std::runtime_error{"watch mode cannot be combined with -s or -S"};
+    }
+
+    // Specs come from stdin in the server mode.
+    if (options.serve) {
+        if (argc != 0) {
+            throw std::runtime_error{"spec file is not accepted in server mode"};
+        }
+        return options;
+    }
+
     // Require exactly one positional argument.
     if (argc != 1) {
         throw std::runtime_error{"spec file is not given"};
@@ -114,13 +236,290 @@ parse_options(int argc, char** argv)
 }
 
 
+// Loads the spec file in any format. Arrows are decoded with as many threads
+// as arrows are rendered with. A watched file is read rather than mapped,
+// since an editor may truncate it while it is parsed.
 quiver_spec
-load_quiver_spec(std::string const& filename)
+load_quiver_spec(program_options const& options, plot_profile* profile)
+{
+    std::optional<mapped_file> file;
+    {
+        phase_timer timer{profile, "load"};
+        file.emplace(options.spec, !options.watch);
+    }
+
+    phase_timer timer{profile, "decode"};
+    auto const format = guess_spec_format(options.spec, file->contents());
+    return parse_quiver_spec(file->contents(), resolve_thread_count(options.threads.value_or(1)), format);
+}
+
+
+// Produces the plot of the spec file. Raw arrow files are drawn from the
+// mapped columns rather than loaded.
+void
+produce_spec_file(program_options const& options, stats_output& stats)
+{
+    std::optional<mapped_file> file;
+    {
+        phase_timer timer{stats.profile(), "load"};
+        file.emplace(options.spec);
+    }
+
+    auto const format = guess_spec_format(options.spec, file->contents());
+    if (format == spec_format::raw) {
+        std::optional<raw_arrow_source> source;
+        {
+            phase_timer timer{stats.profile(), "decode"};
+            source.emplace(file->contents());
+        }
+        apply_options(source->rendering(), options);
+        produce_quiver_plot(source->rendering(), source->style(), *source, stats.profile());
+        stats.report();
+        return;
+    }
+
+    auto spec = [&] {
+        phase_timer timer{stats.profile(), "decode"};
+        return parse_quiver_spec(file->contents(), resolve_thread_count(options.threads.value_or(1)), format);
+    }();
+    file.reset();
+
+    apply_options(spec.rendering, options);
+    produce_quiver_plot(spec, stats.profile());
+    stats.report();
+}
+
+
+void
+apply_options(rendering_spec& rendering, program_options const& options)
+{
+    if (options.output) {
+        rendering.output = *options.output;
+    }
+
+    if (options.format) {
+        rendering.format = *options.format;
+    }
+
+    if (options.compression) {
+        rendering.compression = *options.compression;
+    }
+
+    if (options.threads) {
+        rendering.threads = *options.threads;
+    }
+
+    if (options.pyramid_levels) {
+        rendering.pyramid = rendering.pyramid.value_or(pyramid_spec{});
+        rendering.pyramid->levels = *options.pyramid_levels;
+    }
+
+    if (options.partition) {
+        rendering.partition = *options.partition;
+    }
+
+    // Bands are numbered with as many digits as the last band, so that the
+    // files sort in order.
+    if (!rendering.output && rendering.partition) {
+        auto const& partition = *rendering.partition;
+        auto const digits = std::to_string(std::max(partition.count - 1, 0)).size();
+        auto index = std::to_string(partition.index);
+        index.insert(0, digits - std::min(digits, index.size()), '0');
+        rendering.output = std::filesystem::path{options.spec}.replace_extension("." + index + ".pam").string();
+    }
+
+    // Tiles of a pyramid go to a directory named after the spec by default.
+    if (!rendering.output && rendering.pyramid) {
+        rendering.output = std::filesystem::path{options.spec}.replace_extension().string();
+    }
+    if (!rendering.output) {
+        auto const format = rendering.format ? parse_image_format(*rendering.format) : image_format::png;
+        rendering.output = std::filesystem::path{options.spec}.replace_extension(image_format_extension(format));
+    }
+}
+
+
+int
+parse_count(std::string const& str)
+{
+    std::size_t end;
+    int value = -1;
+    try {
+        value = std::stoi(str, &end);
+    } catch (std::exception const&) {
+        end = 0;
+    }
+    if (end != str.size() || value < 0) {
+        throw std::runtime_error{"invalid count: " + str};
+    }
+    return value;
+}
+
+
+// Parses a partition given as index/count.
+partition_spec
+parse_partition(std::string const& str)
+{
+    auto const slash = str.find('/');
+    if (slash == std::string::npos) {
+        throw std::runtime_error{"invalid partition: " + str};
+    }
+
+    partition_spec partition;
+    partition.index = parse_count(str.substr(0, slash));
+    partition.count = parse_count(str.substr(slash + 1));
+    if (partition.index >= partition.count) {
+        throw std::runtime_error{"invalid partition: " + str};
+    }
+    return partition;
+}
+
+
+// Renders specs read from stdin until EOF. Each line is a complete JSON spec.
+// For each request the response written to stdout is either "ok <size>\n"
+// followed by the image data of <size> bytes, or a line "error <message>\n".
+// The image buffer and the Blend2D runtime stay warm across requests.
+void
+serve_requests(program_options const& options, stats_output& stats)
+{
+    plot_session session;
+    session.set_profile(stats.profile());
+    std::string request;
+
+    while (std::getline(std::cin, request)) {
+        if (request.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+
+        try {
+            auto spec = [&] {
+                phase_timer timer{stats.profile(), "decode"};
+                return parse_quiver_spec(request);
+            }();
+            if (options.format) {
+                spec.rendering.format = *options.format;
+            }
+            if (options.compression) {
+                spec.rendering.compression = *options.compression;
+            }
+            if (options.threads) {
+                spec.rendering.threads = *options.threads;
+            }
+
+            auto const image = session.encode(spec);
+            std::cout << "ok " << image.size() << '\n';
+            std::cout.write(reinterpret_cast<char const*>(image.data()), std::streamsize(image.size()));
+        } catch (std::exception const& err) {
+            std::string message = err.what();
+            for (auto& ch : message) {
+                if (ch == '\n') {
+                    ch = ' ';
+                }
+            }
+            std::cout << "error " << message << '\n';
+        }
+
+        std::cout.flush();
+        stats.report();
+    }
+}
+
+
+// Produces the plot, then polls the spec file for changes and updates the
+// plot after each change until interrupted. The last spec that rendered is
+// kept, so that only changed arrows need to be redrawn. Errors are reported
+// and the file is watched further.
+void
+watch_spec(program_options const& options, stats_output& stats)
+{
+    plot_session session;
+    session.set_profile(stats.profile());
+
+    std::optional<quiver_spec> previous;
+    std::optional<std::filesystem::file_time_type> seen_time;
+    std::optional<std::filesystem::file_time_type> loaded_time;
+
+    for (;; std::this_thread::sleep_for(watch_interval)) {
+        std::error_code error;
+        auto const time = std::filesystem::last_write_time(options.spec, error);
+        if (error) {
+            continue;
+        }
+
+        // Wait for the file to stay unmodified for an interval, so that a
+        // file is not read while an editor is still writing it.
+        auto const settled = time == seen_time;
+        seen_time = time;
+        if (!settled || time == loaded_time) {
+            continue;
+        }
+        loaded_time = time;
+
+        try {
+            auto spec = load_quiver_spec(options, stats.profile());
+            apply_options(spec.rendering, options);
+
+            // Forget the image on failure, since it may be partly drawn.
+            auto last = std::move(previous);
+            previous.reset();
+            if (last) {
+                session.update(*last, spec);
+            } else if (!spec.frames.empty()) {
+                produce_quiver_animation(spec, stats.profile());
+            } else {
+                session.produce(spec);
+            }
+            previous = std::move(spec);
+        } catch (std::exception const& err) {
+            std::cerr << "error: " << err.what() << '\n';
+        }
+        stats.report();
+    }
+}
+
+
+stats_output::stats_output(program_options const& options)
 {
-    std::ifstream file{filename};
-    std::string json;
-    if (!std::getline(file, json, '\0')) {
-        throw std::runtime_error{"failed to load spec file"};
+    if (!options.stats_format && !options.stats_file) {
+        return;
+    }
+    _enabled = true;
+
+    auto const format = options.stats_format.value_or("text");
+    if (format != "text" && format != "json") {
+        throw std::runtime_error{"stats format must be text or json: " + format};
     }
-    return parse_quiver_spec(json);
+    _json = format == "json";
+
+    if (options.stats_file) {
+        _file.open(*options.stats_file);
+        if (!_file) {
+            throw std::runtime_error{"failed to open stats file " + *options.stats_file};
+        }
+    }
+}
+
+
+// Returns the profile to record into, or null if statistics are disabled so
+// that nothing is measured.
+plot_profile*
+stats_output::profile()
+{
+    return _enabled ? &_profile : nullptr;
+}
+
+
+// Writes the statistics recorded since the last report and starts over.
+void
+stats_output::report()
+{
+    if (!_enabled) {
+        return;
+    }
+    record_resource_usage(_profile);
+
+    auto& out = _file.is_open() ? static_cast<std::ostream&>(_file) : std::cerr;
+    write_profile(out, _profile, _json);
+    out.flush();
+    _profile.clear();
 }
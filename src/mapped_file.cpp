@@ -0,0 +1,94 @@
+#include <cstddef>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#if defined(__unix__) || defined(__APPLE__)
+# define QUIVER_USE_MMAP
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+#include "mapped_file.hpp"
+
+
+static bool map_file(std::string const& filename, void*& map, std::size_t& size);
+
+
+mapped_file::mapped_file(std::string const& filename, bool map)
+{
+    if (map && map_file(filename, _map, _size)) {
+        return;
+    }
+
+    std::ifstream file{filename, std::ios::binary};
+    if (!file) {
+        throw std::runtime_error{"failed to load spec file"};
+    }
+    _buffer.assign(std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{});
+    if (file.bad()) {
+        throw std::runtime_error{"failed to load spec file"};
+    }
+}
+
+
+mapped_file::~mapped_file()
+{
+#ifdef QUIVER_USE_MMAP
+    if (_map) {
+        munmap(_map, _size);
+    }
+#endif
+}
+
+
+std::string_view
+mapped_file::contents() const
+{
+    if (_map) {
+        return std::string_view{static_cast<char const*>(_map), _size};
+    }
+    return _buffer;
+}
+
+
+// Maps a nonempty regular file. Returns false if the file should be read
+// instead.
+bool
+map_file(std::string const& filename, void*& map, std::size_t& size)
+{
+#ifdef QUIVER_USE_MMAP
+    auto const fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat status;
+    if (fstat(fd, &status) != 0 || !S_ISREG(status.st_mode) || status.st_size == 0) {
+        close(fd);
+        return false;
+    }
+
+    auto const length = std::size_t(status.st_size);
+    auto const address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED) {
+        return false;
+    }
+
+    // The file is parsed front to back.
+    madvise(address, length, MADV_SEQUENTIAL);
+    map = address;
+    size = length;
+    return true;
+#else
+    (void) filename;
+    (void) map;
+    (void) size;
+    return false;
+#endif
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+
+// Read-only contents of a file, text or binary. Regular files are
+// memory-mapped where the platform supports it, so that the contents are not
+// copied. Other files, such as pipes and stdin, are read into memory, as are
+// all files if map is false. Mapped files must not be truncated while in use.
+class mapped_file
+{
+public:
+    explicit mapped_file(std::string const& filename, bool map = true);
+    ~mapped_file();
+
+    mapped_file(mapped_file const&) = delete;
+    mapped_file& operator=(mapped_file const&) = delete;
+
+    std::string_view contents() const;
+
+private:
+    void*       _map  = nullptr;
+    std::size_t _size = 0;
+    std::string _buffer;
+};
@@ -0,0 +1,426 @@
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <blend2d.h>
+
+#include "geometry.hpp"
+#include "painter.hpp"
+
+
+constexpr std::size_t vertex_batch_size   = 1024;
+constexpr std::size_t max_arrows_per_fill = 4096;
+
+
+static std::uint32_t compute_color(plot_style const& style, arrow_store const& arrows, std::size_t i);
+
+
+int
+plot_view::width() const
+{
+    return int(std::nearbyint((x_range.upper - x_range.lower) * pixels_per_length));
+}
+
+
+int
+plot_view::height() const
+{
+    return int(std::nearbyint((y_range.upper - y_range.lower) * pixels_per_length));
+}
+
+
+// Blend2D works with the top-to-bottom display coordinate system measured in
+// pixels. To use mathematical xy coordinate system with custom range, we set
+// up a transformation matrix. The offset shifts the origin to the given pixel
+// so that a part of the plot can be drawn into a smaller image.
+BLMatrix2D
+plot_view::matrix(int x_offset, int y_offset) const
+{
+    BLMatrix2D view_matrix;
+    view_matrix.reset();
+    view_matrix.translate(-x_offset, -y_offset);
+    view_matrix.scale(pixels_per_length);
+    view_matrix.translate(-x_range.lower, y_range.upper);
+    view_matrix.scale(1, -1);
+    return view_matrix;
+}
+
+
+// Returns the region in data coordinates that is drawn to the given pixels.
+BLBox
+plot_view::data_box(BLBoxI const& pixels) const
+{
+    return BLBox{
+        x_range.lower + pixels.x0 / pixels_per_length,
+        y_range.upper - pixels.y1 / pixels_per_length,
+        x_range.lower + pixels.x1 / pixels_per_length,
+        y_range.upper - pixels.y0 / pixels_per_length
+    };
+}
+
+
+void
+arrow_painter::begin(
+    BLContext& context,
+    plot_style const& style,
+    BLBox const& clip,
+    BLBoxI const& pixels,
+    unsigned threads
+)
+{
+    _context = &context;
+    _style = style;
+    _clip = clip;
+    _pixels = pixels;
+    _threads = threads;
+    _counts = paint_counts{};
+    _queued = false;
+
+    // Sprites are drawn in pixels of the target, so the shape is scaled by
+    // the transformation of the context.
+    if (_style.sprites.angles > 0) {
+        _pixel_matrix = context.userMatrix();
+        _pixel_matrix.postTransform(context.metaMatrix());
+
+        auto shape = _style.shape;
+        shape.shaft_width *= std::sqrt(std::abs(_pixel_matrix.determinant()));
+        _sprite_cache.reset(shape, _style.sprites);
+        context.targetImage()->getData(&_target);
+    }
+
+    // Outlines of all arrows have the same orientation, so the nonzero rule
+    // fills the union of overlapping arrows in a compound path.
+    _context->setCompOp(BL_COMP_OP_SRC_OVER);
+    _context->setFillRule(BL_FILL_RULE_NON_ZERO);
+
+    _path.clear();
+    _path.reserve(max_arrows_per_fill * arrow_command_count);
+    _path_arrows = 0;
+    _runs.reset(_style);
+    _vertices.resize(vertex_batch_size * arrow_vertex_count);
+}
+
+
+void
+arrow_painter::draw_background()
+{
+    _context->setCompOp(BL_COMP_OP_SRC_COPY);
+    _context->setFillStyle(BLRgba32{_style.background_color});
+    _context->fillAll();
+    _context->setCompOp(BL_COMP_OP_SRC_OVER);
+    _queued = true;
+}
+
+
+void
+arrow_painter::draw(arrow_store const& arrows)
+{
+    _counts.arrows += arrows.size();
+
+    if (_style.order != draw_order::input) {
+        _selection.clear();
+        for (std::size_t i = 0; i < arrows.size(); i++) {
+            if (is_visible(arrows, i)) {
+                _selection.push_back(i);
+            }
+        }
+        _counts.culled += arrows.size() - _selection.size();
+
+        draw_selected(arrows);
+        return;
+    }
+
+    // Arrows are drawn straight from the store unless some of the batch are
+    // culled. Culled arrows still count in the runs.
+    for (std::size_t batch = 0; batch < arrows.size(); batch += vertex_batch_size) {
+        auto const batch_end = std::min(batch + vertex_batch_size, arrows.size());
+
+        _batch_runs.clear();
+        _selection.clear();
+        for (auto i = batch; i < batch_end; i++) {
+            _batch_runs.push_back(_runs.next(arrows, i));
+            if (is_visible(arrows, i)) {
+                _selection.push_back(i);
+            }
+        }
+
+        if (_selection.size() == batch_end - batch) {
+            draw_batch(arrows, batch, batch_end, _batch_runs.data());
+            continue;
+        }
+        _counts.culled += batch_end - batch - _selection.size();
+
+        _gathered.clear();
+        for (std::size_t k = 0; k < _selection.size(); k++) {
+            _gathered.push_back(arrows.get(_selection[k]));
+            _batch_runs[k] = _batch_runs[_selection[k] - batch];
+        }
+        draw_batch(_gathered, 0, _gathered.size(), _batch_runs.data());
+    }
+}
+
+
+// Draws the arrows at the given indices, in the order of the indices.
+void
+arrow_painter::draw(
+    arrow_store const& arrows,
+    std::uint32_t const* indices,
+    std::size_t count,
+    std::uint32_t const* runs
+)
+{
+    _counts.arrows += count;
+
+    if (_style.order != draw_order::input || !runs) {
+        _selection.clear();
+        for (std::size_t k = 0; k < count; k++) {
+            if (is_visible(arrows, indices[k])) {
+                _selection.push_back(indices[k]);
+            }
+        }
+        _counts.culled += count - _selection.size();
+
+        draw_selected(arrows);
+        return;
+    }
+
+    for (std::size_t batch = 0; batch < count; batch += vertex_batch_size) {
+        auto const batch_end = std::min(batch + vertex_batch_size, count);
+
+        _gathered.clear();
+        _batch_runs.clear();
+        for (auto k = batch; k < batch_end; k++) {
+            if (is_visible(arrows, indices[k])) {
+                _gathered.push_back(arrows.get(indices[k]));
+                _batch_runs.push_back(runs[indices[k]]);
+            }
+        }
+        _counts.culled += batch_end - batch - _gathered.size();
+
+        draw_batch(_gathered, 0, _gathered.size(), _batch_runs.data());
+    }
+}
+
+
+void
+arrow_painter::end()
+{
+    fill();
+    _context = nullptr;
+}
+
+
+paint_counts const&
+arrow_painter::counts() const
+{
+    return _counts;
+}
+
+
+bool
+arrow_painter::is_visible(arrow_store const& arrows, std::size_t i) const
+{
+    auto const box = bound_arrow(arrows, i, _style.shape);
+    return box.x1 >= _clip.x0 && box.x0 <= _clip.x1 && box.y1 >= _clip.y0 && box.y0 <= _clip.y1;
+}
+
+
+std::uint32_t
+arrow_painter::color_of(arrow_store const& arrows, std::size_t i) const
+{
+    return compute_color(_style, arrows, i);
+}
+
+
+// Draws the selected arrows. With "any" order, arrows are sorted by color so
+// that arrows sharing a color, not only consecutive ones, end up in the same
+// fill call. With "spatial" order, arrows drawn in a row lie close together,
+// which keeps the rasterizer working on the same part of the image.
+void
+arrow_painter::draw_selected(arrow_store const& arrows)
+{
+    if (_style.order == draw_order::any) {
+        std::stable_sort(_selection.begin(), _selection.end(), [&](std::size_t i, std::size_t j) {
+            return color_of(arrows, i) < color_of(arrows, j);
+        });
+    } else if (_style.order == draw_order::spatial) {
+        _sorter.sort(arrows, _clip, _selection, _threads);
+    }
+
+    draw_gathered(arrows, _selection.data(), _selection.size());
+}
+
+
+void
+arrow_painter::draw_gathered(arrow_store const& arrows, std::size_t const* indices, std::size_t count)
+{
+    for (std::size_t batch = 0; batch < count; batch += vertex_batch_size) {
+        auto const batch_end = std::min(batch + vertex_batch_size, count);
+
+        _gathered.clear();
+        for (auto k = batch; k < batch_end; k++) {
+            _gathered.push_back(arrows.get(indices[k]));
+        }
+        draw_batch(_gathered, 0, _gathered.size(), nullptr);
+    }
+}
+
+
+// Draws arrows, merging the arrows of a run, or without runs, consecutive
+// arrows of the same opaque color.
+void
+arrow_painter::draw_batch(arrow_store const& arrows, std::size_t begin, std::size_t end, std::uint32_t const* runs)
+{
+    compute_arrow_vertices(arrows, begin, end, _style.shape, _vertices.data());
+
+    for (auto i = begin; i < end; i++) {
+        auto const color = color_of(arrows, i);
+        auto const outline = _vertices.data() + (i - begin) * arrow_vertex_count;
+        auto const dot = _style.dot_length > 0 && measure_arrow_outline(outline) < _style.dot_length;
+
+        if (!dot && draw_sprite(arrows, i, color)) {
+            continue;
+        }
+
+        // Overlapping arrows in a single fill are painted once, so only
+        // opaque arrows are merged. Their overlapping edges are still
+        // antialiased as one outline, unlike arrows drawn one over another.
+        auto const opaque = (color >> 24) == 0xFF;
+        auto const run = runs ? runs[i - begin] : 0;
+        if (_path_arrows > 0) {
+            auto const merged = runs
+                ? run == _path_run
+                : color == _path_color && opaque && _path_arrows < max_arrows_per_fill;
+            if (!merged) {
+                fill();
+            }
+        }
+
+        if (dot) {
+            append_arrow_dot(_path, outline);
+            _counts.dots++;
+        } else {
+            append_arrow_outline(_path, outline);
+        }
+        _path_color = color;
+        _path_run = run;
+        _path_arrows++;
+    }
+}
+
+
+// Draws the arrow from its sprite if sprites are enabled and the arrow has
+// the default shape. Returns false if the arrow is to be drawn as a path.
+bool
+arrow_painter::draw_sprite(arrow_store const& arrows, std::size_t i, std::uint32_t color)
+{
+    if (_style.sprites.angles == 0 || arrows.has_width(i) || arrows.has_aspect(i)) {
+        return false;
+    }
+
+    double const x = arrows.x()[i];
+    double const y = arrows.y()[i];
+    auto const tail = _pixel_matrix.mapPoint(x, y);
+    auto const head = _pixel_matrix.mapPoint(x + arrows.dx()[i], y + arrows.dy()[i]);
+
+    BLPointI position;
+    auto const sprite = _sprite_cache.find(tail, head - tail, position);
+    if (!sprite) {
+        return false;
+    }
+
+    // Arrows before this one must be in the pixels first.
+    fill();
+    if (_queued) {
+        _context->flush(BL_CONTEXT_FLUSH_SYNC);
+        _queued = false;
+    }
+
+    _sprite_cache.draw(_target, _pixels, *sprite, position, color);
+    _counts.sprites++;
+    return true;
+}
+
+
+void
+arrow_painter::fill()
+{
+    if (_path_arrows == 0) {
+        return;
+    }
+
+    _context->setFillStyle(BLRgba32{_path_color});
+    _context->fillPath(_path);
+    _counts.fills++;
+    _queued = true;
+    _path.clear();
+    _path_arrows = 0;
+}
+
+
+void
+arrow_runs::reset(plot_style const& style)
+{
+    _style = &style;
+    _run = 0;
+    _arrows = 0;
+}
+
+
+std::uint32_t
+arrow_runs::next(arrow_store const& arrows, std::size_t i)
+{
+    auto const color = compute_color(*_style, arrows, i);
+    auto const single =
+        (color >> 24) != 0xFF ||
+        (_style->sprites.angles > 0 && !arrows.has_width(i) && !arrows.has_aspect(i));
+
+    if (single || _arrows == 0 || color != _color || _arrows == max_arrows_per_fill) {
+        _run++;
+        _arrows = 0;
+    }
+    _color = color;
+    _arrows = single ? 0 : _arrows + 1;
+    return _run;
+}
+
+
+// Returns the color of an arrow. A color given with the arrow takes
+// precedence over the colormap. Arrows without the mapped scalar get the
+// arrow color.
+std::uint32_t
+compute_color(plot_style const& style, arrow_store const& arrows, std::size_t i)
+{
+    auto const colors = arrows.color();
+    if (colors && arrows.has_color(i)) {
+        return colors[i];
+    }
+
+    double value = 0;
+    switch (style.color_by) {
+    case color_source::none:
+        return style.arrow_color;
+
+    case color_source::magnitude:
+        value = std::hypot(arrows.dx()[i], arrows.dy()[i]);
+        break;
+
+    case color_source::angle:
+        value = std::atan2(arrows.dy()[i], arrows.dx()[i]);
+        break;
+
+    case color_source::scalar:
+        if (!arrows.scalar() || !arrows.has_scalar(i)) {
+            return style.arrow_color;
+        }
+        value = arrows.scalar()[i];
+        break;
+    }
+
+    auto const& limits = style.color_limits;
+    return style.color_map.map((value - limits.lower) / (limits.upper - limits.lower));
+}
+
+
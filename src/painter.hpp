@@ -0,0 +1,164 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <blend2d.h>
+
+#include "colormap.hpp"
+#include "geometry.hpp"
+#include "spatial_sort.hpp"
+#include "sprite_cache.hpp"
+#include "spec.hpp"
+
+
+// Order in which arrows are submitted for drawing.
+enum class draw_order
+{
+    input,   // As given in the spec
+    any,     // Grouped by color
+    spatial, // Along a Z-order curve through the tails
+};
+
+
+// Mapping from data coordinates to the pixels of a plot.
+struct plot_view
+{
+    double     pixels_per_length = 0;
+    range_spec x_range;
+    range_spec y_range;
+
+    int        width() const;
+    int        height() const;
+    BLMatrix2D matrix(int x_offset = 0, int y_offset = 0) const;
+    BLBox      data_box(BLBoxI const& pixels) const;
+};
+
+
+// Resolved style of arrows shared by all painters of a plot.
+struct plot_style
+{
+    std::uint32_t background_color = 0;
+    std::uint32_t arrow_color      = 0;
+    arrow_shape   shape;
+    draw_order    order = draw_order::input;
+
+    // Arrows that fit in a square of this size are drawn as dots. Zero
+    // draws every arrow in full.
+    double dot_length = 0;
+
+    // Arrows of the default shape are drawn from cached sprites if enabled.
+    sprite_options sprites;
+
+    // Arrows without a color of their own are colored by mapping a quantity
+    // in the limits to the colormap, unless the source is none.
+    color_source color_by = color_source::none;
+    range_spec   color_limits;
+    colormap     color_map;
+};
+
+
+// Numbers of arrows and fills since the painter began drawing.
+struct paint_counts
+{
+    std::size_t arrows  = 0; // Arrows given to draw
+    std::size_t culled  = 0; // Arrows skipped outside the clip box
+    std::size_t dots    = 0; // Arrows drawn as dots
+    std::size_t sprites = 0; // Arrows drawn from sprites
+    std::size_t fills   = 0; // Fill calls on the context
+};
+
+
+// Numbers the runs of arrows that are filled at once when drawn in input
+// order: consecutive arrows of the same opaque color, up to a limit.
+// Translucent arrows and arrows that may be drawn from sprites are runs of
+// their own. Runs are numbered over every arrow, culled or not, so that
+// drawing a part of a plot fills the same unions as drawing all of it.
+class arrow_runs
+{
+public:
+    void          reset(plot_style const& style);
+    std::uint32_t next(arrow_store const& arrows, std::size_t i);
+
+private:
+    plot_style const* _style  = nullptr;
+    std::uint32_t     _run    = 0;
+    std::uint32_t     _color  = 0;
+    std::size_t       _arrows = 0; // Arrows in the run, 0 once it is closed
+};
+
+
+// Draws arrows on a rendering context. Arrows outside the clip box, given in
+// data coordinates, are skipped. Consecutive arrows of the same opaque color
+// are merged into a compound path and filled at once, which changes the
+// antialiasing where they overlap; in input order, these are the arrow runs,
+// so that skipped arrows do not change the fills. Arrows drawn from sprites
+// are composited straight into the pixels of the target image, within the
+// pixel box. The painter keeps its buffers and sprites across plots, so it is
+// cheap to reuse. Painters are not thread safe; parallel rendering uses one
+// painter per thread. Threads given to begin() are only used to sort arrows
+// in spatial order.
+class arrow_painter
+{
+public:
+    void begin(
+        BLContext& context,
+        plot_style const& style,
+        BLBox const& clip,
+        BLBoxI const& pixels,
+        unsigned threads = 1
+    );
+    void draw_background();
+    void draw(arrow_store const& arrows);
+    void end();
+
+    // Draws the arrows at the given indices. Runs, if given, are the runs of
+    // all arrows of the store, which are filled as in drawing all of them.
+    void draw(
+        arrow_store const& arrows,
+        std::uint32_t const* indices,
+        std::size_t count,
+        std::uint32_t const* runs = nullptr
+    );
+
+    paint_counts const& counts() const;
+
+private:
+    bool          is_visible(arrow_store const& arrows, std::size_t i) const;
+    std::uint32_t color_of(arrow_store const& arrows, std::size_t i) const;
+    void draw_selected(arrow_store const& arrows);
+    void draw_gathered(arrow_store const& arrows, std::size_t const* indices, std::size_t count);
+    void draw_batch(arrow_store const& arrows, std::size_t begin, std::size_t end, std::uint32_t const* runs);
+    bool draw_sprite(arrow_store const& arrows, std::size_t i, std::uint32_t color);
+    void fill();
+
+private:
+    BLContext*   _context = nullptr;
+    plot_style   _style;
+    BLBox        _clip;
+    BLBoxI       _pixels;
+    unsigned     _threads = 1;
+    paint_counts _counts;
+
+    // Sprites and the pixels they are composited into. Drawing queued on the
+    // context is flushed before compositing.
+    sprite_cache _sprite_cache;
+    BLMatrix2D   _pixel_matrix;
+    BLImageData  _target;
+    bool         _queued = false;
+
+    // Arrows of the same color accumulated in a compound path
+    BLPath        _path;
+    std::uint32_t _path_color  = 0;
+    std::uint32_t _path_run    = 0;
+    std::size_t   _path_arrows = 0;
+    arrow_runs    _runs;
+
+    // Scratch buffers reused across batches
+    std::vector<BLPoint>       _vertices;
+    std::vector<std::size_t>   _selection;
+    arrow_store                _gathered;
+    std::vector<std::uint32_t> _batch_runs;
+    spatial_sorter             _sorter;
+};
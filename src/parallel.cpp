@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "parallel.hpp"
+
+
+// Range of indices yet to be processed by a worker.
+struct work_range
+{
+    std::mutex  mutex;
+    std::size_t begin = 0;
+    std::size_t end   = 0;
+};
+
+
+static bool pop_front(work_range& range, std::size_t& index);
+static bool steal_back(work_range& victim, work_range& thief);
+
+
+void
+parallel_for(
+    std::size_t count,
+    unsigned threads,
+    std::function<void(std::size_t index, unsigned worker)> const& task
+)
+{
+    threads = unsigned(std::min<std::size_t>(std::max(threads, 1u), std::max<std::size_t>(count, 1)));
+
+    if (threads == 1) {
+        for (std::size_t index = 0; index < count; index++) {
+            task(index, 0);
+        }
+        return;
+    }
+
+    std::unique_ptr<work_range[]> ranges{new work_range[threads]};
+    for (unsigned worker = 0; worker < threads; worker++) {
+        ranges[worker].begin = count * worker / threads;
+        ranges[worker].end = count * (worker + 1) / threads;
+    }
+
+    std::atomic<bool>  stop{false};
+    std::exception_ptr error;
+    std::mutex         error_mutex;
+
+    auto const work = [&](unsigned worker) {
+        auto& own = ranges[worker];
+
+        while (!stop) {
+            std::size_t index;
+
+            if (!pop_front(own, index)) {
+                bool stolen = false;
+                for (unsigned k = 1; k < threads && !stolen; k++) {
+                    stolen = steal_back(ranges[(worker + k) % threads], own);
+                }
+                if (!stolen) {
+                    break;
+                }
+                continue;
+            }
+
+            try {
+                task(index, worker);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock{error_mutex};
+                if (!error) {
+                    error = std::current_exception();
+                }
+                stop = true;
+            }
+        }
+    };
+
+    std::vector<std::thread> helpers;
+    for (unsigned worker = 1; worker < threads; worker++) {
+        helpers.emplace_back(work, worker);
+    }
+    work(0);
+
+    for (auto& helper : helpers) {
+        helper.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+
+unsigned
+resolve_thread_count(int threads)
+{
+    if (threads > 0) {
+        return unsigned(threads);
+    }
+    return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+
+bool
+pop_front(work_range& range, std::size_t& index)
+{
+    std::lock_guard<std::mutex> lock{range.mutex};
+    if (range.begin == range.end) {
+        return false;
+    }
+    index = range.begin++;
+    return true;
+}
+
+
+bool
+steal_back(work_range& victim, work_range& thief)
+{
+    std::size_t begin;
+    std::size_t end;
+    {
+        std::lock_guard<std::mutex> lock{victim.mutex};
+        if (victim.begin == victim.end) {
+            return false;
+        }
+        begin = victim.begin + (victim.end - victim.begin) / 2;
+        end = victim.end;
+        victim.end = begin;
+    }
+
+    std::lock_guard<std::mutex> lock{thief.mutex};
+    thief.begin = begin;
+    thief.end = end;
+    return true;
+}
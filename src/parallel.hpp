@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+
+// Calls task(index, worker) for every index in [0, count) using the given
+// number of worker threads. worker is in [0, threads) and identifies the
+// calling thread, so tasks can keep per-worker state. Each worker starts with
+// a contiguous range of indices and steals half of the remaining range of
+// another worker when it runs out. The first exception thrown by a task stops
+// all workers and is rethrown.
+void parallel_for(
+    std::size_t count,
+    unsigned threads,
+    std::function<void(std::size_t index, unsigned worker)> const& task
+);
+
+
+// Returns the number of threads to use for a thread count given in a spec,
+// where zero means all available cores.
+unsigned resolve_thread_count(int threads);
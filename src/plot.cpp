@@ -1,252 +1,1529 @@
 #include <algorithm>
 #include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <tuple>
 #include <utility>
+#include <vector>
 
 #include <blend2d.h>
 
+#include "aggregate.hpp"
+#include "arrow_index.hpp"
+#include "colormap.hpp"
+#include "geometry.hpp"
+#include "image_writer.hpp"
+#include "painter.hpp"
+#include "parallel.hpp"
 #include "plot.hpp"
+#include "profile.hpp"
+
+
+constexpr int         default_image_size          = 1000;
+constexpr color_spec  default_background_color    = {1, 1, 1, 0};
+constexpr color_spec  default_arrow_color         = {0, 0, 0, 1};
+constexpr double      default_stem_to_shaft_ratio = 3;
+constexpr double      default_head_aspect_ratio   = 1.618;
+constexpr int         default_thread_count        = 1;
+constexpr char const* default_order               = "input";
+constexpr char const* default_colormap            = "viridis";
+constexpr int         default_compression         = 6;
+constexpr char const* standard_output             = "-";
+constexpr unsigned    command_queue_per_thread    = 1024;
+constexpr int         min_frame_number_width      = 4;
+constexpr std::size_t max_changed_regions         = 16;
+constexpr int         default_pyramid_tile_size   = 256;
+constexpr int         max_pyramid_levels          = 24;
+constexpr std::size_t gather_chunk_size           = 65536;
+constexpr int         default_sprite_angles       = 256;
+constexpr double      default_sprite_length_step  = 0.25;
+constexpr int         default_sprite_subpixels    = 4;
+constexpr double      default_sprite_max_size     = 32;
+constexpr double      default_sprite_cache_size   = 64;
+
+
+// Drawing state of one thread rendering tiles.
+struct tile_worker
+{
+    BLContext     context;
+    arrow_painter painter;
+};
 
 
-constexpr int        default_image_size          = 1000;
-constexpr color_spec default_background_color    = {1, 1, 1, 0};
-constexpr color_spec default_arrow_color         = {0, 0, 0, 1};
-constexpr double     default_stem_to_shaft_ratio = 3;
-constexpr double     default_head_aspect_ratio   = 1.618;
+// Image and drawing buffers that outlive a single plot.
+struct plot_canvas
+{
+    BLImage                  image;
+    std::optional<plot_view> view;         // View of the complete plot in the image
+    range_spec               color_limits; // Colormap limits of that plot
+    BLContext                context;
+    arrow_painter            painter;
+    std::vector<tile_worker> tile_workers;
+};
+
+
+// Arrow indices grouped by the rows of tiles the arrows overlap. Indices of
+// row r are indices[offsets[r]] to indices[offsets[r + 1]], in input order.
+// Arrows drawn in input order also have their fill runs.
+struct tile_bins
+{
+    std::vector<std::size_t>   offsets;
+    std::vector<std::uint32_t> indices;
+    std::vector<std::uint32_t> runs;
+};
 
 
 class quiver_plot
 {
 public:
-    explicit quiver_plot(quiver_spec const& spec);
-    void     run();
+    quiver_plot(
+        rendering_spec const& rendering,
+        style_spec const& style,
+        arrow_source& arrows,
+        plot_canvas& canvas,
+        plot_profile* profile
+    );
+    void     produce();
+    void     update(arrow_store const& previous);
+    void     render();
+    void     save();
+    void     encode(std::ostream& stream);
+
+    plot_view const& view() const;
 
 private:
-    void setup_geometry();
     void setup_style();
+    void setup_options();
+    void setup_colors();
+    void setup_aggregation();
     void setup_image();
-    void init_context();
-    void draw_background();
-    void draw_arrows();
-    void save();
-
-    std::pair<range_spec, range_spec> estimate_data_range() const;
+    void draw(BLBoxI const& pixels);
+    std::vector<BLBoxI> find_changed_regions(arrow_store const& previous, arrow_store const& current) const;
+    void render_tiles();
+    void render_tile_row(arrow_store const& arrows, tile_bins const& bins, std::size_t row, BLImage& band, int y);
+    void bin_tile_rows(arrow_store const& arrows, tile_bins& bins) const;
+    BLBoxI compute_pixel_bounds(arrow_store const& arrows, std::size_t i) const;
+    void   record_counts(paint_counts const& counts);
+    arrow_source& source();
 
 private:
     // Drawing
-    BLImage     _image;
-    BLContext   _context;
-    std::string _output;
+    plot_canvas&  _canvas;
+    plot_profile* _profile;
+    std::string  _output;
+    image_format _format = image_format::png;
+    int          _compression = 0;
+    unsigned     _threads = 0;
+    int          _tile_size = 0;
 
     // Raw spec
-    quiver_spec _spec;
-
-    // Canvas geometry
-    double     _pixels_per_length;
-    range_spec _x_range;
-    range_spec _y_range;
-
-    // Style
-    color_spec _background_color;
-    color_spec _arrow_color;
-    double     _shaft_width         = 0;
-    double     _stem_to_shaft_ratio = 0;
-    double     _head_aspect_ratio   = 0;
+    rendering_spec _rendering;
+    style_spec     _style;
+    arrow_source&  _arrows;
+
+    // Resolved view and style
+    plot_view  _view;
+    plot_style _plot_style;
+
+    // Rows of the plot held by the image, all of them unless partitioned
+    int _band_begin = 0;
+    int _band_end = 0;
+
+    // Arrows aggregated into grid cells, drawn in place of the input
+    arrow_store                   _aggregated;
+    std::unique_ptr<arrow_source> _aggregated_source;
+
+    // Tiles of the current row
+    std::vector<std::vector<std::uint32_t>> _tile_indices;
+};
+
+
+static void                              validate_spec(bool condition, std::string const& message);
+static unsigned                          resolve_rendering_threads(rendering_spec const& rendering);
+static bool                              same_view(plot_view const& a, plot_view const& b);
+static plot_view                         resolve_view(rendering_spec const& rendering, arrow_source& arrows, plot_profile* profile);
+static std::pair<range_spec, range_spec> estimate_data_range(arrow_source& arrows);
+static range_spec                        estimate_color_limits(arrow_source& arrows, color_source source);
+static void                              produce_quiver_views(
+    rendering_spec const& rendering,
+    std::vector<rendering_spec> const& renders,
+    style_spec const& style,
+    arrow_store const& arrows,
+    plot_profile* profile
+);
+static std::string                       make_frame_filename(std::string const& output, std::size_t index, std::size_t count);
+static std::ostream&                     open_output(std::string const& output, std::ofstream& file);
+
+
+// Arrows of an in-memory spec, delivered as a single chunk.
+class store_arrow_source : public arrow_source
+{
+public:
+    explicit store_arrow_source(arrow_store const& arrows)
+    : _arrows{arrows}
+    {
+    }
+
+    void scan(chunk_handler const& handler) override
+    {
+        if (!_arrows.empty()) {
+            handler(_arrows);
+        }
+    }
+
+    arrow_store const* resident() const override
+    {
+        return &_arrows;
+    }
+
+private:
+    arrow_store const& _arrows;
+};
+
+
+// Arrows of the whole spec followed by the arrows of one or all frames.
+class frame_arrow_source : public arrow_source
+{
+public:
+    frame_arrow_source(quiver_spec const& spec, std::optional<std::size_t> frame)
+    : _spec{spec}, _frame{frame}
+    {
+    }
+
+    void scan(chunk_handler const& handler) override
+    {
+        if (!_spec.arrows.empty()) {
+            handler(_spec.arrows);
+        }
+        for (std::size_t index = 0; index < _spec.frames.size(); index++) {
+            auto const& arrows = _spec.frames[index].arrows;
+            if ((!_frame || index == *_frame) && !arrows.empty()) {
+                handler(arrows);
+            }
+        }
+    }
+
+private:
+    quiver_spec const&         _spec;
+    std::optional<std::size_t> _frame;
+};
+
+
+// Arrows of a store at the given indices, gathered into chunks on each scan.
+class index_arrow_source : public arrow_source
+{
+public:
+    index_arrow_source(arrow_store const& arrows, std::vector<std::uint32_t> const& indices)
+    : _arrows{arrows}, _indices{indices}
+    {
+    }
+
+    void scan(chunk_handler const& handler) override
+    {
+        for (std::size_t begin = 0; begin < _indices.size(); begin += gather_chunk_size) {
+            auto const end = std::min(begin + gather_chunk_size, _indices.size());
+
+            _chunk.clear();
+            for (auto k = begin; k < end; k++) {
+                _chunk.push_back(_arrows.get(_indices[k]));
+            }
+            handler(_chunk);
+        }
+    }
+
+private:
+    arrow_store const&                _arrows;
+    std::vector<std::uint32_t> const& _indices;
+    arrow_store                       _chunk;
 };
 
 
-template<typename T>
-static T        round(double x);
-static void     validate_spec(bool condition, std::string const& message);
-static BLRgba32 make_color(color_spec const& spec);
-static BLPath   make_arrow_path(double length, double shaft_width, double stem_to_shaft_ratio, double head_aspect_ratio);
+// Renders the images of many views of the same arrows, such as the renders of
+// a spec and the tiles of a pyramid. Settings that depend on the data are
+// resolved once over all arrows, and arrows are indexed once, so that each
+// view only visits the arrows it may show. Views are rendered in parallel,
+// each on a single-threaded context.
+class view_renderer
+{
+public:
+    view_renderer(style_spec const& style, arrow_store const& arrows, unsigned threads, plot_profile* profile);
+
+    range_spec const& x_range() const;
+    range_spec const& y_range() const;
+
+    // Returns which views were rendered. Tiles that no arrow reaches are
+    // skipped, and the directories of tiles are created as they are written.
+    std::vector<char> render(std::vector<rendering_spec> const& views, bool tiles);
+
+private:
+    bool render_view(rendering_spec const& view, bool tiles, unsigned worker);
+
+private:
+    style_spec                              _style;
+    arrow_store const&                      _arrows;
+    plot_profile*                           _profile;
+    range_spec                              _x_range;
+    range_spec                              _y_range;
+    std::optional<arrow_index>              _index;
+    std::vector<plot_session>               _sessions;
+    std::vector<std::vector<std::uint32_t>> _indices;
+};
 
 
 void
-produce_quiver_plot(quiver_spec const& spec)
+produce_quiver_plot(quiver_spec const& spec, plot_profile* profile)
 {
-    quiver_plot{spec}.run();
+    if (!spec.renders.empty() || spec.rendering.pyramid) {
+        if (!spec.frames.empty()) {
+            throw std::runtime_error{"renders and pyramid cannot be combined with frames"};
+        }
+        produce_quiver_views(spec.rendering, spec.renders, spec.style, spec.arrows, profile);
+    } else if (spec.frames.empty()) {
+        plot_session session;
+        session.set_profile(profile);
+        session.produce(spec);
+    } else {
+        produce_quiver_animation(spec, profile);
+    }
 }
 
 
-quiver_plot::quiver_plot(quiver_spec const& spec)
-: _spec{spec}
+void
+produce_quiver_animation(quiver_spec const& spec, plot_profile* profile)
 {
-    setup_geometry();
-    setup_style();
-    setup_image();
+    validate_spec(!spec.rendering.partition, "partition cannot be combined with frames");
+    auto const threads = resolve_rendering_threads(spec.rendering);
+    auto rendering = spec.rendering;
+
+    // All frames share the same view so that they line up when played.
+    if (!rendering.x_range || !rendering.y_range) {
+        phase_timer timer{profile, "range"};
+        frame_arrow_source all_arrows{spec, std::nullopt};
+        auto const [data_x_range, data_y_range] = estimate_data_range(all_arrows);
+        rendering.x_range = rendering.x_range.value_or(data_x_range);
+        rendering.y_range = rendering.y_range.value_or(data_y_range);
+    }
+
+    // Likewise for the colors.
+    auto style = spec.style;
+    if (style.color_by && !style.color_limits) {
+        phase_timer timer{profile, "limits"};
+        frame_arrow_source all_arrows{spec, std::nullopt};
+        style.color_limits = estimate_color_limits(all_arrows, parse_color_source(*style.color_by));
+    }
+
+    if (!rendering.output) {
+        throw std::runtime_error{"output image is not specified"};
+    }
+
+    // Frames are rendered in parallel, each on a single-threaded context.
+    rendering.threads = 1;
+
+    std::vector<plot_session> sessions(threads);
+    for (auto& session : sessions) {
+        session.set_profile(profile);
+    }
+
+    if (*rendering.output != standard_output) {
+        parallel_for(spec.frames.size(), threads, [&](std::size_t index, unsigned worker) {
+            thread_cpu_scope scope;
+            auto frame_rendering = rendering;
+            frame_rendering.output = make_frame_filename(*rendering.output, index, spec.frames.size());
+
+            frame_arrow_source arrows{spec, index};
+            sessions[worker].produce(frame_rendering, style, arrows);
+        });
+        return;
+    }
+
+    // Frames written to stdout are concatenated in order, e.g. for a video
+    // encoder reading a pipe. Each frame is encoded in parallel and then
+    // waits for its turn to be written.
+    std::mutex mutex;
+    std::condition_variable turn;
+    std::size_t next_frame = 0;
+    bool failed = false;
+
+    parallel_for(spec.frames.size(), threads, [&](std::size_t index, unsigned worker) {
+        thread_cpu_scope scope;
+        std::vector<unsigned char> image;
+        try {
+            frame_arrow_source arrows{spec, index};
+            image = sessions[worker].encode(rendering, style, arrows);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock{mutex};
+            failed = true;
+            turn.notify_all();
+            throw;
+        }
+
+        std::unique_lock<std::mutex> lock{mutex};
+        turn.wait(lock, [&] { return next_frame == index || failed; });
+        if (failed) {
+            return;
+        }
+
+        std::cout.write(reinterpret_cast<char const*>(image.data()), std::streamsize(image.size()));
+        if (!std::cout) {
+            failed = true;
+            turn.notify_all();
+            throw std::runtime_error{"failed to write image"};
+        }
+        next_frame++;
+        turn.notify_all();
+    });
+    std::cout.flush();
 }
 
 
 void
-quiver_plot::setup_geometry()
+produce_quiver_plot(
+    rendering_spec const& rendering,
+    style_spec const& style,
+    arrow_source& arrows,
+    plot_profile* profile
+)
 {
-    auto const [data_x_range, data_y_range] = estimate_data_range();
-    _x_range = _spec.rendering.x_range.value_or(data_x_range);
-    _y_range = _spec.rendering.y_range.value_or(data_y_range);
+    // A pyramid indexes all arrows, so streamed arrows are loaded.
+    if (rendering.pyramid) {
+        arrow_store loaded;
+        {
+            phase_timer timer{profile, "load"};
+            arrows.scan([&](arrow_store const& chunk) {
+                loaded.append(chunk);
+            });
+        }
+        produce_quiver_views(rendering, {}, style, loaded, profile);
+        return;
+    }
 
-    validate_spec(_x_range.lower < _x_range.upper, "x_range must be a valid interval");
-    validate_spec(_y_range.lower < _y_range.upper, "y_range must be a valid interval");
+    plot_session session;
+    session.set_profile(profile);
+    session.produce(rendering, style, arrows);
+}
+
+
+// Resolves color limits and the data range over all arrows and indexes them.
+view_renderer::view_renderer(style_spec const& style, arrow_store const& arrows, unsigned threads, plot_profile* profile)
+: _style{style}, _arrows{arrows}, _profile{profile}, _sessions(threads), _indices(threads)
+{
+    store_arrow_source all_arrows{arrows};
+
+    if (_style.color_by && !_style.color_limits) {
+        phase_timer timer{profile, "limits"};
+        _style.color_limits = estimate_color_limits(all_arrows, parse_color_source(*_style.color_by));
+    }
+
+    {
+        phase_timer timer{profile, "range"};
+        std::tie(_x_range, _y_range) = estimate_data_range(all_arrows);
+    }
+
+    {
+        phase_timer timer{profile, "index"};
+        _index.emplace(arrows);
+    }
+
+    for (auto& session : _sessions) {
+        session.set_profile(profile);
+    }
+}
 
-    auto const max_span = std::max(
-        _x_range.upper - _x_range.lower,
-        _y_range.upper - _y_range.lower
-    );
-    _pixels_per_length = _spec.rendering.pixels_per_length.value_or(default_image_size / max_span);
 
-    validate_spec(_pixels_per_length > 0, "pixels_per_length must be positive");
+range_spec const&
+view_renderer::x_range() const
+{
+    return _x_range;
+}
+
+
+range_spec const&
+view_renderer::y_range() const
+{
+    return _y_range;
+}
+
+
+std::vector<char>
+view_renderer::render(std::vector<rendering_spec> const& views, bool tiles)
+{
+    std::vector<char> rendered(views.size());
+    parallel_for(views.size(), unsigned(_sessions.size()), [&](std::size_t index, unsigned worker) {
+        thread_cpu_scope scope;
+        rendered[index] = render_view(views[index], tiles, worker);
+    });
+
+    if (_profile) {
+        _profile->count("images", std::uint64_t(std::count(rendered.begin(), rendered.end(), 1)));
+    }
+    return rendered;
+}
+
+
+// Renders a view from the arrows the index finds in it. Returns false if the
+// view is a tile that no arrow reaches. The index only finds the arrows of
+// the cells around the view, so the outline of each is checked against the
+// pixels of the tile before a tile is called empty.
+bool
+view_renderer::render_view(rendering_spec const& view, bool tiles, unsigned worker)
+{
+    auto rendering = view;
+    rendering.x_range = rendering.x_range.value_or(_x_range);
+    rendering.y_range = rendering.y_range.value_or(_y_range);
+    rendering.threads = 1;
+
+    store_arrow_source all_arrows{_arrows};
+    auto const plot = resolve_view(rendering, all_arrows, nullptr);
+
+    // The query box is widened by the widest arrowhead and a pixel for
+    // antialiasing. Arrows found but not visible are culled when drawing.
+    auto const pixel_width = 1 / plot.pixels_per_length;
+    auto const width = std::max(_index->max_width(), _style.shaft_width.value_or(pixel_width));
+    auto const margin = width * _style.stem_to_shaft_ratio.value_or(default_stem_to_shaft_ratio) / 2 + pixel_width;
+
+    auto box = plot.data_box(BLBoxI{0, 0, plot.width(), plot.height()});
+    box.x0 -= margin;
+    box.y0 -= margin;
+    box.x1 += margin;
+    box.y1 += margin;
+
+    auto& indices = _indices[worker];
+    {
+        phase_timer timer{_profile, "query"};
+        _index->query(box, indices);
+    }
+    if (tiles) {
+        arrow_shape shape;
+        shape.shaft_width = _style.shaft_width.value_or(pixel_width);
+        shape.stem_to_shaft_ratio = _style.stem_to_shaft_ratio.value_or(default_stem_to_shaft_ratio);
+        shape.head_aspect_ratio = _style.head_aspect_ratio.value_or(default_head_aspect_ratio);
+
+        // Dots are squares within a dot of the outline of their arrow.
+        auto const reach = 1 + int(std::ceil(rendering.dot_size.value_or(0)));
+        auto const clip = plot.data_box(BLBoxI{-reach, -reach, plot.width() + reach, plot.height() + reach});
+        auto const reaches = [&](std::uint32_t i) {
+            auto const box = bound_arrow(_arrows, i, shape);
+            if (box.x1 < clip.x0 || box.x0 > clip.x1 || box.y1 < clip.y0 || box.y0 > clip.y1) {
+                return false;
+            }
+            BLPoint outline[arrow_vertex_count];
+            compute_arrow_vertices(_arrows, i, i + 1, shape, outline);
+            return overlaps_arrow_outline(outline, clip);
+        };
+        if (std::none_of(indices.begin(), indices.end(), reaches)) {
+            return false;
+        }
+        std::filesystem::create_directories(std::filesystem::path{*rendering.output}.parent_path());
+    }
+
+    index_arrow_source arrows{_arrows, indices};
+    _sessions[worker].produce(rendering, _style, arrows);
+    return true;
+}
+
+
+plot_session::plot_session()
+: _canvas{std::make_unique<plot_canvas>()}
+{
+}
+
+
+plot_session::~plot_session() = default;
+
+
+void
+plot_session::set_profile(plot_profile* profile)
+{
+    _profile = profile;
 }
 
 
 void
-quiver_plot::setup_style()
+plot_session::produce(quiver_spec const& spec)
 {
-    auto const pixel_width = 1 / _pixels_per_length;
+    store_arrow_source arrows{spec.arrows};
+    produce(spec.rendering, spec.style, arrows);
+}
 
-    _background_color = _spec.style.background_color.value_or(default_background_color);
-    _arrow_color = _spec.style.arrow_color.value_or(default_arrow_color);
-    _shaft_width = _spec.style.shaft_width.value_or(pixel_width);
-    _stem_to_shaft_ratio = _spec.style.stem_to_shaft_ratio.value_or(default_stem_to_shaft_ratio);
-    _head_aspect_ratio = _spec.style.head_aspect_ratio.value_or(default_head_aspect_ratio);
 
-    validate_spec(_shaft_width > 0, "shaft_width must be positive");
-    validate_spec(_stem_to_shaft_ratio >= 1, "stem_to_shaft_ratio must be >= 1");
-    validate_spec(_head_aspect_ratio > 0, "head_aspect_ratio must be positive");
+void
+plot_session::produce(rendering_spec const& rendering, style_spec const& style, arrow_source& arrows)
+{
+    quiver_plot plot{rendering, style, arrows, *_canvas, _profile};
+    plot.produce();
 }
 
 
+// Produces the plot of a spec that has changed since the previous spec was
+// produced by this session. If only arrows have changed, just the pixels that
+// changed arrows cover are redrawn. Other changes redraw the whole plot.
 void
-quiver_plot::setup_image()
+plot_session::update(quiver_spec const& previous, quiver_spec const& spec)
 {
-    auto const width = round<int>((_x_range.upper - _x_range.lower) * _pixels_per_length);
-    auto const height = round<int>((_y_range.upper - _y_range.lower) * _pixels_per_length);
-    _image = BLImage{width, height, BL_FORMAT_PRGB32};
+    if (!spec.frames.empty() || !spec.renders.empty() || spec.rendering.pyramid) {
+        produce_quiver_plot(spec, _profile);
+        return;
+    }
+    if (!previous.frames.empty() || !previous.renders.empty() || !same_settings(previous, spec)) {
+        produce(spec);
+        return;
+    }
 
-    if (!_spec.rendering.output) {
-        throw std::runtime_error{"output image is not specified"};
+    store_arrow_source arrows{spec.arrows};
+    quiver_plot plot{spec.rendering, spec.style, arrows, *_canvas, _profile};
+    plot.update(previous.arrows);
+}
+
+
+std::vector<unsigned char>
+plot_session::encode(quiver_spec const& spec)
+{
+    if (!spec.frames.empty()) {
+        throw std::runtime_error{"frames cannot be encoded into a single image"};
+    }
+    if (!spec.renders.empty()) {
+        throw std::runtime_error{"renders cannot be encoded into a single image"};
+    }
+
+    store_arrow_source arrows{spec.arrows};
+    return encode(spec.rendering, spec.style, arrows);
+}
+
+
+// The image is encoded straight into the returned vector. Errors of the
+// buffer, such as running out of memory, are rethrown by the stream.
+std::vector<unsigned char>
+plot_session::encode(rendering_spec const& rendering, style_spec const& style, arrow_source& arrows)
+{
+    std::vector<unsigned char> data;
+    vector_streambuf buffer{data};
+    std::ostream stream{&buffer};
+    stream.exceptions(std::ios::badbit);
+
+    encode(rendering, style, arrows, stream);
+    return data;
+}
+
+
+// Renders the plot and encodes it into the stream.
+void
+plot_session::encode(rendering_spec const& rendering, style_spec const& style, arrow_source& arrows, std::ostream& stream)
+{
+    if (rendering.tile_size) {
+        throw std::runtime_error{"tiled plots cannot be encoded in memory"};
+    }
+
+    quiver_plot plot{rendering, style, arrows, *_canvas, _profile};
+    plot.render();
+    plot.encode(stream);
+}
+
+
+// Renders the plot into caller memory holding rows of RGBA pixels, stride
+// bytes apart. The plot is drawn in place and the pixels are converted row by
+// row afterwards, so no image buffer is allocated. The memory must have the
+// size that measure_quiver_plot() gives.
+void
+plot_session::render(
+    rendering_spec const& rendering,
+    style_spec const& style,
+    arrow_source& arrows,
+    unsigned char* pixels,
+    std::ptrdiff_t stride,
+    bool premultiplied
+)
+{
+    if (rendering.tile_size) {
+        throw std::runtime_error{"tiled plots cannot be rendered in memory"};
+    }
+    if (rendering.partition) {
+        throw std::runtime_error{"partitioned plots cannot be rendered in memory"};
+    }
+
+    quiver_plot plot{rendering, style, arrows, *_canvas, _profile};
+    auto const width = plot.view().width();
+    auto const height = plot.view().height();
+
+    auto& image = _canvas->image;
+    if (image.createFromData(width, height, BL_FORMAT_PRGB32, pixels, stride) != BL_SUCCESS) {
+        throw std::runtime_error{"cannot render into the given pixels"};
+    }
+
+    try {
+        plot.render();
+    } catch (...) {
+        image.reset();
+        throw;
+    }
+    image.reset();
+    _canvas->view.reset();
+
+    // Each pixel is read before its bytes are written, so rows are converted
+    // in place.
+    phase_timer timer{_profile, "encode"};
+    for (int y = 0; y < height; y++) {
+        auto const row = pixels + y * stride;
+        auto const source = reinterpret_cast<std::uint32_t const*>(row);
+        if (premultiplied) {
+            premultiplied_row(source, width, row);
+        } else {
+            unpremultiply_row(source, width, row);
+        }
+    }
+}
+
+
+std::pair<int, int>
+measure_quiver_plot(rendering_spec const& rendering, arrow_source& arrows)
+{
+    auto const view = resolve_view(rendering, arrows, nullptr);
+    return std::make_pair(view.width(), view.height());
+}
+
+
+quiver_plot::quiver_plot(
+    rendering_spec const& rendering,
+    style_spec const& style,
+    arrow_source& arrows,
+    plot_canvas& canvas,
+    plot_profile* profile
+)
+: _canvas{canvas}
+, _profile{profile}
+, _rendering{rendering}
+, _style{style}
+, _arrows{arrows}
+{
+    _view = resolve_view(_rendering, _arrows, _profile);
+    {
+        phase_timer timer{_profile, "geometry"};
+        setup_style();
+        setup_options();
+    }
+    setup_colors();
+    setup_aggregation();
+}
+
+
+void
+quiver_plot::produce()
+{
+    if (_tile_size > 0) {
+        render_tiles();
+    } else {
+        render();
+        save();
     }
-    _output = *_spec.rendering.output;
 }
 
 
+// Redraws the pixels that differ between the plot of the previous arrows and
+// the plot of the current ones, and saves the image. Arrows are matched by
+// their position in the input. The image must hold the previous plot, or the
+// whole plot is drawn.
 void
-quiver_plot::run()
+quiver_plot::update(arrow_store const& previous)
 {
-    _context = BLContext{_image};
-    init_context();
-    draw_background();
-    draw_arrows();
-    _context.end();
+    auto const current = _arrows.resident();
+    auto const& view = _canvas.view;
+
+    auto const& limits = _plot_style.color_limits;
+    auto const same_colors = _canvas.color_limits.lower == limits.lower && _canvas.color_limits.upper == limits.upper;
+
+    if (!current || _tile_size > 0 || _aggregated_source || !view || !same_view(*view, _view) || !same_colors) {
+        produce();
+        return;
+    }
+
+    std::vector<BLBoxI> regions;
+    {
+        phase_timer timer{_profile, "diff"};
+        regions = find_changed_regions(previous, *current);
+    }
+    if (regions.empty()) {
+        return;
+    }
 
+    for (auto const& pixels : regions) {
+        draw(pixels);
+    }
     save();
 }
 
 
 void
-quiver_plot::init_context()
+quiver_plot::setup_style()
 {
-    // Blend2D works with the top-to-bottom display coordinate system measured
-    // in pixels. To use mathematical xy coordinate system with custom range,
-    // we set up a transformation matrix.
-    BLMatrix2D view_matrix;
-    view_matrix.reset();
-    view_matrix.scale(_pixels_per_length);
-    view_matrix.translate(-_x_range.lower, _y_range.upper);
-    view_matrix.scale(1, -1);
-    _context.setMatrix(view_matrix);
-    _context.userToMeta();
+    auto const pixel_width = 1 / _view.pixels_per_length;
+    auto& shape = _plot_style.shape;
+
+    _plot_style.background_color = pack_color(_style.background_color.value_or(default_background_color));
+    _plot_style.arrow_color = pack_color(_style.arrow_color.value_or(default_arrow_color));
+    shape.shaft_width = _style.shaft_width.value_or(pixel_width);
+    shape.stem_to_shaft_ratio = _style.stem_to_shaft_ratio.value_or(default_stem_to_shaft_ratio);
+    shape.head_aspect_ratio = _style.head_aspect_ratio.value_or(default_head_aspect_ratio);
+
+    validate_spec(shape.shaft_width > 0, "shaft_width must be positive");
+    validate_spec(shape.stem_to_shaft_ratio >= 1, "stem_to_shaft_ratio must be >= 1");
+    validate_spec(shape.head_aspect_ratio > 0, "head_aspect_ratio must be positive");
 }
 
 
 void
-quiver_plot::draw_background()
+quiver_plot::setup_options()
 {
-    _context.setCompOp(BL_COMP_OP_SRC_COPY);
-    _context.setFillStyle(make_color(_background_color));
-    _context.fillAll();
+    _output = _rendering.output.value_or("");
+
+    // Explicit format takes precedence over the extension of the output.
+    if (_rendering.format) {
+        _format = parse_image_format(*_rendering.format);
+    } else {
+        _format = guess_image_format(_output);
+    }
+
+    _compression = _rendering.compression.value_or(default_compression);
+    validate_spec(_compression >= 0 && _compression <= 9, "compression must be in 0-9");
+
+    _threads = resolve_rendering_threads(_rendering);
+
+    auto const order = _rendering.order.value_or(default_order);
+    if (order == "input") {
+        _plot_style.order = draw_order::input;
+    } else if (order == "any") {
+        _plot_style.order = draw_order::any;
+    } else if (order == "spatial") {
+        _plot_style.order = draw_order::spatial;
+    } else {
+        validate_spec(false, "order must be \"input\", \"any\" or \"spatial\"");
+    }
+
+    validate_spec(!_rendering.pyramid, "pyramid can only be produced from a spec file");
+
+    _tile_size = _rendering.tile_size.value_or(0);
+    validate_spec(_tile_size >= 0, "tile_size must be non-negative");
+
+    // The bands of a partition are stitched by quiver-merge, which reads PAM.
+    _band_begin = 0;
+    _band_end = _view.height();
+    if (_rendering.partition) {
+        auto const& partition = *_rendering.partition;
+        validate_spec(partition.count > 0, "partition count must be positive");
+        validate_spec(partition.index >= 0 && partition.index < partition.count, "partition index must be less than count");
+        validate_spec(_format == image_format::pam, "partition output must be PAM");
+
+        auto const height = std::int64_t(_view.height());
+        _band_begin = int(height * partition.index / partition.count);
+        _band_end = int(height * (partition.index + 1) / partition.count);
+    }
+
+    auto const dot_size = _rendering.dot_size.value_or(0);
+    validate_spec(dot_size >= 0, "dot_size must be non-negative");
+    _plot_style.dot_length = dot_size / _view.pixels_per_length;
+
+    if (_rendering.sprites) {
+        auto const& spec = *_rendering.sprites;
+        auto& sprites = _plot_style.sprites;
+        sprites.angles = spec.angles.value_or(default_sprite_angles);
+        sprites.length_step = spec.length_step.value_or(default_sprite_length_step);
+        sprites.subpixels = spec.subpixels.value_or(default_sprite_subpixels);
+        sprites.max_length = spec.max_size.value_or(default_sprite_max_size);
+
+        // Cache size is given in MiB.
+        auto const cache_size = spec.cache_size.value_or(default_sprite_cache_size);
+        validate_spec(sprites.angles >= 4 && sprites.angles <= 65536, "sprite angles must be in 4-65536");
+        validate_spec(sprites.length_step >= 0.01, "sprite length_step must be >= 0.01");
+        validate_spec(sprites.subpixels >= 1 && sprites.subpixels <= 16, "sprite subpixels must be in 1-16");
+        validate_spec(sprites.max_length > 0 && sprites.max_length <= 100, "sprite max_size must be in (0, 100]");
+        validate_spec(cache_size >= 0 && cache_size <= 1 << 20, "sprite cache_size must be in 0-1048576");
+        sprites.max_bytes = std::size_t(cache_size * 1024 * 1024);
+
+        // Sprites are composited once the context is flushed, which makes the
+        // workers of a multi-threaded context wait for each other before every
+        // sprite. Tiles are rendered on single-threaded contexts.
+        if (_threads > 1 && _tile_size == 0) {
+            sprites.angles = 0;
+        }
+    }
 }
 
 
+// Resolves the colormap. Limits not given in the spec span the values of the
+// input arrows, except for angles, which always span the full circle.
 void
-quiver_plot::draw_arrows()
+quiver_plot::setup_colors()
 {
-    _context.setCompOp(BL_COMP_OP_SRC_OVER);
+    if (!_style.color_by) {
+        validate_spec(!_style.colormap && !_style.color_limits, "colormap needs color_by");
+        return;
+    }
 
-    for (auto const& arrow : _spec.arrows) {
-        auto const length = std::hypot(arrow.dx, arrow.dy);
-        auto const angle = std::atan2(arrow.dy, arrow.dx);
+    _plot_style.color_by = parse_color_source(*_style.color_by);
+    _plot_style.color_map = make_colormap(_style.colormap.value_or(colormap_spec{default_colormap, {}}));
 
-        auto path = make_arrow_path(
-            length, arrow.w.value_or(_shaft_width), _stem_to_shaft_ratio, arrow.a.value_or(_head_aspect_ratio)
-        );
+    if (_style.color_limits) {
+        _plot_style.color_limits = *_style.color_limits;
+        validate_spec(_plot_style.color_limits.lower < _plot_style.color_limits.upper, "color_limits must be a valid interval");
+    } else {
+        phase_timer timer{_profile, "limits"};
+        _plot_style.color_limits = estimate_color_limits(_arrows, _plot_style.color_by);
+    }
+}
 
-        BLMatrix2D posing;
-        posing.reset();
-        posing.translate(arrow.x, arrow.y);
-        posing.rotate(angle);
-        path.transform(posing);
 
-        _context.setFillStyle(make_color(arrow.c.value_or(_arrow_color)));
-        _context.fillPath(path);
+// Replaces the input arrows with one arrow per cell of a grid whose cells are
+// square and span the plot range. The number of cells along the longer axis
+// is given in the spec.
+void
+quiver_plot::setup_aggregation()
+{
+    if (!_rendering.aggregate) {
+        return;
     }
+    auto const& spec = *_rendering.aggregate;
+    validate_spec(spec.cells > 0, "aggregate cells must be positive");
+
+    auto const x_span = _view.x_range.upper - _view.x_range.lower;
+    auto const y_span = _view.y_range.upper - _view.y_range.lower;
+    auto const cell_size = std::max(x_span, y_span) / spec.cells;
+
+    aggregate_grid grid;
+    grid.columns = std::max(std::size_t(1), std::size_t(std::ceil(x_span / cell_size - 1e-9)));
+    grid.rows = std::max(std::size_t(1), std::size_t(std::ceil(y_span / cell_size - 1e-9)));
+    grid.x_range = {_view.x_range.lower, _view.x_range.lower + cell_size * double(grid.columns)};
+    grid.y_range = {_view.y_range.upper - cell_size * double(grid.rows), _view.y_range.upper};
+    grid.width_reduction = parse_reduction(spec.width.value_or("mean"));
+    grid.color_reduction = parse_reduction(spec.color.value_or("mean"));
+    grid.shape = _plot_style.shape;
+    grid.arrow_color = _plot_style.arrow_color;
+
+    phase_timer timer{_profile, "aggregate"};
+    _aggregated = aggregate_arrows(_arrows, grid, _threads);
+    _aggregated_source = std::make_unique<store_arrow_source>(_aggregated);
 }
 
 
 void
-quiver_plot::save()
+quiver_plot::setup_image()
 {
-    BLImageCodec codec;
-    codec.findByName("PNG");
+    auto const width = _view.width();
+    auto const height = _band_end - _band_begin;
 
-    auto const status = _image.writeToFile(_output.c_str(), codec);
-    if (status != BL_SUCCESS) {
-        throw std::runtime_error{"failed to save image to file " + _output};
+    // Reuse the image buffer of the previous plot if possible.
+    auto& image = _canvas.image;
+    if (image.width() != width || image.height() != height) {
+        image = BLImage{width, height, BL_FORMAT_PRGB32};
+    }
+
+    if (_profile) {
+        _profile->set("width", std::uint64_t(width));
+        _profile->set("height", std::uint64_t(height));
     }
 }
 
 
-std::pair<range_spec, range_spec>
-quiver_plot::estimate_data_range() const
+void
+quiver_plot::render()
 {
-    if (_spec.arrows.empty()) {
-        return std::make_pair(range_spec{0, 1}, range_spec{0, 1});
+    setup_image();
+    draw(BLBoxI{0, _band_begin, _view.width(), _band_end});
+}
+
+
+// Draws the given pixels of the plot, leaving other pixels as they are. The
+// pixels are in plot coordinates, which are offset from the image by the
+// first row of the band. With multiple threads, drawing only queues commands
+// and the arrows are rasterized when the context is flushed at the end.
+void
+quiver_plot::draw(BLBoxI const& pixels)
+{
+    auto const width = _view.width();
+    auto const whole = pixels.x0 <= 0 && pixels.y0 <= _band_begin && pixels.x1 >= width && pixels.y1 >= _band_end;
+
+    // The image holds an incomplete plot until drawing is done.
+    _canvas.view.reset();
+
+    // Single-threaded rendering runs synchronously on the calling thread.
+    // Otherwise Blend2D queues drawing commands and rasterizes bands of the
+    // image with a worker pool. The result is the same either way.
+    BLContextCreateInfo create_info;
+    create_info.reset();
+    if (_threads > 1) {
+        create_info.threadCount = _threads;
+        create_info.commandQueueLimit = _threads * command_queue_per_thread;
+    }
+
+    auto& context = _canvas.context;
+    auto& painter = _canvas.painter;
+
+    // Arrows are culled with a margin of a pixel for antialiasing.
+    auto const clip = _view.data_box(BLBoxI{pixels.x0 - 1, pixels.y0 - 1, pixels.x1 + 1, pixels.y1 + 1});
+    auto const image_pixels = BLBoxI{pixels.x0, pixels.y0 - _band_begin, pixels.x1, pixels.y1 - _band_begin};
+
+    {
+        phase_timer timer{_profile, "background"};
+        context.begin(_canvas.image, create_info);
+        if (!whole) {
+            context.clipToRect(BLRectI{image_pixels.x0, image_pixels.y0, pixels.x1 - pixels.x0, pixels.y1 - pixels.y0});
+        }
+        context.setMatrix(_view.matrix(0, _band_begin));
+        context.userToMeta();
+
+        painter.begin(context, _plot_style, clip, image_pixels, _threads);
+        painter.draw_background();
+    }
+
+    {
+        phase_timer timer{_profile, "arrows"};
+        source().scan([&](arrow_store const& chunk) {
+            painter.draw(chunk);
+        });
+        painter.end();
+    }
+
+    record_counts(painter.counts());
+    if (_profile) {
+        _profile->set("blend2d_threads", context.threadCount());
+        _profile->set("blend2d_error_flags", context.accumulatedErrorFlags());
+    }
+
+    {
+        phase_timer timer{_profile, "flush"};
+        context.end();
+    }
+    _canvas.view = _view;
+    _canvas.color_limits = _plot_style.color_limits;
+}
+
+
+// Renders the plot one row of tiles at a time and streams each row to the
+// output file, so that memory use is bounded by a row rather than the whole
+// image. Tiles of a row are rendered in parallel, each on a single-threaded
+// context. Arrows are binned into rows beforehand, so that each arrow is
+// visited only by the tiles it overlaps.
+void
+quiver_plot::render_tiles()
+{
+    if (_output.empty()) {
+        throw std::runtime_error{"output image is not specified"};
+    }
+
+    // Fill runs are numbered over all arrows, before a partition drops any,
+    // so that tiles fill arrows as a single render does.
+    tile_bins bins;
+    arrow_runs runs;
+    runs.reset(_plot_style);
+    auto const numbered = _plot_style.order == draw_order::input;
+
+    // Binning needs random access to arrows, so streamed arrows are loaded.
+    // A partition keeps only the arrows that reach its band.
+    arrow_store loaded;
+    auto arrows = source().resident();
+    if (!arrows) {
+        phase_timer timer{_profile, "load"};
+        source().scan([&](arrow_store const& chunk) {
+            if (!_rendering.partition) {
+                loaded.append(chunk);
+                return;
+            }
+            for (std::size_t i = 0; i < chunk.size(); i++) {
+                auto const run = numbered ? runs.next(chunk, i) : 0;
+                auto const bounds = compute_pixel_bounds(chunk, i);
+                if (bounds.y1 >= _band_begin && bounds.y0 < _band_end) {
+                    loaded.push_back(chunk.get(i));
+                    if (numbered) {
+                        bins.runs.push_back(run);
+                    }
+                }
+            }
+        });
+        arrows = &loaded;
+    }
+    validate_spec(arrows->size() <= UINT32_MAX, "too many arrows for tiled rendering");
+
+    {
+        phase_timer timer{_profile, "bin"};
+        if (numbered && bins.runs.size() != arrows->size()) {
+            bins.runs.resize(arrows->size());
+            for (std::size_t i = 0; i < arrows->size(); i++) {
+                bins.runs[i] = runs.next(*arrows, i);
+            }
+        }
+        bin_tile_rows(*arrows, bins);
+    }
+
+    auto const width = _view.width();
+    auto const height = _band_end - _band_begin;
+
+    if (_profile) {
+        _profile->set("width", std::uint64_t(width));
+        _profile->set("height", std::uint64_t(height));
+    }
+
+    std::ofstream file;
+    auto const writer = make_image_writer(_format, open_output(_output, file), width, height, _compression);
+
+    _canvas.tile_workers.resize(_threads);
+
+    BLImage band;
+    for (int y = _band_begin; y < _band_end; y += _tile_size) {
+        auto const band_height = std::min(_tile_size, _band_end - y);
+        if (band.height() != band_height) {
+            band = BLImage{width, band_height, BL_FORMAT_PRGB32};
+        }
+
+        auto const row = std::size_t((y - _band_begin) / _tile_size);
+        {
+            phase_timer timer{_profile, "tiles"};
+            render_tile_row(*arrows, bins, row, band, y);
+        }
+
+        phase_timer timer{_profile, "encode"};
+        writer->write_rows(band);
+    }
+
+    phase_timer timer{_profile, "encode"};
+    writer->finish();
+}
+
+
+void
+quiver_plot::render_tile_row(
+    arrow_store const& arrows,
+    tile_bins const& bins,
+    std::size_t row,
+    BLImage& band,
+    int y
+)
+{
+    auto const indices = bins.indices.data() + bins.offsets[row];
+    auto const count = bins.offsets[row + 1] - bins.offsets[row];
+    auto const runs = bins.runs.empty() ? nullptr : bins.runs.data();
+
+    auto const width = band.width();
+    auto const tile_count = std::size_t((width + _tile_size - 1) / _tile_size);
+
+    _tile_indices.resize(tile_count);
+    for (auto& tile : _tile_indices) {
+        tile.clear();
+    }
+    for (std::size_t k = 0; k < count; k++) {
+        auto const bounds = compute_pixel_bounds(arrows, indices[k]);
+        if (bounds.x1 < 0 || bounds.x0 >= width) {
+            continue;
+        }
+        auto const first = std::max(bounds.x0, 0) / _tile_size;
+        auto const last = std::min(bounds.x1, width - 1) / _tile_size;
+        for (auto tile = first; tile <= last; tile++) {
+            _tile_indices[tile].push_back(indices[k]);
+        }
+    }
+
+    BLImageData data;
+    band.makeMutable(&data);
+
+    parallel_for(tile_count, _threads, [&](std::size_t index, unsigned worker) {
+        auto const x = int(index) * _tile_size;
+        auto const tile_width = std::min(_tile_size, width - x);
+        auto const pixels = static_cast<unsigned char*>(data.pixelData) + std::size_t(x) * 4;
+
+        BLImage tile;
+        tile.createFromData(tile_width, data.size.h, BL_FORMAT_PRGB32, pixels, data.stride);
+
+        auto& context = _canvas.tile_workers[worker].context;
+        auto& painter = _canvas.tile_workers[worker].painter;
+        auto const& tile_indices = _tile_indices[index];
+
+        context.begin(tile);
+        context.setMatrix(_view.matrix(x, y));
+        context.userToMeta();
+
+        auto const clip = _view.data_box(BLBoxI{x - 1, y - 1, x + tile_width + 1, y + data.size.h + 1});
+
+        painter.begin(context, _plot_style, clip, BLBoxI{0, 0, tile_width, data.size.h});
+        painter.draw_background();
+        painter.draw(arrows, tile_indices.data(), tile_indices.size(), runs);
+        painter.end();
+
+        context.end();
+        record_counts(painter.counts());
+    });
+}
+
+
+// Rows of tiles start at the first row of the band.
+void
+quiver_plot::bin_tile_rows(arrow_store const& arrows, tile_bins& bins) const
+{
+    auto const height = _band_end - _band_begin;
+    auto const row_count = std::size_t((height + _tile_size - 1) / _tile_size);
+
+    auto const for_each_row = [&](std::size_t i, auto&& visit) {
+        auto const bounds = compute_pixel_bounds(arrows, i);
+        auto const top = bounds.y0 - _band_begin;
+        auto const bottom = bounds.y1 - _band_begin;
+        if (bottom < 0 || top >= height) {
+            return;
+        }
+        auto const first = std::size_t(std::max(top, 0) / _tile_size);
+        auto const last = std::size_t(std::min(bottom, height - 1) / _tile_size);
+        for (auto row = first; row <= last; row++) {
+            visit(row);
+        }
+    };
+
+    // Count arrows per row, then fill rows in a second pass.
+    bins.offsets.assign(row_count + 1, 0);
+    for (std::size_t i = 0; i < arrows.size(); i++) {
+        for_each_row(i, [&](std::size_t row) { bins.offsets[row + 1]++; });
+    }
+    for (std::size_t row = 0; row < row_count; row++) {
+        bins.offsets[row + 1] += bins.offsets[row];
+    }
+
+    auto positions = bins.offsets;
+    bins.indices.resize(bins.offsets.back());
+    for (std::size_t i = 0; i < arrows.size(); i++) {
+        for_each_row(i, [&](std::size_t row) {
+            bins.indices[positions[row]++] = std::uint32_t(i);
+        });
     }
+}
+
 
-    auto const x_enclosure = [](arrow_spec const& arrow) {
-        auto const x_min = std::min(arrow.x, arrow.x + arrow.dx);
-        auto const x_max = std::max(arrow.x, arrow.x + arrow.dx);
-        return range_spec{x_min, x_max};
+// Returns the pixels of the band covered by arrows that were added, removed
+// or modified, as disjoint boxes. Overlapping boxes are merged, and too many
+// boxes are merged into one because every box costs a pass over all arrows.
+std::vector<BLBoxI>
+quiver_plot::find_changed_regions(arrow_store const& previous, arrow_store const& current) const
+{
+    auto const width = _view.width();
+    std::vector<BLBoxI> regions;
+
+    auto const include = [&](arrow_store const& arrows, std::size_t i) {
+        auto const bounds = compute_pixel_bounds(arrows, i);
+        if (bounds.x1 < 0 || bounds.y1 < _band_begin || bounds.x0 >= width || bounds.y0 >= _band_end) {
+            return;
+        }
+        BLBoxI box{
+            std::max(bounds.x0, 0),
+            std::max(bounds.y0, _band_begin),
+            std::min(bounds.x1 + 1, width),
+            std::min(bounds.y1 + 1, _band_end)
+        };
+
+        // Absorb overlapping regions until the box overlaps none.
+        for (std::size_t k = 0; k < regions.size(); ) {
+            auto const& region = regions[k];
+            if (region.x0 < box.x1 && box.x0 < region.x1 && region.y0 < box.y1 && box.y0 < region.y1) {
+                box = BLBoxI{
+                    std::min(box.x0, region.x0),
+                    std::min(box.y0, region.y0),
+                    std::max(box.x1, region.x1),
+                    std::max(box.y1, region.y1)
+                };
+                regions.erase(regions.begin() + std::ptrdiff_t(k));
+                k = 0;
+            } else {
+                k++;
+            }
+        }
+        regions.push_back(box);
+
+        if (regions.size() > max_changed_regions) {
+            auto bounding = regions.front();
+            for (auto const& region : regions) {
+                bounding.x0 = std::min(bounding.x0, region.x0);
+                bounding.y0 = std::min(bounding.y0, region.y0);
+                bounding.x1 = std::max(bounding.x1, region.x1);
+                bounding.y1 = std::max(bounding.y1, region.y1);
+            }
+            regions.assign(1, bounding);
+        }
     };
 
-    auto const y_enclosure = [](arrow_spec const& arrow) {
-        auto const y_min = std::min(arrow.y, arrow.y + arrow.dy);
-        auto const y_max = std::max(arrow.y, arrow.y + arrow.dy);
-        return range_spec{y_min, y_max};
+    auto const common = std::min(previous.size(), current.size());
+    for (std::size_t i = 0; i < common; i++) {
+        if (!current.equal(i, previous, i)) {
+            include(previous, i);
+            include(current, i);
+        }
+    }
+    for (auto i = common; i < previous.size(); i++) {
+        include(previous, i);
+    }
+    for (auto i = common; i < current.size(); i++) {
+        include(current, i);
+    }
+    return regions;
+}
+
+
+// Returns pixels that the arrow may touch, inclusive. The bounds enclose the
+// segment widened by the widest possible head plus a pixel for antialiasing.
+BLBoxI
+quiver_plot::compute_pixel_bounds(arrow_store const& arrows, std::size_t i) const
+{
+    auto const box = bound_arrow(arrows, i, _plot_style.shape);
+
+    auto const ppl = _view.pixels_per_length;
+    auto const left = (box.x0 - _view.x_range.lower) * ppl;
+    auto const right = (box.x1 - _view.x_range.lower) * ppl;
+    auto const top = (_view.y_range.upper - box.y1) * ppl;
+    auto const bottom = (_view.y_range.upper - box.y0) * ppl;
+
+    // Clamp before converting so that far away arrows do not overflow.
+    auto const to_pixel = [](double value) {
+        return int(std::floor(std::clamp(value, -1e9, 1e9)));
     };
+    return BLBoxI{to_pixel(left) - 1, to_pixel(top) - 1, to_pixel(right) + 1, to_pixel(bottom) + 1};
+}
+
+
+// Adds the counts of a painter to the profile. In tiled rendering, arrows that
+// overlap several tiles are counted once per tile.
+void
+quiver_plot::record_counts(paint_counts const& counts)
+{
+    if (_profile) {
+        _profile->count("arrows", counts.arrows);
+        _profile->count("culled", counts.culled);
+        _profile->count("dots", counts.dots);
+        _profile->count("sprites", counts.sprites);
+        _profile->count("fills", counts.fills);
+    }
+}
+
+
+plot_view const&
+quiver_plot::view() const
+{
+    return _view;
+}
+
+
+// Returns the arrows to draw.
+arrow_source&
+quiver_plot::source()
+{
+    return _aggregated_source ? *_aggregated_source : _arrows;
+}
+
+
+void
+quiver_plot::save()
+{
+    if (_output.empty()) {
+        throw std::runtime_error{"output image is not specified"};
+    }
+
+    phase_timer timer{_profile, "encode"};
+    auto const& image = _canvas.image;
+
+    std::ofstream file;
+    auto const writer = make_image_writer(_format, open_output(_output, file), image.width(), image.height(), _compression);
+    writer->write_rows(image);
+    writer->finish();
+}
+
+
+void
+quiver_plot::encode(std::ostream& stream)
+{
+    phase_timer timer{_profile, "encode"};
+    auto const& image = _canvas.image;
+
+    auto const writer = make_image_writer(_format, stream, image.width(), image.height(), _compression);
+    writer->write_rows(image);
+    writer->finish();
+}
 
-    auto max_x_range = x_enclosure(_spec.arrows.front());
-    auto max_y_range = y_enclosure(_spec.arrows.front());
 
-    for (auto const& arrow: _spec.arrows) {
-        auto const x_range = x_enclosure(arrow);
-        auto const y_range = y_enclosure(arrow);
+// Produces the images of the renders, each rendering overridden by an entry,
+// and the tiles of the pyramid of the rendering. Renders without an output
+// are numbered after the output of the rendering. Tiles are written to
+// output/z/x/y with the extension of the format, skipping tiles that no
+// arrow reaches. Arrows that reach a tile reach its parent, so each level
+// only visits the children of the tiles written at the level above.
+void
+produce_quiver_views(
+    rendering_spec const& rendering,
+    std::vector<rendering_spec> const& renders,
+    style_spec const& style,
+    arrow_store const& arrows,
+    plot_profile* profile
+)
+{
+    if (!rendering.output) {
+        throw std::runtime_error{"output image is not specified"};
+    }
+    validate_spec(!rendering.partition, "partition cannot be combined with renders or pyramid");
+
+    auto const threads = resolve_rendering_threads(rendering);
+    view_renderer renderer{style, arrows, threads, profile};
+
+    std::vector<rendering_spec> views;
+    for (std::size_t index = 0; index < renders.size(); index++) {
+        auto view = merge_rendering(rendering, renders[index]);
+        view.pyramid.reset();
+        validate_spec(!view.partition, "partition cannot be combined with renders or pyramid");
+        if (!renders[index].output) {
+            view.output = make_frame_filename(*rendering.output, index, renders.size());
+        }
+        views.push_back(view);
+    }
+    renderer.render(views, false);
+
+    if (!rendering.pyramid) {
+        return;
+    }
+    auto const& pyramid = *rendering.pyramid;
+    auto const tile_size = pyramid.tile_size.value_or(default_pyramid_tile_size);
+    validate_spec(pyramid.levels > 0 && pyramid.levels <= max_pyramid_levels, "pyramid levels must be in 1-24");
+    validate_spec(tile_size > 0, "pyramid tile_size must be positive");
+
+    // Level 0 is a single tile covering a square whose top left corner is the
+    // top left corner of the plot range.
+    auto const x_range = rendering.x_range.value_or(renderer.x_range());
+    auto const y_range = rendering.y_range.value_or(renderer.y_range());
+    auto const span = std::max(x_range.upper - x_range.lower, y_range.upper - y_range.lower);
+    validate_spec(span > 0, "pyramid needs a nonempty range");
+
+    auto const format = rendering.format ? parse_image_format(*rendering.format) : image_format::png;
+    std::filesystem::path const directory{*rendering.output};
+
+    // Column and row of the tiles to visit at each level
+    std::vector<std::pair<std::size_t, std::size_t>> tiles{{0, 0}};
+    std::vector<std::pair<std::size_t, std::size_t>> children;
+
+    for (int level = 0; level < pyramid.levels && !tiles.empty(); level++) {
+        auto const tile_span = span / double(std::size_t(1) << level);
+
+        views.clear();
+        for (auto const& [x, y] : tiles) {
+            auto view = rendering;
+            view.pyramid.reset();
+            view.pixels_per_length = tile_size / tile_span;
+            view.x_range = range_spec{x_range.lower + double(x) * tile_span, x_range.lower + double(x + 1) * tile_span};
+            view.y_range = range_spec{y_range.upper - double(y + 1) * tile_span, y_range.upper - double(y) * tile_span};
+            view.output = (directory / std::to_string(level) / std::to_string(x) / (std::to_string(y) + image_format_extension(format))).string();
+            views.push_back(view);
+        }
+        auto const rendered = renderer.render(views, true);
+
+        children.clear();
+        for (std::size_t k = 0; k < tiles.size(); k++) {
+            if (rendered[k]) {
+                auto const [x, y] = tiles[k];
+                children.insert(children.end(), {{2 * x, 2 * y}, {2 * x + 1, 2 * y}, {2 * x, 2 * y + 1}, {2 * x + 1, 2 * y + 1}});
+            }
+        }
+        tiles.swap(children);
+    }
+}
+
 
-        max_x_range.lower = std::min(max_x_range.lower, x_range.lower);
-        max_x_range.upper = std::max(max_x_range.upper, x_range.upper);
-        max_y_range.lower = std::min(max_y_range.lower, y_range.lower);
-        max_y_range.upper = std::max(max_y_range.upper, y_range.upper);
+// Data range is only needed as a fallback. Arrows are not scanned when both
+// ranges are given because scanning may involve reading a file.
+plot_view
+resolve_view(rendering_spec const& rendering, arrow_source& arrows, plot_profile* profile)
+{
+    plot_view view;
+    if (rendering.x_range && rendering.y_range) {
+        view.x_range = *rendering.x_range;
+        view.y_range = *rendering.y_range;
+    } else {
+        phase_timer timer{profile, "range"};
+        auto const [data_x_range, data_y_range] = estimate_data_range(arrows);
+        view.x_range = rendering.x_range.value_or(data_x_range);
+        view.y_range = rendering.y_range.value_or(data_y_range);
     }
 
-    return std::make_pair(max_x_range, max_y_range);
+    validate_spec(view.x_range.lower < view.x_range.upper, "x_range must be a valid interval");
+    validate_spec(view.y_range.lower < view.y_range.upper, "y_range must be a valid interval");
+
+    auto const max_span = std::max(
+        view.x_range.upper - view.x_range.lower,
+        view.y_range.upper - view.y_range.lower
+    );
+    view.pixels_per_length = rendering.pixels_per_length.value_or(default_image_size / max_span);
+
+    validate_spec(view.pixels_per_length > 0, "pixels_per_length must be positive");
+    return view;
+}
+
+
+std::pair<range_spec, range_spec>
+estimate_data_range(arrow_source& arrows)
+{
+    std::optional<range_spec> max_x_range;
+    std::optional<range_spec> max_y_range;
+
+    arrows.scan([&](arrow_store const& chunk) {
+        auto const [x_range, y_range] = compute_arrow_bounds(chunk);
+
+        if (!max_x_range) {
+            max_x_range = x_range;
+            max_y_range = y_range;
+        }
+
+        max_x_range->lower = std::min(max_x_range->lower, x_range.lower);
+        max_x_range->upper = std::max(max_x_range->upper, x_range.upper);
+        max_y_range->lower = std::min(max_y_range->lower, y_range.lower);
+        max_y_range->upper = std::max(max_y_range->upper, y_range.upper);
+    });
+
+    if (!max_x_range) {
+        return std::make_pair(range_spec{0, 1}, range_spec{0, 1});
+    }
+    return std::make_pair(*max_x_range, *max_y_range);
 }
 
 
-template<typename T>
-T
-round(double x)
+// Returns the range of the quantity that colors arrows. Arrows with colors of
+// their own are included. Without any values the range is [0, 1].
+range_spec
+estimate_color_limits(arrow_source& arrows, color_source source)
 {
-    return static_cast<T>(std::nearbyint(x));
+    constexpr double pi = 3.14159265358979323846;
+    if (source == color_source::angle) {
+        return range_spec{-pi, pi};
+    }
+
+    std::optional<range_spec> limits;
+    auto const include = [&](double value) {
+        if (!limits) {
+            limits = range_spec{value, value};
+        }
+        limits->lower = std::min(limits->lower, value);
+        limits->upper = std::max(limits->upper, value);
+    };
+
+    arrows.scan([&](arrow_store const& chunk) {
+        auto const dx = chunk.dx();
+        auto const dy = chunk.dy();
+        auto const scalars = chunk.scalar();
+
+        for (std::size_t i = 0; i < chunk.size(); i++) {
+            if (source == color_source::magnitude) {
+                include(std::hypot(dx[i], dy[i]));
+            } else if (scalars && chunk.has_scalar(i)) {
+                include(scalars[i]);
+            }
+        }
+    });
+
+    return limits.value_or(range_spec{0, 1});
 }
 
 
@@ -259,41 +1536,53 @@ validate_spec(bool condition, std::string const& message)
 }
 
 
-BLRgba32
-make_color(color_spec const& spec)
+// Threads of a rendering, validated here for plots, animations and views
+// alike. Zero means all cores.
+unsigned
+resolve_rendering_threads(rendering_spec const& rendering)
 {
-    constexpr double byte_scale = 255;
-    return BLRgba32{
-        round<unsigned>(byte_scale * spec.red),
-        round<unsigned>(byte_scale * spec.green),
-        round<unsigned>(byte_scale * spec.blue),
-        round<unsigned>(byte_scale * spec.alpha)
-    };
+    auto const threads = rendering.threads.value_or(default_thread_count);
+    validate_spec(threads >= 0, "threads must be non-negative");
+    return resolve_thread_count(threads);
+}
+
+
+bool
+same_view(plot_view const& a, plot_view const& b)
+{
+    return a.pixels_per_length == b.pixels_per_length &&
+           a.x_range.lower == b.x_range.lower && a.x_range.upper == b.x_range.upper &&
+           a.y_range.lower == b.y_range.lower && a.y_range.upper == b.y_range.upper;
 }
 
 
-BLPath
-make_arrow_path(double length, double shaft_width, double stem_to_shaft_ratio, double head_aspect_ratio)
+// Returns output file name of a frame. Frame numbers are zero-padded, so
+// "anim.png" becomes "anim_0000.png", "anim_0001.png" and so on.
+std::string
+make_frame_filename(std::string const& output, std::size_t index, std::size_t count)
 {
-    auto const head_length = std::min(shaft_width * stem_to_shaft_ratio / head_aspect_ratio, length);
-    auto const head_width = head_length * head_aspect_ratio;
-    auto const shaft_length = length - head_length;
+    auto const width = std::max(min_frame_number_width, int(std::to_string(count - 1).size()));
 
-    auto const x_stem = shaft_length;
-    auto const x_head = length;
-    auto const y_shaft = shaft_width / 2;
-    auto const y_stem = head_width / 2;
+    std::ostringstream number;
+    number << std::setw(width) << std::setfill('0') << index;
 
-    // Arrow-shaped path pointing from the origin to the east.
-    BLPath path;
-    path.moveTo(0, y_shaft);
-    path.lineTo(x_stem, y_shaft);
-    path.lineTo(x_stem, y_stem);
-    path.lineTo(x_head, 0);
-    path.lineTo(x_stem, -y_stem);
-    path.lineTo(x_stem, -y_shaft);
-    path.lineTo(0, -y_shaft);
-    path.close();
+    std::filesystem::path const path{output};
+    auto const filename = path.stem().string() + "_" + number.str() + path.extension().string();
+    return (path.parent_path() / filename).string();
+}
 
-    return path;
+
+// Opens the output file, or returns stdout if the output is "-".
+std::ostream&
+open_output(std::string const& output, std::ofstream& file)
+{
+    if (output == standard_output) {
+        return std::cout;
+    }
+
+    file.open(output, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error{"failed to open output file " + output};
+    }
+    return file;
 }
@@ -1,6 +1,62 @@
 #pragma once
 
+#include <cstddef>
+#include <memory>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+#include "profile.hpp"
 #include "spec.hpp"
 
 
-void produce_quiver_plot(quiver_spec const& spec);
+struct plot_canvas;
+
+
+// Produces plots one after another. The image buffer and drawing buffers are
+// kept between plots and reused while the image size stays the same. Time
+// spent in each phase is added to the profile if one is set.
+class plot_session
+{
+public:
+    plot_session();
+    ~plot_session();
+
+    void                       produce(quiver_spec const& spec);
+    void                       produce(rendering_spec const& rendering, style_spec const& style, arrow_source& arrows);
+    void                       update(quiver_spec const& previous, quiver_spec const& spec);
+    std::vector<unsigned char> encode(quiver_spec const& spec);
+    std::vector<unsigned char> encode(rendering_spec const& rendering, style_spec const& style, arrow_source& arrows);
+    void                       encode(
+        rendering_spec const& rendering,
+        style_spec const& style,
+        arrow_source& arrows,
+        std::ostream& stream
+    );
+    void                       render(
+        rendering_spec const& rendering,
+        style_spec const& style,
+        arrow_source& arrows,
+        unsigned char* pixels,
+        std::ptrdiff_t stride,
+        bool premultiplied
+    );
+    void                       set_profile(plot_profile* profile);
+
+private:
+    std::unique_ptr<plot_canvas> _canvas;
+    plot_profile*                _profile = nullptr;
+};
+
+
+void produce_quiver_plot(quiver_spec const& spec, plot_profile* profile = nullptr);
+void produce_quiver_animation(quiver_spec const& spec, plot_profile* profile = nullptr);
+void produce_quiver_plot(
+    rendering_spec const& rendering,
+    style_spec const& style,
+    arrow_source& arrows,
+    plot_profile* profile = nullptr
+);
+
+// Returns the width and height in pixels of the plot of the arrows.
+std::pair<int, int> measure_quiver_plot(rendering_spec const& rendering, arrow_source& arrows);
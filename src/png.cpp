@@ -0,0 +1,185 @@
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include <blend2d.h>
+#include <zlib.h>
+
+#include "png.hpp"
+
+
+constexpr std::size_t idat_chunk_size  = 1 << 16;
+constexpr int         bytes_per_pixel  = 4;
+constexpr int         window_bits      = 15;
+constexpr int         memory_level     = 8;
+constexpr int         fast_compression = 1;
+
+// Every row is predicted from the row above. This suits plots, which are
+// mostly flat background, and costs a single subtraction per byte.
+constexpr unsigned char up_filter = 2;
+
+
+static void store_big_endian(unsigned char* data, std::uint32_t value);
+
+
+png_writer::png_writer(std::ostream& stream, int width, int height, int compression)
+: _stream{stream}
+, _width{width}
+, _height{height}
+, _deflate{std::make_unique<z_stream_s>()}
+, _row(1 + std::size_t(width) * bytes_per_pixel)
+, _previous_row(_row.size())
+, _output(idat_chunk_size)
+{
+    // Run-length matching is much faster than the full search and loses
+    // little on filtered plots, which consist of long runs of zeros.
+    auto const strategy = compression <= fast_compression ? Z_RLE : Z_DEFAULT_STRATEGY;
+
+    auto const status = deflateInit2(
+        _deflate.get(), compression, Z_DEFLATED, window_bits, memory_level, strategy
+    );
+    if (status != Z_OK) {
+        throw std::runtime_error{"failed to initialize PNG compression"};
+    }
+    _deflate->next_out = _output.data();
+    _deflate->avail_out = uInt(_output.size());
+
+    // The destructor does not run if the constructor throws, so the stream
+    // is released here.
+    try {
+        write_header();
+    } catch (...) {
+        deflateEnd(_deflate.get());
+        throw;
+    }
+}
+
+
+png_writer::~png_writer()
+{
+    deflateEnd(_deflate.get());
+}
+
+
+void
+png_writer::write_rows(BLImage const& rows)
+{
+    BLImageData data;
+    rows.getData(&data);
+
+    auto const pixels = static_cast<unsigned char const*>(data.pixelData);
+
+    for (int y = 0; y < data.size.h; y++) {
+        auto const row = reinterpret_cast<std::uint32_t const*>(pixels + y * data.stride);
+
+        _row[0] = up_filter;
+        unpremultiply_row(row, _width, _row.data() + 1);
+
+        // The row above the first one is taken as zero, so the previous row
+        // starts out cleared.
+        for (std::size_t i = 1; i < _row.size(); i++) {
+            auto const value = _row[i];
+            _row[i] = static_cast<unsigned char>(value - _previous_row[i]);
+            _previous_row[i] = value;
+        }
+
+        compress(_row.data(), _row.size(), Z_NO_FLUSH);
+        _rows_written++;
+    }
+}
+
+
+void
+png_writer::finish()
+{
+    if (_rows_written != _height) {
+        throw std::logic_error{"PNG image is incomplete"};
+    }
+
+    compress(nullptr, 0, Z_FINISH);
+    write_chunk("IEND", nullptr, 0);
+
+    if (!_stream.flush()) {
+        throw std::runtime_error{"failed to write image"};
+    }
+}
+
+
+void
+png_writer::write_header()
+{
+    static unsigned char const signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    _stream.write(reinterpret_cast<char const*>(signature), sizeof signature);
+
+    unsigned char header[13];
+    store_big_endian(header, std::uint32_t(_width));
+    store_big_endian(header + 4, std::uint32_t(_height));
+    header[8] = 8;  // Bit depth
+    header[9] = 6;  // Truecolor with alpha
+    header[10] = 0; // Deflate
+    header[11] = 0; // Adaptive filtering
+    header[12] = 0; // No interlace
+    write_chunk("IHDR", header, sizeof header);
+}
+
+
+// Feeds data to the compressor and writes out an IDAT chunk whenever the
+// output buffer fills up.
+void
+png_writer::compress(unsigned char const* data, std::size_t size, int flush)
+{
+    _deflate->next_in = const_cast<unsigned char*>(data);
+    _deflate->avail_in = uInt(size);
+
+    int status;
+    do {
+        status = deflate(_deflate.get(), flush);
+        if (status == Z_STREAM_ERROR) {
+            throw std::runtime_error{"failed to compress PNG image"};
+        }
+
+        auto const pending = _output.size() - _deflate->avail_out;
+        if (_deflate->avail_out == 0 || (status == Z_STREAM_END && pending > 0)) {
+            write_chunk("IDAT", _output.data(), pending);
+            _deflate->next_out = _output.data();
+            _deflate->avail_out = uInt(_output.size());
+        }
+    } while (flush == Z_FINISH ? status != Z_STREAM_END : _deflate->avail_in > 0);
+}
+
+
+void
+png_writer::write_chunk(char const* type, unsigned char const* data, std::size_t size)
+{
+    unsigned char length[4];
+    store_big_endian(length, std::uint32_t(size));
+
+    auto crc = crc32(0, reinterpret_cast<unsigned char const*>(type), 4);
+    if (size > 0) {
+        crc = crc32(crc, data, uInt(size));
+    }
+    unsigned char checksum[4];
+    store_big_endian(checksum, std::uint32_t(crc));
+
+    _stream.write(reinterpret_cast<char const*>(length), 4);
+    _stream.write(type, 4);
+    _stream.write(reinterpret_cast<char const*>(data), std::streamsize(size));
+    _stream.write(reinterpret_cast<char const*>(checksum), 4);
+
+    if (!_stream) {
+        throw std::runtime_error{"failed to write image"};
+    }
+}
+
+
+void
+store_big_endian(unsigned char* data, std::uint32_t value)
+{
+    data[0] = static_cast<unsigned char>(value >> 24);
+    data[1] = static_cast<unsigned char>(value >> 16);
+    data[2] = static_cast<unsigned char>(value >> 8);
+    data[3] = static_cast<unsigned char>(value);
+}
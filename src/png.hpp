@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+#include <blend2d.h>
+
+#include "image_writer.hpp"
+
+
+struct z_stream_s;
+
+
+// Writes a PNG image incrementally. Each row is deflated as soon as it is
+// given, and compressed data is emitted in IDAT chunks of bounded size.
+class png_writer : public image_writer
+{
+public:
+    png_writer(std::ostream& stream, int width, int height, int compression);
+    ~png_writer() override;
+    void write_rows(BLImage const& rows) override;
+    void finish() override;
+
+private:
+    void write_header();
+    void compress(unsigned char const* data, std::size_t size, int flush);
+    void write_chunk(char const* type, unsigned char const* data, std::size_t size);
+
+private:
+    std::ostream&               _stream;
+    int                         _width;
+    int                         _height;
+    int                         _rows_written = 0;
+    std::unique_ptr<z_stream_s> _deflate;
+    std::vector<unsigned char>  _row;
+    std::vector<unsigned char>  _previous_row;
+    std::vector<unsigned char>  _output;
+};
+
@@ -0,0 +1,247 @@
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+#if defined(__unix__) || defined(__APPLE__)
+# define QUIVER_USE_GETRUSAGE
+# include <sys/resource.h>
+#endif
+
+#ifdef CLOCK_THREAD_CPUTIME_ID
+# define QUIVER_USE_THREAD_CPUTIME
+#endif
+
+#include <blend2d.h>
+
+#include "profile.hpp"
+
+
+static double        query_cpu_seconds(bool thread);
+static std::uint64_t query_peak_memory();
+
+
+// Whether phase timers of this thread measure its own CPU time
+static thread_local bool measure_thread_cpu = false;
+
+
+void
+plot_profile::add(std::string const& phase, phase_time const& time)
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    for (auto& [name, total] : _phases) {
+        if (name == phase) {
+            total.wall_seconds += time.wall_seconds;
+            total.cpu_seconds += time.cpu_seconds;
+            return;
+        }
+    }
+    _phases.emplace_back(phase, time);
+}
+
+
+// Returns the time of the phase, or zero if the phase has not occurred.
+phase_time
+plot_profile::get(std::string const& phase) const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    for (auto const& [name, total] : _phases) {
+        if (name == phase) {
+            return total;
+        }
+    }
+    return phase_time{};
+}
+
+
+void
+plot_profile::count(std::string const& counter, std::uint64_t amount)
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    for (auto& [name, total] : _counters) {
+        if (name == counter) {
+            total += amount;
+            return;
+        }
+    }
+    _counters.emplace_back(counter, amount);
+}
+
+
+// Replaces the value of a counter that does not add up, such as a size.
+void
+plot_profile::set(std::string const& counter, std::uint64_t value)
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+
+    for (auto& [name, current] : _counters) {
+        if (name == counter) {
+            current = value;
+            return;
+        }
+    }
+    _counters.emplace_back(counter, value);
+}
+
+
+plot_profile::phase_list
+plot_profile::phases() const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _phases;
+}
+
+
+plot_profile::counter_list
+plot_profile::counters() const
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    return _counters;
+}
+
+
+void
+plot_profile::clear()
+{
+    std::lock_guard<std::mutex> lock{_mutex};
+    _phases.clear();
+    _counters.clear();
+}
+
+
+phase_timer::phase_timer(plot_profile* profile, char const* phase)
+: _profile{profile}, _phase{phase}, _thread_cpu{measure_thread_cpu}
+{
+    if (_profile) {
+        _wall_start = std::chrono::steady_clock::now();
+        _cpu_start = query_cpu_seconds(_thread_cpu);
+    }
+}
+
+
+phase_timer::~phase_timer()
+{
+    if (_profile) {
+        phase_time time;
+        time.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - _wall_start).count();
+        time.cpu_seconds = query_cpu_seconds(_thread_cpu) - _cpu_start;
+        _profile->add(_phase, time);
+    }
+}
+
+
+thread_cpu_scope::thread_cpu_scope()
+: _enclosing{measure_thread_cpu}
+{
+    measure_thread_cpu = true;
+}
+
+
+thread_cpu_scope::~thread_cpu_scope()
+{
+    measure_thread_cpu = _enclosing;
+}
+
+
+// Records the peak memory of the process and the memory and pipelines held
+// by the Blend2D runtime. The runtime is shared, so these are process-wide.
+void
+record_resource_usage(plot_profile& profile)
+{
+    if (auto const peak_memory = query_peak_memory()) {
+        profile.set("peak_rss_bytes", peak_memory);
+    }
+
+    BLRuntimeResourceInfo info;
+    if (BLRuntime::queryResourceInfo(&info) == BL_SUCCESS) {
+        profile.set("blend2d_memory_bytes", info.vmUsed + info.zmUsed);
+        profile.set("blend2d_pipelines", info.dynamicPipelineCount);
+    }
+}
+
+
+// Writes phases and counters either as a table or as a single line of JSON.
+void
+write_profile(std::ostream& out, plot_profile const& profile, bool json)
+{
+    auto const phases = profile.phases();
+    auto const counters = profile.counters();
+    auto const flags = out.flags();
+    auto const precision = out.precision();
+
+    out << std::fixed << std::setprecision(6);
+
+    if (json) {
+        out << R"({"phases": {)";
+        for (std::size_t i = 0; i < phases.size(); i++) {
+            auto const& [name, time] = phases[i];
+            out << (i > 0 ? ", " : "") << '"' << name << R"(": {"wall_seconds": )" << time.wall_seconds
+                << R"(, "cpu_seconds": )" << time.cpu_seconds << '}';
+        }
+        out << R"(}, "counters": {)";
+        for (std::size_t i = 0; i < counters.size(); i++) {
+            auto const& [name, value] = counters[i];
+            out << (i > 0 ? ", " : "") << '"' << name << R"(": )" << value;
+        }
+        out << "}}\n";
+    } else {
+        out << std::left << std::setw(24) << "phase" << std::right << std::setw(12) << "wall (s)"
+            << std::setw(12) << "cpu (s)" << '\n';
+        for (auto const& [name, time] : phases) {
+            out << std::left << std::setw(24) << name << std::right << std::setw(12) << time.wall_seconds
+                << std::setw(12) << time.cpu_seconds << '\n';
+        }
+        for (auto const& [name, value] : counters) {
+            out << std::left << std::setw(24) << name << std::right << std::setw(12) << value << '\n';
+        }
+    }
+
+    out.flags(flags);
+    out.precision(precision);
+}
+
+
+// Returns the CPU time of the calling thread or of the whole process. Falls
+// back to the process where threads cannot be measured.
+double
+query_cpu_seconds(bool thread)
+{
+#ifdef QUIVER_USE_THREAD_CPUTIME
+    if (thread) {
+        timespec time;
+        if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time) == 0) {
+            return double(time.tv_sec) + double(time.tv_nsec) * 1e-9;
+        }
+    }
+#else
+    (void) thread;
+#endif
+    return double(std::clock()) / CLOCKS_PER_SEC;
+}
+
+
+// Returns the peak resident memory of the process in bytes, or zero if it is
+// not known on this platform.
+std::uint64_t
+query_peak_memory()
+{
+#ifdef QUIVER_USE_GETRUSAGE
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+# ifdef __APPLE__
+    return std::uint64_t(usage.ru_maxrss);
+# else
+    return std::uint64_t(usage.ru_maxrss) * 1024;
+# endif
+#else
+    return 0;
+#endif
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+// Time spent in a phase of producing a plot. CPU time counts all threads of
+// the process, or only the timing thread within a thread_cpu_scope.
+struct phase_time
+{
+    double wall_seconds = 0;
+    double cpu_seconds  = 0;
+};
+
+
+// Accumulates the time of named phases and the values of named counters in
+// the order they first occur. Plots rendered in parallel may share a profile;
+// their times and counts add up.
+class plot_profile
+{
+public:
+    using phase_list   = std::vector<std::pair<std::string, phase_time>>;
+    using counter_list = std::vector<std::pair<std::string, std::uint64_t>>;
+
+    void         add(std::string const& phase, phase_time const& time);
+    phase_time   get(std::string const& phase) const;
+    void         count(std::string const& counter, std::uint64_t amount);
+    void         set(std::string const& counter, std::uint64_t value);
+    phase_list   phases() const;
+    counter_list counters() const;
+    void         clear();
+
+private:
+    mutable std::mutex _mutex;
+    phase_list         _phases;
+    counter_list       _counters;
+};
+
+
+// Adds the time from construction to destruction to a phase of the profile.
+// Does nothing if the profile is null.
+class phase_timer
+{
+public:
+    phase_timer(plot_profile* profile, char const* phase);
+    ~phase_timer();
+
+    phase_timer(phase_timer const&)            = delete;
+    phase_timer& operator=(phase_timer const&) = delete;
+
+private:
+    plot_profile*                         _profile;
+    char const*                           _phase;
+    bool                                  _thread_cpu = false;
+    std::chrono::steady_clock::time_point _wall_start;
+    double                                _cpu_start = 0;
+};
+
+
+// Makes phase timers started on the calling thread measure the CPU time of
+// that thread while the scope exists. Plots rendered concurrently on single
+// threads use it, so each phase counts only its own plot.
+class thread_cpu_scope
+{
+public:
+    thread_cpu_scope();
+    ~thread_cpu_scope();
+
+    thread_cpu_scope(thread_cpu_scope const&)            = delete;
+    thread_cpu_scope& operator=(thread_cpu_scope const&) = delete;
+
+private:
+    bool _enclosing;
+};
+
+
+void record_resource_usage(plot_profile& profile);
+void write_profile(std::ostream& out, plot_profile const& profile, bool json);
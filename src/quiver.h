@@ -0,0 +1,134 @@
+/*
+ * C interface of libquiver, for rendering quiver plots in process.
+ *
+ * Arrows are given as strided arrays, so that columns of a structured array
+ * or a numpy view can be passed without copying them into a new layout. The
+ * rendering and style are given as the JSON objects of a spec file.
+ *
+ * Functions return QUIVER_OK on success. On failure, quiver_last_error()
+ * describes the error. A session is not thread safe, but separate sessions
+ * may be used from separate threads.
+ */
+#ifndef QUIVER_H
+#define QUIVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Functions exported by the library, which hides all other symbols. */
+#if defined(QUIVER_BUILDING_LIBRARY) && defined(__GNUC__)
+#define QUIVER_API __attribute__((visibility("default")))
+#else
+#define QUIVER_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+enum
+{
+    QUIVER_OK    = 0,
+    QUIVER_ERROR = 1
+};
+
+
+/* Layout of rendered pixels. Both are 4 bytes per pixel in R, G, B, A order. */
+typedef enum quiver_pixel_format
+{
+    QUIVER_RGBA_PREMULTIPLIED = 0, /* Same as the raw output format */
+    QUIVER_RGBA               = 1
+} quiver_pixel_format;
+
+
+/*
+ * Array of count values starting at data, stride bytes apart. Contiguous
+ * values have a stride of the size of a value, and a stride of 0 repeats the
+ * single value at data, as in numpy broadcast arrays. Optional arrays are
+ * null if absent.
+ */
+typedef struct quiver_array
+{
+    void const* data;
+    ptrdiff_t   stride;
+} quiver_array;
+
+
+/*
+ * Arrows as parallel arrays. x, y, dx, dy, w, a and s hold doubles, and c
+ * holds colors packed as 0xAARRGGBB in 32-bit integers. w, a, c and s are
+ * optional and override the style for every arrow when given. w and a must
+ * be positive.
+ */
+typedef struct quiver_arrows
+{
+    size_t       count;
+    quiver_array x;
+    quiver_array y;
+    quiver_array dx;
+    quiver_array dy;
+    quiver_array w;
+    quiver_array a;
+    quiver_array c;
+    quiver_array s;
+} quiver_arrows;
+
+
+typedef struct quiver_session quiver_session;
+
+
+/* Creates a session, which keeps drawing buffers between plots. */
+QUIVER_API quiver_session* quiver_session_create(void);
+QUIVER_API void            quiver_session_destroy(quiver_session* session);
+
+/* Returns the message of the last error in the session, or "". */
+QUIVER_API char const* quiver_last_error(quiver_session const* session);
+
+/*
+ * Computes the size of the plot in pixels. settings is a JSON object with
+ * the optional keys "rendering" and "style" of a spec file, or null.
+ */
+QUIVER_API int quiver_measure(
+    quiver_session* session,
+    char const* settings,
+    quiver_arrows const* arrows,
+    int* width,
+    int* height
+);
+
+/*
+ * Renders the plot into rows of pixels, stride bytes apart. The pixels must
+ * be 4-byte aligned and hold the size given by quiver_measure(). Output
+ * options of the rendering are ignored.
+ */
+QUIVER_API int quiver_render(
+    quiver_session* session,
+    char const* settings,
+    quiver_arrows const* arrows,
+    void* pixels,
+    ptrdiff_t stride,
+    quiver_pixel_format format
+);
+
+/*
+ * Renders the plot and encodes it in the format of the rendering, PNG by
+ * default. The bytes are allocated by the library and released with
+ * quiver_free().
+ */
+QUIVER_API int quiver_encode(
+    quiver_session* session,
+    char const* settings,
+    quiver_arrows const* arrows,
+    unsigned char** data,
+    size_t* size
+);
+
+QUIVER_API void quiver_free(void* data);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,205 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "raw_arrows.hpp"
+#include "spec.hpp"
+
+
+constexpr std::size_t   raw_header_size   = 64;
+constexpr std::size_t   raw_alignment     = 8;
+constexpr std::uint32_t raw_version       = 1;
+constexpr std::uint32_t raw_required_mask = 0x0F;
+constexpr std::uint32_t raw_known_mask    = 0xFF;
+
+
+static std::uint32_t load_uint32(unsigned char const* bytes);
+static std::uint64_t load_uint64(unsigned char const* bytes);
+static std::size_t   align_size(std::size_t size);
+
+
+// Validates the header and locates the columns. The settings are decoded
+// here, so that errors in them are reported before anything is drawn.
+raw_arrow_source::raw_arrow_source(std::string_view data, std::size_t chunk_size)
+: _data{data}
+, _chunk_size{chunk_size}
+{
+    auto const bytes = reinterpret_cast<unsigned char const*>(data.data());
+    if (data.size() < raw_header_size || data.substr(0, raw_arrows_magic.size()) != raw_arrows_magic) {
+        throw std::runtime_error{"not a raw arrow file"};
+    }
+    if (load_uint32(bytes + 8) != raw_version) {
+        throw std::runtime_error{"unsupported raw arrow file version"};
+    }
+
+    _value_size = load_uint32(bytes + 12);
+    if (_value_size != 4 && _value_size != 8) {
+        throw std::runtime_error{"raw arrow value size must be 4 or 8"};
+    }
+
+    auto const count = load_uint64(bytes + 16);
+    auto const mask = load_uint32(bytes + 24);
+    auto const settings_size = load_uint32(bytes + 28);
+    if ((mask & raw_required_mask) != raw_required_mask || (mask & ~raw_known_mask) != 0) {
+        throw std::runtime_error{"raw arrow columns must include x, y, dx and dy and no unknown ones"};
+    }
+
+    // Sizes are checked against the data before they are multiplied, so
+    // that a corrupt header cannot overflow them.
+    auto offset = raw_header_size;
+    auto const take = [&](std::size_t size) {
+        if (size > data.size() - offset) {
+            throw std::runtime_error{"raw arrow file is truncated"};
+        }
+        auto const begin = offset;
+        offset += std::min(align_size(size), data.size() - offset);
+        return begin;
+    };
+    auto const take_column = [&](std::uint32_t bit, std::size_t value_size) -> std::size_t {
+        if (!(mask & bit)) {
+            return 0;
+        }
+        if (count > (data.size() - offset) / value_size) {
+            throw std::runtime_error{"raw arrow file is truncated"};
+        }
+        return take(std::size_t(count) * value_size);
+    };
+
+    auto const settings = data.substr(take(settings_size), settings_size);
+    _count = std::size_t(count);
+    _columns.x = take_column(0x01, _value_size);
+    _columns.y = take_column(0x02, _value_size);
+    _columns.dx = take_column(0x04, _value_size);
+    _columns.dy = take_column(0x08, _value_size);
+    _columns.w = take_column(0x10, _value_size);
+    _columns.a = take_column(0x20, _value_size);
+    _columns.c = take_column(0x40, sizeof(std::uint32_t));
+    _columns.s = take_column(0x80, _value_size);
+
+    if (settings.find_first_not_of(std::string_view{" \t\r\n\0", 5}) != std::string_view::npos) {
+        auto spec = parse_quiver_spec(settings);
+        if (!spec.arrows.empty() || !spec.frames.empty() || !spec.renders.empty()) {
+            throw std::runtime_error{"raw arrow settings may only hold rendering and style"};
+        }
+        _rendering = std::move(spec.rendering);
+        _style = std::move(spec.style);
+    }
+}
+
+
+rendering_spec&
+raw_arrow_source::rendering()
+{
+    return _rendering;
+}
+
+
+style_spec&
+raw_arrow_source::style()
+{
+    return _style;
+}
+
+
+std::size_t
+raw_arrow_source::size() const
+{
+    return _count;
+}
+
+
+void
+raw_arrow_source::scan(chunk_handler const& handler)
+{
+    for (std::size_t begin = 0; begin < _count; begin += _chunk_size) {
+        auto const end = std::min(begin + _chunk_size, _count);
+
+        arrow_columns columns;
+        gather(_columns.x, begin, end, columns.x);
+        gather(_columns.y, begin, end, columns.y);
+        gather(_columns.dx, begin, end, columns.dx);
+        gather(_columns.dy, begin, end, columns.dy);
+        gather(_columns.w, begin, end, columns.w);
+        gather(_columns.a, begin, end, columns.a);
+        gather(_columns.c, begin, end, columns.c);
+        gather(_columns.s, begin, end, columns.s);
+
+        _chunk.clear();
+        _chunk.append(std::move(columns));
+        handler(_chunk);
+    }
+}
+
+
+void
+raw_arrow_source::gather(std::size_t offset, std::size_t begin, std::size_t end, std::vector<double>& values) const
+{
+    if (offset == 0) {
+        return;
+    }
+
+    auto const bytes = reinterpret_cast<unsigned char const*>(_data.data()) + offset;
+    values.resize(end - begin);
+    for (auto i = begin; i < end; i++) {
+        if (_value_size == sizeof(double)) {
+            auto const bits = load_uint64(bytes + i * sizeof(double));
+            std::memcpy(&values[i - begin], &bits, sizeof(double));
+        } else {
+            auto const bits = load_uint32(bytes + i * sizeof(float));
+            float value;
+            std::memcpy(&value, &bits, sizeof(float));
+            values[i - begin] = value;
+        }
+    }
+}
+
+
+void
+raw_arrow_source::gather(std::size_t offset, std::size_t begin, std::size_t end, std::vector<std::uint32_t>& values) const
+{
+    if (offset == 0) {
+        return;
+    }
+
+    auto const bytes = reinterpret_cast<unsigned char const*>(_data.data()) + offset;
+    values.resize(end - begin);
+    for (auto i = begin; i < end; i++) {
+        values[i - begin] = load_uint32(bytes + i * sizeof(std::uint32_t));
+    }
+}
+
+
+// Reads little-endian integers regardless of the byte order of the host.
+// Compilers turn these into plain loads on little-endian hosts.
+std::uint32_t
+load_uint32(unsigned char const* bytes)
+{
+    std::uint32_t value = 0;
+    for (std::size_t k = 0; k < sizeof value; k++) {
+        value |= std::uint32_t(bytes[k]) << (8 * k);
+    }
+    return value;
+}
+
+
+std::uint64_t
+load_uint64(unsigned char const* bytes)
+{
+    std::uint64_t value = 0;
+    for (std::size_t k = 0; k < sizeof value; k++) {
+        value |= std::uint64_t(bytes[k]) << (8 * k);
+    }
+    return value;
+}
+
+
+std::size_t
+align_size(std::size_t size)
+{
+    return (size + raw_alignment - 1) / raw_alignment * raw_alignment;
+}
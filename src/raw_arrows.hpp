@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "spec.hpp"
+
+
+// Raw arrow files hold arrows as binary columns that programs can write
+// straight from memory. All numbers are little endian. The file starts with
+// a header of 64 bytes:
+//
+//   offset  type      field
+//   0       char[8]   magic "QUIVRAW\0"
+//   8       uint32    version, 1
+//   12      uint32    value size of real columns, 4 (float32) or 8 (float64)
+//   16      uint64    number of arrows
+//   24      uint32    columns present, bits x=1 y=2 dx=4 dy=8 w=16 a=32 c=64 s=128
+//   28      uint32    size of the settings in bytes
+//   32      -         reserved, zero
+//
+// The settings follow: a JSON object with the optional keys "rendering" and
+// "style" of a spec. Then come the present columns in the order of their
+// bits, each holding a value per arrow. c holds uint32 colors packed as
+// 0xAARRGGBB, and the other columns hold reals. The settings and each column
+// are padded with zeros to a multiple of 8 bytes. x, y, dx and dy are
+// required, and w, a, c and s apply to every arrow when present.
+constexpr std::string_view raw_arrows_magic{"QUIVRAW\0", 8};
+
+
+// Arrows of a raw arrow file in memory, usually mapped. Columns are read in
+// place and converted in chunks on each scan, so the arrows are never held
+// as a whole. The data must outlive the source.
+class raw_arrow_source : public arrow_source
+{
+public:
+    static constexpr std::size_t default_chunk_size = 65536;
+
+    explicit raw_arrow_source(std::string_view data, std::size_t chunk_size = default_chunk_size);
+
+    rendering_spec& rendering();
+    style_spec&     style();
+    std::size_t     size() const;
+    void            scan(chunk_handler const& handler) override;
+
+private:
+    // Offsets of the columns in the data, or zero if absent
+    struct column_offsets
+    {
+        std::size_t x  = 0;
+        std::size_t y  = 0;
+        std::size_t dx = 0;
+        std::size_t dy = 0;
+        std::size_t w  = 0;
+        std::size_t a  = 0;
+        std::size_t c  = 0;
+        std::size_t s  = 0;
+    };
+
+    void gather(std::size_t offset, std::size_t begin, std::size_t end, std::vector<double>& values) const;
+    void gather(std::size_t offset, std::size_t begin, std::size_t end, std::vector<std::uint32_t>& values) const;
+
+private:
+    std::string_view _data;
+    std::size_t      _chunk_size;
+    std::size_t      _count = 0;
+    std::size_t      _value_size = 0;
+    column_offsets   _columns;
+    rendering_spec   _rendering;
+    style_spec       _style;
+    arrow_store      _chunk;
+};
@@ -0,0 +1,150 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <blend2d.h>
+
+#include "parallel.hpp"
+#include "spatial_sort.hpp"
+
+
+// Tails are quantized to a grid of 2^16 cells per axis, finer than any image,
+// and the key is sorted a byte at a time.
+constexpr double      key_cells_per_axis = 65535;
+constexpr int         radix_bits         = 8;
+constexpr std::size_t radix_size         = std::size_t(1) << radix_bits;
+constexpr int         key_bits           = 32;
+
+// Fewer keys are sorted on the calling thread only.
+constexpr std::size_t parallel_sort_min_size = 65536;
+
+
+static std::uint32_t quantize(double t);
+static std::uint32_t spread_bits(std::uint32_t value);
+
+
+void
+spatial_sorter::sort(
+    arrow_store const& arrows,
+    BLBox const& box,
+    std::vector<std::size_t>& indices,
+    unsigned threads
+)
+{
+    auto const n = indices.size();
+    if (n < 2) {
+        return;
+    }
+    if (n < parallel_sort_min_size) {
+        threads = 1;
+    }
+
+    // Rows are counted from the top, so arrows are submitted in the order
+    // the image is rasterized.
+    auto const x_scale = box.x1 > box.x0 ? key_cells_per_axis / (box.x1 - box.x0) : 0.0;
+    auto const y_scale = box.y1 > box.y0 ? key_cells_per_axis / (box.y1 - box.y0) : 0.0;
+    auto const xs = arrows.x();
+    auto const ys = arrows.y();
+
+    _keys.resize(n);
+    parallel_for(threads, threads, [&](std::size_t block, unsigned) {
+        auto const begin = n * block / threads;
+        auto const end = n * (block + 1) / threads;
+        for (auto k = begin; k < end; k++) {
+            auto const i = indices[k];
+            auto const column = quantize((xs[i] - box.x0) * x_scale);
+            auto const row = quantize((box.y1 - ys[i]) * y_scale);
+            _keys[k] = spread_bits(column) | spread_bits(row) << 1;
+        }
+    });
+
+    radix_sort(indices, threads);
+}
+
+
+// Sorts the keys with the indices by least significant digit first. Each
+// pass splits the keys into a block per thread: blocks count their digits,
+// the counts give every block its own output positions for each digit, and
+// blocks scatter their keys there in order, which keeps the sort stable.
+void
+spatial_sorter::radix_sort(std::vector<std::size_t>& indices, unsigned threads)
+{
+    auto const n = _keys.size();
+    _sorted_keys.resize(n);
+    _sorted_indices.resize(n);
+
+    for (int shift = 0; shift < key_bits; shift += radix_bits) {
+        _counts.assign(threads * radix_size, 0);
+        parallel_for(threads, threads, [&](std::size_t block, unsigned) {
+            auto const counts = _counts.data() + block * radix_size;
+            auto const end = n * (block + 1) / threads;
+            for (auto k = n * block / threads; k < end; k++) {
+                counts[_keys[k] >> shift & (radix_size - 1)]++;
+            }
+        });
+
+        // A digit shared by all keys leaves the order as it is.
+        auto const shared = [&] {
+            for (std::size_t digit = 0; digit < radix_size; digit++) {
+                std::size_t total = 0;
+                for (unsigned block = 0; block < threads; block++) {
+                    total += _counts[block * radix_size + digit];
+                }
+                if (total != 0) {
+                    return total == n;
+                }
+            }
+            return false;
+        }();
+        if (shared) {
+            continue;
+        }
+
+        std::size_t position = 0;
+        for (std::size_t digit = 0; digit < radix_size; digit++) {
+            for (unsigned block = 0; block < threads; block++) {
+                auto& count = _counts[block * radix_size + digit];
+                auto const next = position + count;
+                count = position;
+                position = next;
+            }
+        }
+
+        parallel_for(threads, threads, [&](std::size_t block, unsigned) {
+            auto const positions = _counts.data() + block * radix_size;
+            auto const end = n * (block + 1) / threads;
+            for (auto k = n * block / threads; k < end; k++) {
+                auto const position = positions[_keys[k] >> shift & (radix_size - 1)]++;
+                _sorted_keys[position] = _keys[k];
+                _sorted_indices[position] = indices[k];
+            }
+        });
+
+        std::swap(_keys, _sorted_keys);
+        std::swap(indices, _sorted_indices);
+    }
+}
+
+
+// Returns the grid cell of a coordinate scaled to the grid. Values outside
+// the grid, and NaN, are clamped.
+std::uint32_t
+quantize(double t)
+{
+    return t > 0 ? std::uint32_t(std::min(t, key_cells_per_axis)) : 0;
+}
+
+
+// Spreads the low 16 bits of the value to the even bits.
+std::uint32_t
+spread_bits(std::uint32_t value)
+{
+    value &= 0xFFFF;
+    value = (value | value << 8) & 0x00FF00FF;
+    value = (value | value << 4) & 0x0F0F0F0F;
+    value = (value | value << 2) & 0x33333333;
+    value = (value | value << 1) & 0x55555555;
+    return value;
+}
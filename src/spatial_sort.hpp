@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <blend2d.h>
+
+#include "spec.hpp"
+
+
+// Sorts arrows along a Z-order (Morton) curve through their tails, so that
+// arrows drawn one after another lie close together on the canvas. Keys are
+// sorted by a stable radix sort, so arrows with the same key keep their order
+// and the result does not depend on the number of threads. The sorter keeps
+// its buffers across sorts; it is not thread safe.
+class spatial_sorter
+{
+public:
+    // Reorders the arrow indices by the Z-order of the tails within the box,
+    // in data coordinates, from the top left corner. Tails outside the box
+    // are clamped to its edges.
+    void sort(
+        arrow_store const& arrows,
+        BLBox const& box,
+        std::vector<std::size_t>& indices,
+        unsigned threads = 1
+    );
+
+private:
+    void radix_sort(std::vector<std::size_t>& indices, unsigned threads);
+
+private:
+    std::vector<std::uint32_t> _keys;
+    std::vector<std::uint32_t> _sorted_keys;
+    std::vector<std::size_t>   _sorted_indices;
+    std::vector<std::size_t>   _counts;
+};
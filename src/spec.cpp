@@ -1,10 +1,37 @@
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <random>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <utility>
 
 #include <jsoncons/json.hpp>
+#include <jsoncons/json_cursor.hpp>
+#include <jsoncons_ext/cbor/cbor_cursor.hpp>
+#include <jsoncons_ext/msgpack/msgpack_cursor.hpp>
 
+#include "parallel.hpp"
+#include "raw_arrows.hpp"
 #include "spec.hpp"
 
 
+// Arrays of arrow objects at least this large are decoded in parallel, in
+// pieces of about equal size. Pieces are kept small so that the text copied
+// for each and the growth slack of its store stay small.
+constexpr std::size_t parallel_decode_min_size  = std::size_t(1) << 22;
+constexpr std::size_t decode_pieces_per_thread = 4;
+constexpr std::size_t decode_piece_max_size    = std::size_t(1) << 20;
+
+
 // range_spec as a JSON array of two numbers.
 template<class Json>
 struct jsoncons::json_type_traits<Json, range_spec>
@@ -35,7 +62,8 @@ struct jsoncons::json_type_traits<Json, range_spec>
 };
 
 
-// color_spec as a JSON array of three (RGB) or four (RGBA) numbers.
+// color_spec as a JSON array of three (RGB) or four (RGBA) numbers, or as a
+// hex string "#rrggbb" or "#rrggbbaa".
 template<class Json>
 struct jsoncons::json_type_traits<Json, color_spec>
 {
@@ -44,11 +72,19 @@ struct jsoncons::json_type_traits<Json, color_spec>
 
     static bool is(const Json& j) noexcept
     {
+        if (j.is_string()) {
+            auto const str = j.as_string_view();
+            return !str.empty() && str[0] == '#' && (str.size() == 7 || str.size() == 9);
+        }
         return j.is_array() && (j.size() == 3 || j.size() == 4);
     }
 
     static value_type as(const Json& j)
     {
+        if (j.is_string()) {
+            return parse_hex_color(j.as_string());
+        }
+
         value_type color = {
             j.at(0).template as<double>(),
             j.at(1).template as<double>(),
@@ -71,9 +107,74 @@ struct jsoncons::json_type_traits<Json, color_spec>
         }
         return j;
     }
+
+    static value_type parse_hex_color(std::string const& str)
+    {
+        // Every digit is checked, as stoul alone would accept a sign, spaces
+        // or a 0x prefix.
+        auto const is_hex = [](char ch) { return std::isxdigit(static_cast<unsigned char>(ch)) != 0; };
+        auto const digits = str.empty() ? 0 : str.size() - 1;
+        if (str.empty() || str[0] != '#' || (digits != 6 && digits != 8) || !std::all_of(str.begin() + 1, str.end(), is_hex)) {
+            throw std::runtime_error{"invalid color: " + str};
+        }
+
+        // Reorder RRGGBBAA to the packed AARRGGBB.
+        auto const packed = static_cast<std::uint32_t>(std::stoul(str.substr(1), nullptr, 16));
+        return unpack_color(digits == 6 ? 0xFF000000 | packed : packed << 24 | packed >> 8);
+    }
 };
 
 
+JSONCONS_N_MEMBER_TRAITS(
+    aggregate_spec,
+
+    // Required fields
+    1,
+    cells,
+
+    // Optional fields
+    width,
+    color
+)
+
+
+JSONCONS_N_MEMBER_TRAITS(
+    pyramid_spec,
+
+    // Required fields
+    1,
+    levels,
+
+    // Optional fields
+    tile_size
+)
+
+
+JSONCONS_N_MEMBER_TRAITS(
+    sprite_spec,
+
+    // Required fields
+    0,
+
+    // Optional fields
+    angles,
+    length_step,
+    subpixels,
+    max_size,
+    cache_size
+)
+
+
+JSONCONS_N_MEMBER_TRAITS(
+    partition_spec,
+
+    // Required fields
+    2,
+    index,
+    count
+)
+
+
 JSONCONS_N_MEMBER_TRAITS(
     rendering_spec,
 
@@ -84,10 +185,57 @@ JSONCONS_N_MEMBER_TRAITS(
     pixels_per_length,
     x_range,
     y_range,
-    output
+    output,
+    threads,
+    order,
+    tile_size,
+    format,
+    compression,
+    dot_size,
+    aggregate,
+    pyramid,
+    partition,
+    sprites
 )
 
 
+// colormap_spec as the name of a built-in colormap or as an array of colors.
+template<class Json>
+struct jsoncons::json_type_traits<Json, colormap_spec>
+{
+    using allocator_type = typename Json::allocator_type;
+    using value_type     = colormap_spec;
+
+    static bool is(const Json& j) noexcept
+    {
+        return j.is_string() || j.is_array();
+    }
+
+    static value_type as(const Json& j)
+    {
+        value_type colormap;
+        if (j.is_string()) {
+            colormap.name = j.as_string();
+        } else {
+            colormap.colors = j.template as<std::vector<color_spec>>();
+        }
+        return colormap;
+    }
+
+    static Json to_json(value_type const& value, allocator_type alloc = {})
+    {
+        if (value.colors.empty()) {
+            return Json{value.name, alloc};
+        }
+        Json j{jsoncons::json_array_arg_t{}, jsoncons::semantic_tag::none, alloc};
+        for (auto const& color : value.colors) {
+            j.push_back(Json{color, alloc});
+        }
+        return j;
+    }
+};
+
+
 JSONCONS_N_MEMBER_TRAITS(
     style_spec,
 
@@ -99,42 +247,1367 @@ JSONCONS_N_MEMBER_TRAITS(
     arrow_color,
     shaft_width,
     stem_to_shaft_ratio,
-    head_aspect_ratio
+    head_aspect_ratio,
+    palette,
+    colormap,
+    color_by,
+    color_limits
 )
 
 
-JSONCONS_N_MEMBER_TRAITS(
-    arrow_spec,
+// arrow_spec as a JSON object. Color c is either a color or a non-negative
+// integer that indexes the palette.
+template<class Json>
+struct jsoncons::json_type_traits<Json, arrow_spec>
+{
+    using allocator_type = typename Json::allocator_type;
+    using value_type     = arrow_spec;
 
-    // Required fields
-    4,
-    x,
-    y,
-    dx,
-    dy,
+    static bool is(const Json& j) noexcept
+    {
+        return j.is_object() && j.contains("x") && j.contains("y") && j.contains("dx") && j.contains("dy");
+    }
 
-    // Optional fields
-    w,
-    a,
-    c
+    static value_type as(const Json& j)
+    {
+        value_type arrow;
+        arrow.x = j.at("x").template as<double>();
+        arrow.y = j.at("y").template as<double>();
+        arrow.dx = j.at("dx").template as<double>();
+        arrow.dy = j.at("dy").template as<double>();
+
+        auto members = j.object_range();
+        if (auto const w = j.find("w"); w != members.end()) {
+            arrow.w = w->value().template as<std::optional<double>>();
+        }
+        if (auto const a = j.find("a"); a != members.end()) {
+            arrow.a = a->value().template as<std::optional<double>>();
+        }
+        if (auto const scalar = j.find("s"); scalar != members.end()) {
+            arrow.s = scalar->value().template as<std::optional<double>>();
+        }
+        if (auto const c = j.find("c"); c != members.end() && !c->value().is_null()) {
+            auto const& color = c->value();
+            if (color.is_number()) {
+                if (!color.template is<std::uint32_t>()) {
+                    throw std::runtime_error{"palette index must be a non-negative integer"};
+                }
+                arrow.palette_index = color.template as<std::uint32_t>();
+            } else {
+                arrow.c = color.template as<color_spec>();
+            }
+        }
+        return arrow;
+    }
+
+    static Json to_json(value_type const& value, allocator_type alloc = {})
+    {
+        Json j{jsoncons::json_object_arg_t{}, jsoncons::semantic_tag::none, alloc};
+        j.try_emplace("x", value.x);
+        j.try_emplace("y", value.y);
+        j.try_emplace("dx", value.dx);
+        j.try_emplace("dy", value.dy);
+        if (value.w) {
+            j.try_emplace("w", *value.w);
+        }
+        if (value.a) {
+            j.try_emplace("a", *value.a);
+        }
+        if (value.s) {
+            j.try_emplace("s", *value.s);
+        }
+        if (value.palette_index) {
+            j.try_emplace("c", *value.palette_index);
+        } else if (value.c) {
+            j.try_emplace("c", Json{*value.c, alloc});
+        }
+        return j;
+    }
+};
+
+
+// Cursor over JSON text or binary JSON, either in memory or read from a
+// stream.
+using json_cursor = jsoncons::basic_staj_cursor<char>;
+
+
+// Visitor that consumes exactly one JSON value and discards it.
+class skip_visitor : public jsoncons::default_json_visitor
+{
+private:
+    bool visit_begin_object(jsoncons::semantic_tag, jsoncons::ser_context const&, std::error_code&) override
+    {
+        _depth++;
+        return true;
+    }
+
+    bool visit_begin_array(jsoncons::semantic_tag, jsoncons::ser_context const&, std::error_code&) override
+    {
+        _depth++;
+        return true;
+    }
+
+    bool visit_end_object(jsoncons::ser_context const&, std::error_code&) override
+    {
+        return --_depth > 0;
+    }
+
+    bool visit_end_array(jsoncons::ser_context const&, std::error_code&) override
+    {
+        return --_depth > 0;
+    }
+
+private:
+    int _depth = 0;
+};
+
+
+static quiver_spec   decode_spec(json_cursor& cursor, std::optional<arrow_store>& parallel_arrows);
+static quiver_spec   load_raw_arrows(std::string_view data);
+static std::unique_ptr<json_cursor> make_stream_cursor(std::istream& stream, spec_format format);
+template<typename T>
+static T             decode_value(json_cursor& cursor);
+static void          skip_value(json_cursor& cursor);
+template<typename F>
+static void          visit_members(json_cursor& cursor, char const* what, F handler);
+template<typename F>
+static void          visit_elements(json_cursor& cursor, char const* what, F handler);
+static bool          decode_arrows(json_cursor& cursor, std::string const& key, arrow_store& arrows);
+static void          decode_arrow_columns(json_cursor& cursor, arrow_store& arrows);
+static void          decode_field(json_cursor& cursor, arrow_store& arrows);
+static void          decode_frames(json_cursor& cursor, std::vector<frame_spec>& frames);
+static void          decode_colors(json_cursor& cursor, arrow_columns& columns);
+static std::optional<std::size_t> find_arrows_array(std::string_view text);
+static arrow_store   decode_arrows_parallel(std::string_view text, std::size_t& pos, unsigned threads);
+static std::size_t   skip_space(std::string_view text, std::size_t pos);
+static std::size_t   skip_json(std::string_view text, std::size_t pos);
+static bool          is_delimiter(char ch);
+static std::ifstream spill_to_temporary(std::string const& filename);
+static void          set_bit(std::vector<std::uint64_t>& mask, std::size_t index);
+static void          set_bits(std::vector<std::uint64_t>& mask, std::size_t begin, std::size_t end);
+static bool          test_bit(std::vector<std::uint64_t> const& mask, std::size_t index);
+static bool          all_positive(std::vector<double> const& values);
+template<typename T, typename U, typename F>
+static void          push_optional(
+    std::vector<T>& column,
+    std::vector<std::uint64_t>& mask,
+    std::size_t index,
+    std::optional<U> const& value,
+    F convert
+);
+template<typename T, typename U>
+static void          append_column(std::vector<T>& column, std::vector<U>&& values);
+template<typename T>
+static void          append_masked(
+    std::vector<T>& column,
+    std::vector<std::uint64_t>& mask,
+    std::size_t index,
+    std::size_t count,
+    std::vector<T> const& values,
+    std::vector<std::uint64_t> const& values_mask
+);
+template<typename T, typename U>
+static void          append_optional(
+    std::vector<T>& column,
+    std::vector<std::uint64_t>& mask,
+    std::size_t index,
+    std::size_t count,
+    std::vector<U>&& values
+);
+
+
+// Guesses the format of a spec from its first bytes, or else from the
+// extension of the file. Binary specs are maps at the top level, and CBOR
+// ones may start with the self-described CBOR tag.
+spec_format
+guess_spec_format(std::string const& filename, std::string_view head)
+{
+    if (head.substr(0, raw_arrows_magic.size()) == raw_arrows_magic) {
+        return spec_format::raw;
+    }
+
+    auto extension = std::filesystem::path{filename}.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char ch) {
+        return char(std::tolower(ch));
+    });
+    if (extension == ".json") {
+        return spec_format::json;
+    }
+    if (extension == ".cbor") {
+        return spec_format::cbor;
+    }
+    if (extension == ".msgpack" || extension == ".mpk") {
+        return spec_format::msgpack;
+    }
+
+    if (head.empty()) {
+        return spec_format::json;
+    }
+    auto const lead = static_cast<unsigned char>(head[0]);
+    if ((lead >= 0xA0 && lead <= 0xBB) || lead == 0xBF || head.substr(0, 3) == "\xD9\xD9\xF7") {
+        return spec_format::cbor;
+    }
+    if ((lead >= 0x80 && lead <= 0x8F) || lead == 0xDE || lead == 0xDF) {
+        return spec_format::msgpack;
+    }
+    return spec_format::json;
+}
+
+
+// Decodes a spec. Arrows are decoded one by one, or column by column, from a
+// cursor into the arrow store without building a document tree. With multiple
+// threads, a large arrows array is cut out of JSON text and decoded in
+// parallel, and the rest of the text is parsed with an empty array in its
+// place. Binary specs are decoded with the same cursor, so CBOR typed arrays
+// work wherever arrays of numbers do.
+quiver_spec
+parse_quiver_spec(std::string_view data, unsigned threads, spec_format format)
+{
+    std::optional<arrow_store> parallel_arrows;
+
+    switch (format) {
+    case spec_format::json:
+        break;
+
+    case spec_format::cbor: {
+        jsoncons::cbor::cbor_bytes_cursor cursor{data};
+        return decode_spec(cursor, parallel_arrows);
+    }
+
+    case spec_format::msgpack: {
+        jsoncons::msgpack::msgpack_bytes_cursor cursor{data};
+        return decode_spec(cursor, parallel_arrows);
+    }
+
+    case spec_format::raw:
+        return load_raw_arrows(data);
+    }
+
+    auto text = data;
+    std::string remainder;
+    if (threads > 1) {
+        auto const begin = find_arrows_array(text);
+        if (begin && text.size() - *begin >= parallel_decode_min_size) {
+            auto end = *begin;
+            parallel_arrows = decode_arrows_parallel(text, end, threads);
+            remainder.reserve(text.size() - (end - *begin) + 2);
+            remainder.append(text.substr(0, *begin));
+            remainder.append("[]");
+            remainder.append(text.substr(end));
+            text = remainder;
+        }
+    }
+
+    jsoncons::json_string_cursor cursor{text};
+    return decode_spec(cursor, parallel_arrows);
+}
+
+
+// Tells whether two specs have the same rendering and style. The specs are
+// compared in their JSON form so that every field takes part.
+bool
+same_settings(quiver_spec const& a, quiver_spec const& b)
+{
+    auto const settings = [](quiver_spec const& spec) {
+        std::string json;
+        jsoncons::encode_json(spec.rendering, json);
+        jsoncons::encode_json(spec.style, json);
+        return json;
+    };
+    return settings(a) == settings(b);
+}
+
+
+// Returns the base rendering with the fields given in the overrides replaced.
+rendering_spec
+merge_rendering(rendering_spec const& base, rendering_spec const& overrides)
+{
+    auto merged = jsoncons::json{base};
+    merged.merge_or_update(jsoncons::json{overrides});
+    return merged.as<rendering_spec>();
+}
+
+
+std::uint32_t
+pack_color(color_spec const& color)
+{
+    auto const quantize = [](double value) {
+        constexpr double byte_scale = 255;
+        return static_cast<std::uint32_t>(std::nearbyint(byte_scale * std::clamp(value, 0.0, 1.0)));
+    };
+    return quantize(color.alpha) << 24 |
+           quantize(color.red)   << 16 |
+           quantize(color.green) << 8  |
+           quantize(color.blue);
+}
+
+
+std::vector<std::uint32_t>
+pack_palette(style_spec const& style)
+{
+    std::vector<std::uint32_t> palette;
+    if (style.palette) {
+        for (auto const& color : *style.palette) {
+            palette.push_back(pack_color(color));
+        }
+    }
+    return palette;
+}
+
+
+color_spec
+unpack_color(std::uint32_t packed)
+{
+    auto const dequantize = [](std::uint32_t value) {
+        constexpr double byte_scale = 255;
+        return double(value & 0xFF) / byte_scale;
+    };
+    return {
+        dequantize(packed >> 16),
+        dequantize(packed >> 8),
+        dequantize(packed),
+        dequantize(packed >> 24)
+    };
+}
+
+
+std::size_t
+arrow_store::size() const
+{
+    return _x.size();
+}
+
+
+bool
+arrow_store::empty() const
+{
+    return _x.empty();
+}
+
+
+void
+arrow_store::clear()
+{
+    _x.clear();
+    _y.clear();
+    _dx.clear();
+    _dy.clear();
+    _width.clear();
+    _aspect.clear();
+    _color.clear();
+    _scalar.clear();
+    _width_mask.clear();
+    _aspect_mask.clear();
+    _color_mask.clear();
+    _scalar_mask.clear();
+    _palette_mask.clear();
+}
+
+
+void
+arrow_store::reserve(std::size_t capacity)
+{
+    _x.reserve(capacity);
+    _y.reserve(capacity);
+    _dx.reserve(capacity);
+    _dy.reserve(capacity);
+}
+
+
+void
+arrow_store::push_back(arrow_spec const& arrow)
+{
+    // A non-positive width reverses the outline, which would cut holes in
+    // the other arrows of a compound fill.
+    if ((arrow.w && !(*arrow.w > 0)) || (arrow.a && !(*arrow.a > 0))) {
+        throw std::runtime_error{"w and a of arrows must be positive"};
+    }
+
+    auto const index = _x.size();
+
+    _x.push_back(arrow.x);
+    _y.push_back(arrow.y);
+    _dx.push_back(arrow.dx);
+    _dy.push_back(arrow.dy);
+
+    auto const identity = [](double value) { return value; };
+    push_optional(_width, _width_mask, index, arrow.w, identity);
+    push_optional(_aspect, _aspect_mask, index, arrow.a, identity);
+    push_optional(_scalar, _scalar_mask, index, arrow.s, identity);
+    if (arrow.palette_index) {
+        push_optional(_color, _color_mask, index, arrow.palette_index, [](std::uint32_t value) { return value; });
+        set_bit(_palette_mask, index);
+    } else {
+        push_optional(_color, _color_mask, index, arrow.c, pack_color);
+    }
+}
+
+
+arrow_spec
+arrow_store::get(std::size_t index) const
+{
+    arrow_spec arrow;
+    arrow.x = _x[index];
+    arrow.y = _y[index];
+    arrow.dx = _dx[index];
+    arrow.dy = _dy[index];
+    if (has_width(index)) {
+        arrow.w = _width[index];
+    }
+    if (has_aspect(index)) {
+        arrow.a = _aspect[index];
+    }
+    if (has_scalar(index)) {
+        arrow.s = _scalar[index];
+    }
+    if (test_bit(_palette_mask, index)) {
+        arrow.palette_index = _color[index];
+    } else if (has_color(index)) {
+        arrow.c = unpack_color(_color[index]);
+    }
+    return arrow;
+}
+
+
+// Tells whether an arrow is the same as an arrow of another store, including
+// which optional fields are set.
+bool
+arrow_store::equal(std::size_t index, arrow_store const& other, std::size_t other_index) const
+{
+    auto const i = index;
+    auto const j = other_index;
+
+    if (_x[i] != other._x[j] || _y[i] != other._y[j] || _dx[i] != other._dx[j] || _dy[i] != other._dy[j]) {
+        return false;
+    }
+    if (has_width(i) != other.has_width(j) || (has_width(i) && _width[i] != other._width[j])) {
+        return false;
+    }
+    if (has_aspect(i) != other.has_aspect(j) || (has_aspect(i) && _aspect[i] != other._aspect[j])) {
+        return false;
+    }
+    if (has_color(i) != other.has_color(j) || (has_color(i) && _color[i] != other._color[j])) {
+        return false;
+    }
+    if (has_scalar(i) != other.has_scalar(j) || (has_scalar(i) && _scalar[i] != other._scalar[j])) {
+        return false;
+    }
+    return true;
+}
+
+
+// Appends arrows given as columns. Columns are moved into an empty store.
+void
+arrow_store::append(arrow_columns&& columns)
+{
+    auto const begin = size();
+    auto const count = columns.x.size();
+
+    auto const has_length = [&](auto const& column, bool optional) {
+        return column.size() == count || (optional && column.empty());
+    };
+    if (!has_length(columns.y, false) || !has_length(columns.dx, false) || !has_length(columns.dy, false) ||
+        !has_length(columns.w, true) || !has_length(columns.a, true) || !has_length(columns.c, true) ||
+        !has_length(columns.s, true)) {
+        throw std::runtime_error{"arrow columns must have the same length"};
+    }
+    if (!all_positive(columns.w) || !all_positive(columns.a)) {
+        throw std::runtime_error{"w and a of arrows must be positive"};
+    }
+
+    append_column(_x, std::move(columns.x));
+    append_column(_y, std::move(columns.y));
+    append_column(_dx, std::move(columns.dx));
+    append_column(_dy, std::move(columns.dy));
+    append_optional(_width, _width_mask, begin, count, std::move(columns.w));
+    append_optional(_aspect, _aspect_mask, begin, count, std::move(columns.a));
+
+    if (columns.c_indexed && !columns.c.empty()) {
+        set_bits(_palette_mask, begin, begin + count);
+    }
+    append_optional(_color, _color_mask, begin, count, std::move(columns.c));
+    append_optional(_scalar, _scalar_mask, begin, count, std::move(columns.s));
+}
+
+
+// Appends the arrows of another store, palette indices included.
+void
+arrow_store::append(arrow_store const& other)
+{
+    auto const begin = size();
+    auto const count = other.size();
+
+    _x.insert(_x.end(), other._x.begin(), other._x.end());
+    _y.insert(_y.end(), other._y.begin(), other._y.end());
+    _dx.insert(_dx.end(), other._dx.begin(), other._dx.end());
+    _dy.insert(_dy.end(), other._dy.begin(), other._dy.end());
+    append_masked(_width, _width_mask, begin, count, other._width, other._width_mask);
+    append_masked(_aspect, _aspect_mask, begin, count, other._aspect, other._aspect_mask);
+    append_masked(_color, _color_mask, begin, count, other._color, other._color_mask);
+    append_masked(_scalar, _scalar_mask, begin, count, other._scalar, other._scalar_mask);
+
+    for (std::size_t i = 0; i < count; i++) {
+        if (test_bit(other._palette_mask, i)) {
+            set_bit(_palette_mask, begin + i);
+        }
+    }
+}
+
+
+// Replaces palette indices in the color column with the colors they index.
+void
+arrow_store::resolve_palette(std::vector<std::uint32_t> const& palette)
+{
+    for (std::size_t word = 0; word < _palette_mask.size(); word++) {
+        auto const bits = _palette_mask[word];
+        for (std::size_t bit = 0; bits != 0 && bit < 64; bit++) {
+            if (!(bits >> bit & 1)) {
+                continue;
+            }
+            auto& color = _color[word * 64 + bit];
+            if (color >= palette.size()) {
+                throw std::runtime_error{"palette index out of range: " + std::to_string(color)};
+            }
+            color = palette[color];
+        }
+    }
+    _palette_mask.clear();
+}
+
+
+arrow_real const*
+arrow_store::x() const
+{
+    return _x.data();
+}
+
+
+arrow_real const*
+arrow_store::y() const
+{
+    return _y.data();
+}
+
+
+arrow_real const*
+arrow_store::dx() const
+{
+    return _dx.data();
+}
+
+
+arrow_real const*
+arrow_store::dy() const
+{
+    return _dy.data();
+}
+
+
+arrow_real const*
+arrow_store::width() const
+{
+    return _width.empty() ? nullptr : _width.data();
+}
+
+
+arrow_real const*
+arrow_store::aspect() const
+{
+    return _aspect.empty() ? nullptr : _aspect.data();
+}
+
+
+std::uint32_t const*
+arrow_store::color() const
+{
+    return _color.empty() ? nullptr : _color.data();
+}
+
+
+arrow_real const*
+arrow_store::scalar() const
+{
+    return _scalar.empty() ? nullptr : _scalar.data();
+}
+
+
+bool
+arrow_store::has_width(std::size_t index) const
+{
+    return test_bit(_width_mask, index);
+}
+
+
+bool
+arrow_store::has_aspect(std::size_t index) const
+{
+    return test_bit(_aspect_mask, index);
+}
+
+
+bool
+arrow_store::has_color(std::size_t index) const
+{
+    return test_bit(_color_mask, index);
+}
+
+
+bool
+arrow_store::has_scalar(std::size_t index) const
+{
+    return test_bit(_scalar_mask, index);
+}
+
+
+quiver_spec_reader::quiver_spec_reader(std::string const& filename, std::size_t chunk_size)
+: _chunk_size{chunk_size}
+{
+    if (std::filesystem::is_regular_file(filename)) {
+        _file.open(filename, std::ios::binary);
+    } else {
+        _file = spill_to_temporary(filename);
+    }
+    if (!_file) {
+        throw std::runtime_error{"failed to open spec file"};
+    }
+
+    char head[raw_arrows_magic.size()] = {};
+    _file.read(head, sizeof head);
+    _format = guess_spec_format(filename, std::string_view{head, std::size_t(_file.gcount())});
+    _file.clear();
+    _file.seekg(0);
+
+    auto const stream_cursor = make_stream_cursor(_file, _format);
+    auto& cursor = *stream_cursor;
+    visit_members(cursor, "spec", [&](std::string const& key) {
+        if (key == "rendering") {
+            _rendering = decode_value<rendering_spec>(cursor);
+        } else if (key == "style") {
+            _style = decode_value<style_spec>(cursor);
+        } else if (key == "frames") {
+            throw std::runtime_error{"frames cannot be streamed"};
+        } else if (key == "renders") {
+            throw std::runtime_error{"renders cannot be streamed"};
+        } else {
+            skip_value(cursor);
+        }
+    });
+    _palette = pack_palette(_style);
+}
+
+
+rendering_spec&
+quiver_spec_reader::rendering()
+{
+    return _rendering;
+}
+
+
+style_spec&
+quiver_spec_reader::style()
+{
+    return _style;
+}
+
+
+void
+quiver_spec_reader::scan(chunk_handler const& handler)
+{
+    _file.clear();
+    _file.seekg(0);
+
+    arrow_store chunk;
+    chunk.reserve(_chunk_size);
+
+    auto const flush = [&] {
+        if (!chunk.empty()) {
+            chunk.resolve_palette(_palette);
+            handler(chunk);
+            chunk.clear();
+        }
+    };
+
+    auto const stream_cursor = make_stream_cursor(_file, _format);
+    auto& cursor = *stream_cursor;
+    visit_members(cursor, "spec", [&](std::string const& key) {
+        if (key == "arrows") {
+            visit_elements(cursor, "arrows", [&] {
+                chunk.push_back(decode_value<arrow_spec>(cursor));
+                if (chunk.size() == _chunk_size) {
+                    flush();
+                }
+            });
+        } else if (key == "arrow_columns" || key == "field") {
+            // Columns are compact, so they are loaded whole.
+            flush();
+            decode_arrows(cursor, key, chunk);
+            flush();
+        } else {
+            skip_value(cursor);
+        }
+    });
+    flush();
+}
+
+
+// Decodes the spec at the cursor. Arrows decoded in advance, if any, take the
+// place of the first arrows array.
+quiver_spec
+decode_spec(json_cursor& cursor, std::optional<arrow_store>& parallel_arrows)
+{
+    quiver_spec spec;
+
+    visit_members(cursor, "spec", [&](std::string const& key) {
+        if (key == "arrows" && parallel_arrows) {
+            skip_value(cursor);
+            if (spec.arrows.empty()) {
+                spec.arrows = std::move(*parallel_arrows);
+            } else {
+                spec.arrows.append(*parallel_arrows);
+            }
+            parallel_arrows.reset();
+        } else if (key == "rendering") {
+            spec.rendering = decode_value<rendering_spec>(cursor);
+        } else if (key == "style") {
+            spec.style = decode_value<style_spec>(cursor);
+        } else if (key == "frames") {
+            decode_frames(cursor, spec.frames);
+        } else if (key == "renders") {
+            spec.renders = decode_value<std::vector<rendering_spec>>(cursor);
+        } else if (!decode_arrows(cursor, key, spec.arrows)) {
+            skip_value(cursor);
+        }
+    });
+
+    auto const palette = pack_palette(spec.style);
+    spec.arrows.resolve_palette(palette);
+    for (auto& frame : spec.frames) {
+        frame.arrows.resolve_palette(palette);
+    }
+    return spec;
+}
+
+
+// Loads the arrows of a raw arrow file into a spec.
+quiver_spec
+load_raw_arrows(std::string_view data)
+{
+    raw_arrow_source source{data};
+
+    quiver_spec spec;
+    spec.rendering = source.rendering();
+    spec.style = source.style();
+    spec.arrows.reserve(source.size());
+    source.scan([&](arrow_store const& chunk) {
+        spec.arrows.append(chunk);
+    });
+    return spec;
+}
+
+
+// Returns a cursor over a spec in the given format read from the stream.
+std::unique_ptr<json_cursor>
+make_stream_cursor(std::istream& stream, spec_format format)
+{
+    switch (format) {
+    case spec_format::cbor:
+        return std::make_unique<jsoncons::cbor::cbor_stream_cursor>(stream);
+    case spec_format::msgpack:
+        return std::make_unique<jsoncons::msgpack::msgpack_stream_cursor>(stream);
+    case spec_format::raw:
+        throw std::runtime_error{"raw arrow files are streamed without -s"};
+    case spec_format::json:
+        break;
+    }
+    return std::make_unique<jsoncons::json_stream_cursor>(stream);
+}
+
+
+template<typename T>
+T
+decode_value(json_cursor& cursor)
+{
+    jsoncons::json_decoder<jsoncons::json> decoder;
+    std::error_code ec;
+    T value = jsoncons::decode_traits<T, char>::decode(cursor, decoder, ec);
+    if (ec) {
+        throw jsoncons::ser_error{ec, cursor.context().line(), cursor.context().column()};
+    }
+    return value;
+}
+
+
+// Consumes the value at the cursor without decoding it.
+void
+skip_value(json_cursor& cursor)
+{
+    auto const event = cursor.current().event_type();
+    if (event == jsoncons::staj_event_type::begin_array ||
+        event == jsoncons::staj_event_type::begin_object) {
+        skip_visitor skip;
+        cursor.read_to(skip);
+    }
+}
+
+
+// Walks the members of the object at the cursor, calling the handler with
+// each key while the cursor is positioned at the value. The handler must
+// consume the value.
+template<typename F>
+void
+visit_members(json_cursor& cursor, char const* what, F handler)
+{
+    if (cursor.done() || cursor.current().event_type() != jsoncons::staj_event_type::begin_object) {
+        throw std::runtime_error{std::string{what} + " must be a JSON object"};
+    }
+    for (cursor.next(); cursor.current().event_type() != jsoncons::staj_event_type::end_object; cursor.next()) {
+        auto const key = cursor.current().get<std::string>();
+        cursor.next();
+        handler(key);
+    }
+}
+
+
+// Walks the elements of the array at the cursor, calling the handler while
+// the cursor is positioned at each element. The handler must consume the
+// element.
+template<typename F>
+void
+visit_elements(json_cursor& cursor, char const* what, F handler)
+{
+    if (cursor.done() || cursor.current().event_type() != jsoncons::staj_event_type::begin_array) {
+        throw std::runtime_error{std::string{what} + " must be an array"};
+    }
+    for (cursor.next(); cursor.current().event_type() != jsoncons::staj_event_type::end_array; cursor.next()) {
+        handler();
+    }
+}
+
+
+// Returns the offset of the first arrows array in the top-level object, or
+// nothing if there is none or the text is not well formed. Errors are left
+// for the parser to report.
+std::optional<std::size_t>
+find_arrows_array(std::string_view text)
+{
+    auto pos = skip_space(text, 0);
+    if (pos >= text.size() || text[pos] != '{') {
+        return std::nullopt;
+    }
+    pos = skip_space(text, pos + 1);
+
+    while (pos < text.size() && text[pos] == '"') {
+        auto const key_end = skip_json(text, pos);
+        if (key_end == std::string_view::npos) {
+            return std::nullopt;
+        }
+        auto const key = text.substr(pos + 1, key_end - pos - 2);
+
+        pos = skip_space(text, key_end);
+        if (pos >= text.size() || text[pos] != ':') {
+            return std::nullopt;
+        }
+        auto const value = skip_space(text, pos + 1);
+        if (key == "arrows" && value < text.size() && text[value] == '[') {
+            return value;
+        }
+        auto const value_end = skip_json(text, value);
+        if (value_end == std::string_view::npos) {
+            return std::nullopt;
+        }
+
+        pos = skip_space(text, value_end);
+        if (pos < text.size() && text[pos] == ',') {
+            pos = skip_space(text, pos + 1);
+        }
+    }
+    return std::nullopt;
+}
+
+
+// Decodes the array of arrow objects at the position on multiple threads and
+// advances the position past the array. The array is cut between elements at
+// about equal intervals, and each piece is decoded as an array of its own.
+// Pieces are decoded in waves of one per thread and appended in order after
+// each wave, so that only the pieces of a wave are held besides the arrows.
+arrow_store
+decode_arrows_parallel(std::string_view text, std::size_t& pos, unsigned threads)
+{
+    auto const target_pieces = threads * decode_pieces_per_thread;
+    auto const piece_size = std::min((text.size() - pos) / target_pieces + 1, decode_piece_max_size);
+
+    // Pieces are [begin, end) ranges of elements without the separating
+    // commas.
+    std::vector<std::pair<std::size_t, std::size_t>> pieces;
+    std::size_t total = 0;
+    pos = skip_space(text, pos + 1);
+    auto piece_begin = pos;
+
+    while (pos < text.size() && text[pos] != ']') {
+        auto const element_end = skip_json(text, pos);
+        if (element_end == std::string_view::npos) {
+            throw std::runtime_error{"arrows must be an array"};
+        }
+        pos = skip_space(text, element_end);
+        total++;
+
+        if (element_end - piece_begin >= piece_size || pos >= text.size() || text[pos] == ']') {
+            pieces.emplace_back(piece_begin, element_end);
+            piece_begin = skip_space(text, pos + 1);
+        }
+        if (pos < text.size() && text[pos] == ',') {
+            pos = skip_space(text, pos + 1);
+        }
+    }
+    if (pos >= text.size()) {
+        throw std::runtime_error{"arrows must be an array"};
+    }
+    pos++;
+
+    arrow_store arrows;
+    arrows.reserve(total);
+
+    std::vector<arrow_store> stores(threads);
+    std::vector<std::string> buffers(threads);
+
+    for (std::size_t wave = 0; wave < pieces.size(); wave += threads) {
+        auto const wave_end = std::min(wave + threads, pieces.size());
+
+        parallel_for(wave_end - wave, threads, [&](std::size_t index, unsigned worker) {
+            auto const [begin, end] = pieces[wave + index];
+            auto& buffer = buffers[worker];
+            buffer.assign("[");
+            buffer.append(text.substr(begin, end - begin));
+            buffer.append("]");
+
+            auto& store = stores[index];
+            store.clear();
+            jsoncons::json_string_cursor cursor{buffer};
+            visit_elements(cursor, "arrows", [&] {
+                store.push_back(decode_value<arrow_spec>(cursor));
+            });
+        });
+
+        for (auto index = wave; index < wave_end; index++) {
+            arrows.append(stores[index - wave]);
+        }
+    }
+    return arrows;
+}
+
+
+std::size_t
+skip_space(std::string_view text, std::size_t pos)
+{
+    while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\n' || text[pos] == '\r' || text[pos] == '\t')) {
+        pos++;
+    }
+    return pos;
+}
+
+
+// Returns the end of the JSON value starting at the position, looking only at
+// the structure: strings, brackets and braces. Returns npos if the value is
+// cut off.
+std::size_t
+skip_json(std::string_view text, std::size_t pos)
+{
+    std::size_t depth = 0;
+    do {
+        if (pos >= text.size()) {
+            return std::string_view::npos;
+        }
+        switch (text[pos]) {
+        case '"':
+            for (pos++; pos < text.size() && text[pos] != '"'; pos++) {
+                if (text[pos] == '\\') {
+                    pos++;
+                }
+            }
+            pos++;
+            break;
+
+        case '[':
+        case '{':
+            depth++;
+            pos++;
+            break;
+
+        case ']':
+        case '}':
+            if (depth == 0) {
+                return std::string_view::npos;
+            }
+            depth--;
+            pos++;
+            break;
+
+        default:
+            // Scalars end at a delimiter.
+            while (pos < text.size() && !is_delimiter(text[pos])) {
+                pos++;
+            }
+            if (depth == 0) {
+                return pos;
+            }
+            if (pos < text.size() && (text[pos] == ',' || text[pos] == ':' || std::isspace(static_cast<unsigned char>(text[pos])))) {
+                pos++;
+            }
+        }
+    } while (depth > 0);
+
+    return pos <= text.size() ? pos : std::string_view::npos;
+}
+
+
+bool
+is_delimiter(char ch)
+{
+    switch (ch) {
+    case ',': case ':': case '[': case ']': case '{': case '}': case '"':
+    case ' ': case '\n': case '\r': case '\t':
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+// Decodes arrows given in any form into the store. Returns false if the key
+// is not one of the forms, leaving the value at the cursor.
+bool
+decode_arrows(json_cursor& cursor, std::string const& key, arrow_store& arrows)
+{
+    if (key == "arrows") {
+        visit_elements(cursor, "arrows", [&] {
+            arrows.push_back(decode_value<arrow_spec>(cursor));
+        });
+    } else if (key == "arrow_columns") {
+        decode_arrow_columns(cursor, arrows);
+    } else if (key == "field") {
+        decode_field(cursor, arrows);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+
+// Decodes arrows given as an object of parallel arrays x, y, dx, dy and the
+// optional w, a, c and s.
+void
+decode_arrow_columns(json_cursor& cursor, arrow_store& arrows)
+{
+    arrow_columns columns;
+
+    visit_members(cursor, "arrow_columns", [&](std::string const& key) {
+        if (key == "x") {
+            columns.x = decode_value<std::vector<double>>(cursor);
+        } else if (key == "y") {
+            columns.y = decode_value<std::vector<double>>(cursor);
+        } else if (key == "dx") {
+            columns.dx = decode_value<std::vector<double>>(cursor);
+        } else if (key == "dy") {
+            columns.dy = decode_value<std::vector<double>>(cursor);
+        } else if (key == "w") {
+            columns.w = decode_value<std::vector<double>>(cursor);
+        } else if (key == "a") {
+            columns.a = decode_value<std::vector<double>>(cursor);
+        } else if (key == "s") {
+            columns.s = decode_value<std::vector<double>>(cursor);
+        } else if (key == "c") {
+            decode_colors(cursor, columns);
+        } else {
+            skip_value(cursor);
+        }
+    });
+
+    arrows.append(std::move(columns));
+}
+
+
+// Decodes arrows on a regular grid. The vector at column i and row j of the
+// grid, (u[k], v[k]) with k = j * columns + i, is drawn from the point
+// origin + (i, j) * spacing. An optional array s gives scalars likewise.
+void
+decode_field(json_cursor& cursor, arrow_store& arrows)
+{
+    std::vector<double> origin;
+    std::vector<double> spacing;
+    std::vector<std::size_t> shape;
+    arrow_columns columns;
+
+    visit_members(cursor, "field", [&](std::string const& key) {
+        if (key == "origin") {
+            origin = decode_value<std::vector<double>>(cursor);
+        } else if (key == "spacing") {
+            spacing = decode_value<std::vector<double>>(cursor);
+        } else if (key == "shape") {
+            shape = decode_value<std::vector<std::size_t>>(cursor);
+        } else if (key == "u") {
+            columns.dx = decode_value<std::vector<double>>(cursor);
+        } else if (key == "v") {
+            columns.dy = decode_value<std::vector<double>>(cursor);
+        } else if (key == "s") {
+            columns.s = decode_value<std::vector<double>>(cursor);
+        } else {
+            skip_value(cursor);
+        }
+    });
+
+    if (origin.size() != 2 || spacing.size() != 2 || shape.size() != 2) {
+        throw std::runtime_error{"field needs origin [x, y], spacing [x, y] and shape [columns, rows]"};
+    }
+    auto const grid_columns = shape[0];
+    auto const grid_rows = shape[1];
+    if (grid_columns != 0 && grid_rows > SIZE_MAX / grid_columns) {
+        throw std::runtime_error{"field shape is too large"};
+    }
+    auto const has_size = [&](std::vector<double> const& values) {
+        return values.size() == grid_columns * grid_rows;
+    };
+    if (!has_size(columns.dx) || !has_size(columns.dy) || !(columns.s.empty() || has_size(columns.s))) {
+        throw std::runtime_error{"field u, v and s must have columns * rows values"};
+    }
+
+    columns.x.resize(columns.dx.size());
+    columns.y.resize(columns.dy.size());
+    for (std::size_t j = 0; j < grid_rows; j++) {
+        for (std::size_t i = 0; i < grid_columns; i++) {
+            auto const k = j * grid_columns + i;
+            columns.x[k] = origin[0] + double(i) * spacing[0];
+            columns.y[k] = origin[1] + double(j) * spacing[1];
+        }
+    }
+
+    arrows.append(std::move(columns));
+}
+
+
+void
+decode_frames(json_cursor& cursor, std::vector<frame_spec>& frames)
+{
+    visit_elements(cursor, "frames", [&] {
+        auto& frame = frames.emplace_back();
+        auto has_arrows = false;
+
+        visit_members(cursor, "frame", [&](std::string const& key) {
+            if (decode_arrows(cursor, key, frame.arrows)) {
+                has_arrows = true;
+            } else {
+                skip_value(cursor);
+            }
+        });
+
+        if (!has_arrows) {
+            throw std::runtime_error{"frame has no arrows"};
+        }
+    });
+}
+
+
+// Decodes the c column, which holds either palette indices or colors. Each
+// element is read from the cursor, so that the column is never held as JSON.
+void
+decode_colors(json_cursor& cursor, arrow_columns& columns)
+{
+    auto first = true;
+
+    visit_elements(cursor, "c of arrow_columns", [&] {
+        auto const event = cursor.current().event_type();
+        auto const indexed =
+            event == jsoncons::staj_event_type::uint64_value ||
+            event == jsoncons::staj_event_type::int64_value ||
+            event == jsoncons::staj_event_type::double_value ||
+            event == jsoncons::staj_event_type::half_value;
+
+        if (first) {
+            columns.c_indexed = indexed;
+            first = false;
+        } else if (indexed != columns.c_indexed) {
+            throw std::runtime_error{"c of arrow_columns must be all colors or all palette indices"};
+        }
+
+        if (!indexed) {
+            columns.c.push_back(pack_color(decode_value<color_spec>(cursor)));
+        } else if (event == jsoncons::staj_event_type::uint64_value &&
+                   cursor.current().get<std::uint64_t>() <= UINT32_MAX) {
+            columns.c.push_back(std::uint32_t(cursor.current().get<std::uint64_t>()));
+        } else if (event == jsoncons::staj_event_type::int64_value &&
+                   cursor.current().get<std::int64_t>() >= 0 &&
+                   cursor.current().get<std::int64_t>() <= std::int64_t(UINT32_MAX)) {
+            columns.c.push_back(std::uint32_t(cursor.current().get<std::int64_t>()));
+        } else {
+            throw std::runtime_error{"palette index must be a non-negative integer"};
+        }
+    });
+}
+
+
+// Copies non-seekable input, such as a pipe, into an anonymous temporary
+// file so that it can be read more than once.
+std::ifstream
+spill_to_temporary(std::string const& filename)
+{
+    std::ifstream input{filename, std::ios::binary};
+    if (!input) {
+        throw std::runtime_error{"failed to open spec file"};
+    }
+
+    std::random_device random;
+    auto const temp_path = std::filesystem::temp_directory_path() / (
+        "quiver-" + std::to_string(random()) + std::to_string(random()) + ".json"
+    );
+
+    {
+        std::ofstream spill{temp_path, std::ios::binary};
+        if (!(spill << input.rdbuf())) {
+            throw std::runtime_error{"failed to buffer spec input"};
+        }
+    }
+
+    std::ifstream file{temp_path, std::ios::binary};
+    std::error_code ec;
+    std::filesystem::remove(temp_path, ec);
+    return file;
+}
+
+
+void
+set_bit(std::vector<std::uint64_t>& mask, std::size_t index)
+{
+    auto const word = index / 64;
+    if (word >= mask.size()) {
+        mask.resize(word + 1);
+    }
+    mask[word] |= std::uint64_t(1) << (index % 64);
+}
+
+
+void
+set_bits(std::vector<std::uint64_t>& mask, std::size_t begin, std::size_t end)
+{
+    if (begin == end) {
+        return;
+    }
+    mask.resize(std::max(mask.size(), (end - 1) / 64 + 1));
+    for (auto index = begin; index < end; index++) {
+        mask[index / 64] |= std::uint64_t(1) << (index % 64);
+    }
+}
+
+
+bool
+test_bit(std::vector<std::uint64_t> const& mask, std::size_t index)
+{
+    auto const word = index / 64;
+    return word < mask.size() && (mask[word] >> (index % 64) & 1);
+}
+
+
+// Comparisons are written so that NaN fails them.
+bool
+all_positive(std::vector<double> const& values)
+{
+    return std::all_of(values.begin(), values.end(), [](double value) { return value > 0; });
+}
+
+
+// Appends an optional field of the index-th arrow to a lazily allocated
+// column. Columns stay empty until some arrow has the field.
+template<typename T, typename U, typename F>
+void
+push_optional(
+    std::vector<T>& column,
+    std::vector<std::uint64_t>& mask,
+    std::size_t index,
+    std::optional<U> const& value,
+    F convert
 )
+{
+    if (!value && column.empty()) {
+        return;
+    }
+    if (column.size() < index) {
+        column.resize(index);
+    }
+    if (value) {
+        column.push_back(convert(*value));
+        set_bit(mask, index);
+    } else {
+        column.push_back(T{});
+    }
+}
 
 
-JSONCONS_N_MEMBER_TRAITS(
-    quiver_spec,
+// Appends decoded values to a column. Values of the stored type are moved
+// into an empty column; others are converted.
+template<typename T, typename U>
+void
+append_column(std::vector<T>& column, std::vector<U>&& values)
+{
+    if constexpr (std::is_same_v<T, U>) {
+        if (column.empty()) {
+            column = std::move(values);
+            return;
+        }
+    }
+    column.insert(column.end(), values.begin(), values.end());
+}
 
-    // Required fields
-    0,
 
-    // Optional fields
-    rendering,
-    style,
-    arrows
+// Appends an optional field of count arrows of another store from the
+// index-th on, with the bits telling which arrows have the field.
+template<typename T>
+void
+append_masked(
+    std::vector<T>& column,
+    std::vector<std::uint64_t>& mask,
+    std::size_t index,
+    std::size_t count,
+    std::vector<T> const& values,
+    std::vector<std::uint64_t> const& values_mask
 )
+{
+    if (values.empty()) {
+        if (!column.empty()) {
+            column.resize(index + count);
+        }
+        return;
+    }
+    column.resize(index);
+    column.insert(column.end(), values.begin(), values.end());
+    column.resize(index + count);
 
+    for (std::size_t i = 0; i < count; i++) {
+        if (test_bit(values_mask, i)) {
+            set_bit(mask, index + i);
+        }
+    }
+}
 
-quiver_spec
-parse_quiver_spec(std::string const& str)
+
+// Appends an optional field of count arrows from the index-th on, like
+// push_optional(). Empty values mean that the arrows do not have the field.
+template<typename T, typename U>
+void
+append_optional(
+    std::vector<T>& column,
+    std::vector<std::uint64_t>& mask,
+    std::size_t index,
+    std::size_t count,
+    std::vector<U>&& values
+)
 {
-    return jsoncons::decode_json<quiver_spec>(str);
+    if (values.empty()) {
+        if (!column.empty()) {
+            column.resize(index + count);
+        }
+        return;
+    }
+    if (column.size() < index) {
+        column.resize(index);
+    }
+    append_column(column, std::move(values));
+    set_bits(mask, index, index + count);
 }
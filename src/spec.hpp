@@ -1,7 +1,12 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <functional>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 
@@ -21,22 +26,80 @@ struct color_spec
 };
 
 
+struct aggregate_spec
+{
+    int                        cells = 0;
+    std::optional<std::string> width;
+    std::optional<std::string> color;
+};
+
+
+// Map tiles of a square over the plot range, 2^z by 2^z tiles at zoom z.
+struct pyramid_spec
+{
+    int                levels = 0;
+    std::optional<int> tile_size;
+};
+
+
+// Quantization of arrows drawn from pre-rasterized sprites.
+struct sprite_spec
+{
+    std::optional<int>    angles;
+    std::optional<double> length_step;
+    std::optional<int>    subpixels;
+    std::optional<double> max_size;
+    std::optional<double> cache_size;
+};
+
+
+// Band of image rows rendered by one of count processes. Band index holds the
+// rows from height * index / count up to height * (index + 1) / count.
+struct partition_spec
+{
+    int index = 0;
+    int count = 0;
+};
+
+
 struct rendering_spec
 {
-    std::optional<double>      pixels_per_length;
-    std::optional<range_spec>  x_range;
-    std::optional<range_spec>  y_range;
-    std::optional<std::string> output;
+    std::optional<double>         pixels_per_length;
+    std::optional<range_spec>     x_range;
+    std::optional<range_spec>     y_range;
+    std::optional<std::string>    output;
+    std::optional<int>            threads;
+    std::optional<std::string>    order;
+    std::optional<int>            tile_size;
+    std::optional<std::string>    format;
+    std::optional<int>            compression;
+    std::optional<double>         dot_size;
+    std::optional<aggregate_spec> aggregate;
+    std::optional<pyramid_spec>   pyramid;
+    std::optional<partition_spec> partition;
+    std::optional<sprite_spec>    sprites;
+};
+
+
+// Built-in colormap by name, or evenly spaced colors of a custom colormap.
+struct colormap_spec
+{
+    std::string             name;
+    std::vector<color_spec> colors;
 };
 
 
 struct style_spec
 {
-    std::optional<color_spec> background_color;
-    std::optional<color_spec> arrow_color;
-    std::optional<double>     shaft_width;
-    std::optional<double>     stem_to_shaft_ratio;
-    std::optional<double>     head_aspect_ratio;
+    std::optional<color_spec>              background_color;
+    std::optional<color_spec>              arrow_color;
+    std::optional<double>                  shaft_width;
+    std::optional<double>                  stem_to_shaft_ratio;
+    std::optional<double>                  head_aspect_ratio;
+    std::optional<std::vector<color_spec>> palette;
+    std::optional<colormap_spec>           colormap;
+    std::optional<std::string>             color_by;
+    std::optional<range_spec>              color_limits;
 };
 
 
@@ -49,15 +112,169 @@ struct arrow_spec
     std::optional<double>     w;
     std::optional<double>     a;
     std::optional<color_spec> c;
+    std::optional<double>     s;
+
+    // Index into the palette of the style, given in place of c
+    std::optional<std::uint32_t> palette_index;
+};
+
+
+// Arrows given as parallel arrays of their fields. Optional fields are empty
+// if no arrow has them. Colors are packed, or are palette indices if
+// c_indexed is set.
+struct arrow_columns
+{
+    std::vector<double>        x;
+    std::vector<double>        y;
+    std::vector<double>        dx;
+    std::vector<double>        dy;
+    std::vector<double>        w;
+    std::vector<double>        a;
+    std::vector<std::uint32_t> c;
+    std::vector<double>        s;
+    bool                       c_indexed = false;
+};
+
+
+// Type of the real fields of stored arrows. Building with
+// QUIVER_FLOAT32_ARROWS halves the memory of arrows, keeping about seven
+// significant digits of each value.
+#ifdef QUIVER_FLOAT32_ARROWS
+using arrow_real = float;
+#else
+using arrow_real = double;
+#endif
+
+
+// Columnar storage of arrows. Each field is kept in its own contiguous array.
+// Optional fields are allocated on first use and paired with a bitmap that
+// tells which arrows have the field. Colors are packed as 0xAARRGGBB. Palette
+// indices are held in the color column until resolve_palette() replaces them
+// with colors.
+class arrow_store
+{
+public:
+    std::size_t size() const;
+    bool        empty() const;
+    void        clear();
+    void        reserve(std::size_t capacity);
+    void        push_back(arrow_spec const& arrow);
+    void        append(arrow_columns&& columns);
+    void        append(arrow_store const& other);
+    arrow_spec  get(std::size_t index) const;
+    bool        equal(std::size_t index, arrow_store const& other, std::size_t other_index) const;
+    void        resolve_palette(std::vector<std::uint32_t> const& palette);
+
+    arrow_real const* x() const;
+    arrow_real const* y() const;
+    arrow_real const* dx() const;
+    arrow_real const* dy() const;
+
+    // These return null if no arrow has the field.
+    arrow_real const*    width() const;
+    arrow_real const*    aspect() const;
+    std::uint32_t const* color() const;
+    arrow_real const*    scalar() const;
+
+    bool has_width(std::size_t index) const;
+    bool has_aspect(std::size_t index) const;
+    bool has_color(std::size_t index) const;
+    bool has_scalar(std::size_t index) const;
+
+private:
+    std::vector<arrow_real>    _x;
+    std::vector<arrow_real>    _y;
+    std::vector<arrow_real>    _dx;
+    std::vector<arrow_real>    _dy;
+    std::vector<arrow_real>    _width;
+    std::vector<arrow_real>    _aspect;
+    std::vector<std::uint32_t> _color;
+    std::vector<arrow_real>    _scalar;
+    std::vector<std::uint64_t> _width_mask;
+    std::vector<std::uint64_t> _aspect_mask;
+    std::vector<std::uint64_t> _color_mask;
+    std::vector<std::uint64_t> _scalar_mask;
+    std::vector<std::uint64_t> _palette_mask;
+};
+
+
+// Arrows of one frame of an animation.
+struct frame_spec
+{
+    arrow_store arrows;
 };
 
 
 struct quiver_spec
 {
-    rendering_spec          rendering;
-    style_spec              style;
-    std::vector<arrow_spec> arrows;
+    rendering_spec              rendering;
+    style_spec                  style;
+    arrow_store                 arrows;
+    std::vector<frame_spec>     frames;
+    std::vector<rendering_spec> renders; // Overrides of rendering, one per image
+};
+
+
+// Sequence of arrows delivered in chunks. scan() may be called any number of
+// times and visits the same arrows in the same order each time.
+class arrow_source
+{
+public:
+    using chunk_handler = std::function<void(arrow_store const&)>;
+
+    virtual                    ~arrow_source() = default;
+    virtual void               scan(chunk_handler const& handler) = 0;
+
+    // All arrows as a single store if they are held in memory, or null if
+    // they are produced on each scan.
+    virtual arrow_store const* resident() const { return nullptr; }
+};
+
+
+// Encoding of a spec file. CBOR and MessagePack specs have the structure of
+// JSON specs.
+enum class spec_format
+{
+    json,
+    cbor,
+    msgpack,
+    raw,     // Raw arrow columns, see raw_arrows.hpp
+};
+
+
+// Reads a JSON, CBOR or MessagePack spec file incrementally. rendering and
+// style are decoded on construction, and arrows are decoded on each scan in
+// chunks of bounded size. Input that cannot be rewound is spilled to a
+// temporary file first.
+class quiver_spec_reader : public arrow_source
+{
+public:
+    static constexpr std::size_t default_chunk_size = 65536;
+
+    explicit quiver_spec_reader(std::string const& filename, std::size_t chunk_size = default_chunk_size);
+
+    rendering_spec& rendering();
+    style_spec&     style();
+    void            scan(chunk_handler const& handler) override;
+
+private:
+    std::ifstream              _file;
+    spec_format                _format = spec_format::json;
+    std::size_t                _chunk_size;
+    rendering_spec             _rendering;
+    style_spec                 _style;
+    std::vector<std::uint32_t> _palette;
 };
 
 
-quiver_spec parse_quiver_spec(std::string const& str);
+spec_format                guess_spec_format(std::string const& filename, std::string_view head);
+quiver_spec                parse_quiver_spec(
+    std::string_view data,
+    unsigned threads = 1,
+    spec_format format = spec_format::json
+);
+bool                       same_settings(quiver_spec const& a, quiver_spec const& b);
+rendering_spec             merge_rendering(rendering_spec const& base, rendering_spec const& overrides);
+std::uint32_t              pack_color(color_spec const& color);
+color_spec                 unpack_color(std::uint32_t packed);
+std::vector<std::uint32_t> pack_palette(style_spec const& style);
@@ -0,0 +1,356 @@
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <blend2d.h>
+
+#include "geometry.hpp"
+#include "sprite_cache.hpp"
+
+
+constexpr double two_pi = 6.283185307179586;
+
+// Tails farther than this from the image are not drawn from sprites, so that
+// pixel positions fit in int.
+constexpr double max_sprite_coordinate = 1e9;
+
+// Sprites larger than this along either axis are not cached, so that the
+// first and last pixels of rows fit in a byte.
+constexpr int max_sprite_size = 255;
+
+// Slots of the table when the first sprite is cached. The table is kept at
+// most half full.
+constexpr std::size_t initial_slot_count = 1024;
+
+
+static std::size_t   hash_key(std::uint64_t key);
+static std::int64_t  floor_divide(std::int64_t value, std::int64_t divisor);
+static std::uint32_t premultiply_color(std::uint32_t color);
+static std::uint32_t scale_pixel(std::uint32_t pixel, std::uint32_t factor);
+
+
+void
+sprite_cache::reset(arrow_shape const& shape, sprite_options const& options)
+{
+    auto const same_shape =
+        shape.shaft_width == _shape.shaft_width &&
+        shape.stem_to_shaft_ratio == _shape.stem_to_shaft_ratio &&
+        shape.head_aspect_ratio == _shape.head_aspect_ratio;
+    auto const same_options =
+        options.angles == _options.angles &&
+        options.length_step == _options.length_step &&
+        options.subpixels == _options.subpixels &&
+        options.max_length == _options.max_length &&
+        options.max_bytes == _options.max_bytes;
+
+    // Sprites cover arrows whose bounding box fits in twice the longest
+    // length, as neither the shaft nor the head is wider than that length.
+    auto const width = shape.shaft_width * std::max(shape.stem_to_shaft_ratio, 1.0);
+    _enabled = options.angles > 0 && width <= options.max_length;
+
+    if (!same_shape || !same_options) {
+        _slots.clear();
+        _count = 0;
+        _data.clear();
+        _full = false;
+    }
+    _shape = shape;
+    _options = options;
+}
+
+
+sprite_cache::sprite const*
+sprite_cache::find(BLPoint const& tail, BLPoint const& vector, BLPointI& position)
+{
+    if (!_enabled) {
+        return nullptr;
+    }
+
+    // Comparisons are written so that NaN fails them.
+    auto const length = std::hypot(vector.x, vector.y);
+    if (!(length <= _options.max_length)) {
+        return nullptr;
+    }
+    if (!(std::abs(tail.x) < max_sprite_coordinate && std::abs(tail.y) < max_sprite_coordinate)) {
+        return nullptr;
+    }
+
+    auto const angles = _options.angles;
+    auto const subpixels = _options.subpixels;
+    auto const length_steps = std::lround(length / _options.length_step);
+    auto const angle_steps = (std::lround(std::atan2(vector.y, vector.x) / two_pi * angles) % angles + angles) % angles;
+
+    auto const tail_x = std::llround(tail.x * subpixels);
+    auto const tail_y = std::llround(tail.y * subpixels);
+    auto const pixel_x = floor_divide(tail_x, subpixels);
+    auto const pixel_y = floor_divide(tail_y, subpixels);
+    auto const subpixel_x = tail_x - pixel_x * subpixels;
+    auto const subpixel_y = tail_y - pixel_y * subpixels;
+
+    auto const key =
+        std::uint64_t(length_steps) << 32 | std::uint64_t(angle_steps) << 16 |
+        std::uint64_t(subpixel_x) << 8 | std::uint64_t(subpixel_y);
+    auto const offset = BLPoint{double(subpixel_x) / subpixels, double(subpixel_y) / subpixels};
+    auto const found = lookup(key, double(length_steps) * _options.length_step, two_pi * double(angle_steps) / angles, offset);
+    if (found) {
+        position = BLPointI{int(pixel_x) + found->x0, int(pixel_y) + found->y0};
+    }
+    return found;
+}
+
+
+// Source over with the premultiplied color scaled by the coverage.
+void
+sprite_cache::draw(
+    BLImageData const& image,
+    BLBoxI const& clip,
+    sprite const& drawn,
+    BLPointI const& position,
+    std::uint32_t color
+) const
+{
+    auto const x0 = position.x;
+    auto const y0 = position.y;
+    auto const clip_x0 = std::max(clip.x0, 0) - x0;
+    auto const clip_x1 = std::min(clip.x1, image.size.w) - x0;
+    auto const clip_y0 = std::max(clip.y0, 0) - y0;
+    auto const clip_y1 = std::min(clip.y1, image.size.h) - y0;
+
+    auto const source = premultiply_color(color);
+    auto const opaque = (source >> 24) == 0xFF;
+
+    auto const spans = _data.data() + drawn.data;
+    auto coverage = spans + 2 * std::size_t(drawn.height);
+
+    for (int row = 0; row < drawn.height; row++) {
+        int const first = spans[2 * row];
+        int const last = spans[2 * row + 1];
+        auto const row_coverage = coverage;
+        coverage += last - first;
+
+        if (row < clip_y0 || row >= clip_y1) {
+            continue;
+        }
+
+        auto const begin = std::max(first, clip_x0);
+        auto const end = std::min(last, clip_x1);
+        auto const pixels = reinterpret_cast<std::uint32_t*>(
+            static_cast<unsigned char*>(image.pixelData) + std::ptrdiff_t(y0 + row) * image.stride
+        );
+
+        for (int x = begin; x < end; x++) {
+            auto const mask = std::uint32_t(row_coverage[x - first]);
+            auto& pixel = pixels[x0 + x];
+            if (mask == 0xFF && opaque) {
+                pixel = source;
+            } else if (mask != 0) {
+                auto const scaled = scale_pixel(source, mask);
+                pixel = scaled + scale_pixel(pixel, 0xFF - (scaled >> 24));
+            }
+        }
+    }
+}
+
+
+// Returns the sprite of the key, rasterizing it on first use. Returns null
+// once the cache is full.
+sprite_cache::sprite const*
+sprite_cache::lookup(std::uint64_t key, double length, double angle, BLPoint const& offset)
+{
+    if (_slots.empty()) {
+        if (initial_slot_count * sizeof(slot) > _options.max_bytes) {
+            _full = true;
+            return nullptr;
+        }
+        rehash(initial_slot_count);
+    }
+
+    auto index = find_slot(key);
+    if (_slots[index].key == key) {
+        return &_slots[index].drawn;
+    }
+    if (_full) {
+        return nullptr;
+    }
+
+    if (2 * (_count + 1) > _slots.size()) {
+        if (memory() + _slots.size() * sizeof(slot) > _options.max_bytes) {
+            _full = true;
+            return nullptr;
+        }
+        rehash(2 * _slots.size());
+        index = find_slot(key);
+    }
+
+    sprite drawn;
+    auto const data_size = _data.size();
+    if (!rasterize(drawn, length, angle, offset)) {
+        _data.resize(data_size);
+        return nullptr;
+    }
+    if (memory() > _options.max_bytes) {
+        _data.resize(data_size);
+        _full = true;
+        return nullptr;
+    }
+
+    _slots[index] = slot{key, drawn};
+    _count++;
+    return &_slots[index].drawn;
+}
+
+
+// Fills the outline of the arrow from the tail at the offset, in pixels, and
+// appends the coverage of the pixels its bounding box touches to the data.
+// Returns false if the sprite is too large.
+bool
+sprite_cache::rasterize(sprite& drawn, double length, double angle, BLPoint const& offset)
+{
+    arrow_spec arrow;
+    arrow.x = offset.x;
+    arrow.y = offset.y;
+    arrow.dx = length * std::cos(angle);
+    arrow.dy = length * std::sin(angle);
+    _arrow.clear();
+    _arrow.push_back(arrow);
+    compute_arrow_vertices(_arrow, 0, 1, _shape, _outline);
+
+    BLBox bounds{_outline[0].x, _outline[0].y, _outline[0].x, _outline[0].y};
+    for (auto const& vertex : _outline) {
+        bounds.x0 = std::min(bounds.x0, vertex.x);
+        bounds.y0 = std::min(bounds.y0, vertex.y);
+        bounds.x1 = std::max(bounds.x1, vertex.x);
+        bounds.y1 = std::max(bounds.y1, vertex.y);
+    }
+    auto const x0 = int(std::floor(bounds.x0));
+    auto const y0 = int(std::floor(bounds.y0));
+    auto const width = std::max(int(std::ceil(bounds.x1)) - x0, 1);
+    auto const height = std::max(int(std::ceil(bounds.y1)) - y0, 1);
+    if (width > max_sprite_size || height > max_sprite_size) {
+        return false;
+    }
+
+    if (_canvas.width() < width || _canvas.height() < height) {
+        _canvas = BLImage{std::max(_canvas.width(), width), std::max(_canvas.height(), height), BL_FORMAT_PRGB32};
+    }
+
+    _path.clear();
+    append_arrow_outline(_path, _outline);
+
+    _context.begin(_canvas);
+    _context.clearRect(BLRectI{0, 0, width, height});
+    _context.translate(-x0, -y0);
+    _context.setFillRule(BL_FILL_RULE_NON_ZERO);
+    _context.setFillStyle(BLRgba32{0xFFFFFFFF});
+    _context.fillPath(_path);
+    _context.end();
+
+    BLImageData data;
+    _canvas.getData(&data);
+
+    drawn.data = _data.size();
+    drawn.x0 = static_cast<std::int16_t>(x0);
+    drawn.y0 = static_cast<std::int16_t>(y0);
+    drawn.height = static_cast<std::uint8_t>(height);
+
+    // Rows are trimmed to their first and last covered pixels.
+    _data.resize(drawn.data + 2 * std::size_t(height));
+    for (int y = 0; y < height; y++) {
+        auto const pixels = reinterpret_cast<std::uint32_t const*>(
+            static_cast<unsigned char const*>(data.pixelData) + std::ptrdiff_t(y) * data.stride
+        );
+
+        int first = 0;
+        int last = width;
+        while (first < last && (pixels[first] >> 24) == 0) {
+            first++;
+        }
+        while (last > first && (pixels[last - 1] >> 24) == 0) {
+            last--;
+        }
+        if (first == last) {
+            first = last = 0;
+        }
+
+        _data[drawn.data + 2 * std::size_t(y)] = static_cast<std::uint8_t>(first);
+        _data[drawn.data + 2 * std::size_t(y) + 1] = static_cast<std::uint8_t>(last);
+        for (int x = first; x < last; x++) {
+            _data.push_back(static_cast<std::uint8_t>(pixels[x] >> 24));
+        }
+    }
+    return true;
+}
+
+
+// Returns the slot of the key, or the empty slot where it belongs.
+std::size_t
+sprite_cache::find_slot(std::uint64_t key) const
+{
+    auto const mask = _slots.size() - 1;
+    auto index = hash_key(key) & mask;
+    while (_slots[index].key != key && _slots[index].key != slot{}.key) {
+        index = (index + 1) & mask;
+    }
+    return index;
+}
+
+
+// Moves the sprites to a table of the given power of two size.
+void
+sprite_cache::rehash(std::size_t size)
+{
+    auto slots = std::move(_slots);
+    _slots.assign(size, slot{});
+    for (auto const& filled : slots) {
+        if (filled.key != slot{}.key) {
+            _slots[find_slot(filled.key)] = filled;
+        }
+    }
+}
+
+
+std::size_t
+sprite_cache::memory() const
+{
+    return _data.size() + _slots.size() * sizeof(slot);
+}
+
+
+// Mixes the bits of the key, as keys differ mostly in their high bits.
+std::size_t
+hash_key(std::uint64_t key)
+{
+    auto const mixed = key * 0x9E3779B97F4A7C15;
+    return std::size_t(mixed ^ mixed >> 32);
+}
+
+
+std::int64_t
+floor_divide(std::int64_t value, std::int64_t divisor)
+{
+    auto const quotient = value / divisor;
+    return quotient * divisor > value ? quotient - 1 : quotient;
+}
+
+
+// Converts a packed 0xAARRGGBB color to premultiplied PRGB32.
+std::uint32_t
+premultiply_color(std::uint32_t color)
+{
+    return scale_pixel(color | 0xFF000000, color >> 24);
+}
+
+
+// Multiplies all four channels of a pixel by factor / 255, rounded.
+std::uint32_t
+scale_pixel(std::uint32_t pixel, std::uint32_t factor)
+{
+    auto rb = (pixel & 0x00FF00FF) * factor + 0x00800080;
+    auto ag = (pixel >> 8 & 0x00FF00FF) * factor + 0x00800080;
+    rb = (rb + (rb >> 8 & 0x00FF00FF)) >> 8 & 0x00FF00FF;
+    ag = (ag + (ag >> 8 & 0x00FF00FF)) & 0xFF00FF00;
+    return rb | ag;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <blend2d.h>
+
+#include "geometry.hpp"
+
+
+// Quantization of arrows drawn from sprites. Zero angles disables sprites.
+struct sprite_options
+{
+    int         angles      = 0; // Directions per full turn
+    double      length_step = 0; // Pixels per step of length
+    int         subpixels   = 0; // Tail positions per pixel along each axis
+    double      max_length  = 0; // Longest arrow drawn from a sprite, in pixels
+    std::size_t max_bytes   = 0; // Memory of the sprites in the cache
+};
+
+
+// Coverage masks of arrows rasterized once and composited with the color of
+// each arrow drawn. Arrows are quantized in pixel coordinates: the length to
+// a multiple of the length step, the direction to one of the angles, and the
+// tail to a subpixel position, so that the many arrows of a dense plot share
+// a few sprites. Overlapping arrows are composited one by one rather than
+// filled as a union. Sprites are kept across plots of the same shape and
+// options; the cache is not thread safe.
+//
+// Sprites are packed in a single buffer and indexed by an open-addressing
+// table, so that drawing an arrow touches two places in memory rather than
+// the nodes and arrays of a map.
+class sprite_cache
+{
+public:
+    // Rows of pixels from (x0, y0), relative to the pixel of the tail. The
+    // data of the sprite holds the first and last pixel plus one of each row,
+    // then the coverage of the pixels between them row by row.
+    struct sprite
+    {
+        std::size_t  data   = 0;
+        std::int16_t x0     = 0;
+        std::int16_t y0     = 0;
+        std::uint8_t height = 0;
+    };
+
+    // Sets the shape of arrows in pixels, dropping sprites of another shape.
+    void reset(arrow_shape const& shape, sprite_options const& options);
+
+    // Returns the sprite of the arrow with its tail at the given pixel
+    // position, and the position of the top left pixel of the sprite in the
+    // image. Returns null if the arrow is too long or its sprite does not fit
+    // in the cache. The sprite is valid until the next call.
+    sprite const* find(BLPoint const& tail, BLPoint const& vector, BLPointI& position);
+
+    // Composites the sprite in the color onto the premultiplied image, within
+    // the clip box.
+    void draw(
+        BLImageData const& image,
+        BLBoxI const& clip,
+        sprite const& drawn,
+        BLPointI const& position,
+        std::uint32_t color
+    ) const;
+
+private:
+    // Slots without a sprite have all bits of the key set.
+    struct slot
+    {
+        std::uint64_t key = ~std::uint64_t(0);
+        sprite        drawn;
+    };
+
+    sprite const* lookup(std::uint64_t key, double length, double angle, BLPoint const& offset);
+    bool          rasterize(sprite& drawn, double length, double angle, BLPoint const& offset);
+    std::size_t   find_slot(std::uint64_t key) const;
+    void          rehash(std::size_t size);
+    std::size_t   memory() const;
+
+private:
+    arrow_shape               _shape;
+    sprite_options            _options;
+    bool                      _enabled = false;
+    std::vector<slot>         _slots;
+    std::size_t               _count = 0;
+    std::vector<std::uint8_t> _data;
+    bool                      _full = false;
+
+    // Scratch buffers for rasterizing sprites
+    arrow_store _arrow;
+    BLPoint     _outline[arrow_vertex_count];
+    BLPath      _path;
+    BLImage     _canvas;
+    BLContext   _context;
+};